@@ -0,0 +1,535 @@
+#include "OpenCanvas.h"
+
+#include <ctime>
+#include <regex>
+#include <cstring>
+#include <cstdlib>
+
+// Performance suite for the canvas core, built optimised by `make bench`.
+// Flags follow Google Benchmark: --benchmark_filter=<regex>, --benchmark_format=console|json|csv,
+// --benchmark_min_time=<seconds>, plus --max_shapes=<n> to cap the canvas sizes (1k to 1M).
+// Every case reports time per iteration and shapes processed per second
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Harness
+
+class BenchmarkState {
+private:
+    size_t range;
+    size_t iterations;
+    size_t items = 0;
+    bool paused = false;
+    std::chrono::steady_clock::time_point started;
+    std::clock_t cpuStarted;
+    double realSeconds = 0;
+    double cpuSeconds = 0;
+
+    friend class BenchmarkRunner;
+
+public:
+    BenchmarkState(size_t range, size_t iterations) : range(range), iterations(iterations), cpuStarted(0) {}
+
+    size_t getRange() const { return range; }
+    size_t getIterations() const { return iterations; }
+    void setItemsProcessed(size_t count) { items = count; }
+
+    // Setup and teardown inside the loop go between these so only the operation is timed
+    void pauseTiming() {
+        realSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        cpuSeconds += double(std::clock() - cpuStarted) / CLOCKS_PER_SEC;
+        paused = true;
+    }
+    void resumeTiming() {
+        paused = false;
+        started = std::chrono::steady_clock::now();
+        cpuStarted = std::clock();
+    }
+};
+
+typedef void (*BenchmarkFunction)(BenchmarkState&);
+
+struct Benchmark {
+    std::string name;
+    BenchmarkFunction function;
+    std::vector<size_t> ranges;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    size_t iterations;
+    double realNanos; // per iteration
+    double cpuNanos;
+    double itemsPerSecond;
+};
+
+class BenchmarkRunner {
+private:
+    std::vector<Benchmark> benchmarks;
+
+    static BenchmarkResult runOnce(const Benchmark& benchmark, size_t range, size_t iterations) {
+        BenchmarkState state(range, iterations);
+        state.resumeTiming();
+        benchmark.function(state);
+        if (!state.paused) {
+            state.pauseTiming();
+        }
+
+        BenchmarkResult result;
+        result.name = benchmark.name + "/" + std::to_string(range);
+        result.iterations = iterations;
+        result.realNanos = state.realSeconds * 1e9 / double(iterations);
+        result.cpuNanos = state.cpuSeconds * 1e9 / double(iterations);
+        result.itemsPerSecond = state.items == 0 || state.realSeconds <= 0 ? 0 : double(state.items) / state.realSeconds;
+        return result;
+    }
+
+public:
+    void add(const std::string& name, BenchmarkFunction function, const std::vector<size_t>& ranges) {
+        Benchmark benchmark;
+        benchmark.name = name;
+        benchmark.function = function;
+        benchmark.ranges = ranges;
+        benchmarks.push_back(benchmark);
+    }
+
+    // Doubles the iteration count until a run takes at least minSeconds, keeping the last run
+    std::vector<BenchmarkResult> run(const std::regex& filter, double minSeconds, size_t maxRange,
+                                     std::function<void(const BenchmarkResult&)> report) const {
+        std::vector<BenchmarkResult> results;
+        for (size_t b = 0; b < benchmarks.size(); ++b) {
+            for (size_t r = 0; r < benchmarks[b].ranges.size(); ++r) {
+                size_t range = benchmarks[b].ranges[r];
+                if (range > maxRange || !std::regex_search(benchmarks[b].name + "/" + std::to_string(range), filter)) {
+                    continue;
+                }
+                size_t iterations = 1;
+                BenchmarkResult result;
+                for (;;) {
+                    result = runOnce(benchmarks[b], range, iterations);
+                    double seconds = result.realNanos * double(iterations) / 1e9;
+                    if (seconds >= minSeconds || iterations >= (size_t(1) << 30)) {
+                        break;
+                    }
+                    // Aim past the minimum directly once a run has taken measurable time
+                    size_t next = seconds > minSeconds / 100 ? size_t(double(iterations) * 1.4 * minSeconds / seconds) : iterations * 10;
+                    iterations = std::max(iterations * 2, next);
+                }
+                results.push_back(result);
+                report(result);
+            }
+        }
+        return results;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Fixtures
+
+// Deterministic shapes spread over a 2000 x 2000 area, a third of each kind
+static std::vector<Shape*> makeShapes(size_t count) {
+    static const char* colours[] = { "red", "green", "blue", "black", "yellow", "purple" };
+    std::vector<Shape*> shapes;
+    shapes.reserve(count);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < count; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        int x = int(seed >> 8) % 2000;
+        int y = int(seed >> 16) % 2000;
+        int size = 1 + int(seed >> 4) % 40;
+        const char* colour = colours[i % 6];
+        switch (i % 3) {
+        case 0: shapes.push_back(new Rectangle(size, size / 2 + 1, colour, x, y)); break;
+        case 1: shapes.push_back(new Square(size, colour, x, y)); break;
+        default: shapes.push_back(new Textbox(size, size / 2 + 1, colour, x, y, "label " + std::to_string(i))); break;
+        }
+    }
+    return shapes;
+}
+
+static void fillCanvas(Canvas& canvas, size_t count) {
+    std::vector<Shape*> shapes = makeShapes(count);
+    canvas.addShapes(shapes);
+}
+
+static void releaseAll(std::vector<Shape*>& shapes) {
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        shapes[i]->release();
+    }
+    shapes.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Cases
+
+static void benchAddShape(BenchmarkState& state) {
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        state.pauseTiming();
+        Canvas* canvas = new Canvas();
+        std::vector<Shape*> shapes = makeShapes(state.getRange());
+        state.resumeTiming();
+        for (size_t s = 0; s < shapes.size(); ++s) {
+            canvas->addShape(shapes[s]);
+        }
+        state.pauseTiming();
+        delete canvas;
+        state.resumeTiming();
+    }
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchAddShapes(BenchmarkState& state) {
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        state.pauseTiming();
+        Canvas* canvas = new Canvas();
+        std::vector<Shape*> shapes = makeShapes(state.getRange());
+        state.resumeTiming();
+        canvas->addShapes(shapes);
+        state.pauseTiming();
+        delete canvas;
+        state.resumeTiming();
+    }
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void captureWith(BenchmarkState& state, SnapshotMode mode, unsigned threads = 0) {
+    state.pauseTiming();
+    Canvas canvas;
+    canvas.setSnapshotMode(mode);
+    canvas.setSnapshotThreads(threads);
+    fillCanvas(canvas, state.getRange());
+    delete canvas.captureCurrent(); // shared mode: later captures reuse the twins
+    state.resumeTiming();
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        Memento* memento = canvas.captureCurrent();
+        state.pauseTiming();
+        delete memento;
+        state.resumeTiming();
+    }
+    state.pauseTiming();
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchCaptureDeep(BenchmarkState& state) {
+    captureWith(state, SnapshotMode::DeepCopy);
+}
+
+static void benchCaptureDeepSerial(BenchmarkState& state) {
+    captureWith(state, SnapshotMode::DeepCopy, 1);
+}
+
+static void benchCaptureShared(BenchmarkState& state) {
+    captureWith(state, SnapshotMode::Shared);
+}
+
+// Moves every shape, so the undo that follows has each of them to put back. Without it
+// every undo after the first finds the canvas already matching and keeps all the shapes
+static void editAll(Canvas& canvas, size_t step) {
+    std::vector<Shape*> shapes = canvas.getShapes();
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        shapes[i]->setPositionX(static_cast<int>(step + 1));
+    }
+}
+
+static void undoWith(BenchmarkState& state, SnapshotMode mode) {
+    state.pauseTiming();
+    Canvas canvas;
+    canvas.setSnapshotMode(mode);
+    fillCanvas(canvas, state.getRange());
+    Memento* memento = canvas.captureCurrent();
+    state.resumeTiming();
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        state.pauseTiming();
+        editAll(canvas, i);
+        state.resumeTiming();
+        canvas.undoAction(memento);
+    }
+    state.pauseTiming();
+    delete memento;
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchUndoDeep(BenchmarkState& state) {
+    undoWith(state, SnapshotMode::DeepCopy);
+}
+
+static void benchUndoShared(BenchmarkState& state) {
+    undoWith(state, SnapshotMode::Shared);
+}
+
+// Undo that consumes the memento, as CareTaker::undoState() does; a fresh capture each time
+static void moveUndoWith(BenchmarkState& state, SnapshotMode mode) {
+    state.pauseTiming();
+    Canvas canvas;
+    canvas.setSnapshotMode(mode);
+    fillCanvas(canvas, state.getRange());
+    state.resumeTiming();
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        state.pauseTiming();
+        std::unique_ptr<Memento> memento(canvas.captureCurrent());
+        editAll(canvas, i);
+        state.resumeTiming();
+        canvas.undoAction(std::move(memento));
+    }
+    state.pauseTiming();
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchMoveUndoDeep(BenchmarkState& state) {
+    moveUndoWith(state, SnapshotMode::DeepCopy);
+}
+
+static void benchMoveUndoShared(BenchmarkState& state) {
+    moveUndoWith(state, SnapshotMode::Shared);
+}
+
+// The range is the size of the saved canvas; push and pop should not depend on it
+static void benchCareTakerPushPop(BenchmarkState& state) {
+    state.pauseTiming();
+    Canvas canvas;
+    fillCanvas(canvas, state.getRange());
+    CareTaker caretaker;
+    Memento* memento = canvas.captureCurrent();
+    state.resumeTiming();
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        caretaker.addMemento(memento);
+        memento = caretaker.getLastMemento();
+    }
+    state.pauseTiming();
+    delete memento;
+    state.setItemsProcessed(state.getIterations());
+}
+
+static void cloneEach(BenchmarkState& state, const Shape& prototype) {
+    std::vector<Shape*> clones;
+    clones.reserve(state.getRange());
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        for (size_t c = 0; c < state.getRange(); ++c) {
+            clones.push_back(prototype.clone());
+        }
+        state.pauseTiming();
+        releaseAll(clones);
+        state.resumeTiming();
+    }
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchCloneRectangle(BenchmarkState& state) {
+    Rectangle prototype(10, 5, "red", 1, 2);
+    cloneEach(state, prototype);
+}
+
+static void benchCloneSquare(BenchmarkState& state) {
+    Square prototype(10, "blue", 1, 2);
+    cloneEach(state, prototype);
+}
+
+static void benchCloneTextbox(BenchmarkState& state) {
+    Textbox prototype(10, 5, "black", 1, 2, "a benchmark label");
+    cloneEach(state, prototype);
+}
+
+// createShape() is public on the concrete factories only
+template <typename Factory>
+static void createEach(BenchmarkState& state) {
+    Factory factory;
+    std::vector<Shape*> created;
+    created.reserve(state.getRange());
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        for (size_t c = 0; c < state.getRange(); ++c) {
+            created.push_back(factory.createShape());
+        }
+        state.pauseTiming();
+        releaseAll(created);
+        state.resumeTiming();
+    }
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchCreateRectangle(BenchmarkState& state) {
+    createEach<RectangleFactory>(state);
+}
+
+static void benchCreateSquare(BenchmarkState& state) {
+    createEach<SquareFactory>(state);
+}
+
+static void benchCreateTextbox(BenchmarkState& state) {
+    createEach<TextboxFactory>(state);
+}
+
+static void benchCreateBatch(BenchmarkState& state) {
+    RectangleFactory factory;
+    ShapeBatch batch;
+    batch.count = state.getRange();
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        std::vector<Shape*> created = factory.createShapes(batch);
+        state.pauseTiming();
+        releaseAll(created);
+        state.resumeTiming();
+    }
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+// A fresh exporter per iteration, so every export is a full one
+template <typename Exporter>
+static void exportEach(BenchmarkState& state, const char* path) {
+    state.pauseTiming();
+    Canvas canvas;
+    fillCanvas(canvas, state.getRange());
+    state.resumeTiming();
+    for (size_t i = 0; i < state.getIterations(); ++i) {
+        Exporter exporter(&canvas);
+        exporter.setOutputPath(path);
+        exporter.exportCanvas();
+    }
+    state.pauseTiming();
+    std::remove(path);
+    state.setItemsProcessed(state.getIterations() * state.getRange());
+}
+
+static void benchExportPng(BenchmarkState& state) {
+    exportEach<PNGExporter>(state, "bench_canvas.png");
+}
+
+static void benchExportPdf(BenchmarkState& state) {
+    exportEach<PDFExporter>(state, "bench_canvas.pdf");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Reporting
+
+static std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '"' || text[i] == '\\') {
+            escaped += '\\';
+        }
+        escaped += text[i];
+    }
+    return escaped;
+}
+
+static void printConsole(const BenchmarkResult& result) {
+    std::printf("%-40s %15.0f ns %15.0f ns %12zu %14.4g items/s\n", result.name.c_str(), result.realNanos,
+                result.cpuNanos, result.iterations, result.itemsPerSecond);
+}
+
+static void printCsv(const BenchmarkResult& result) {
+    std::printf("\"%s\",%zu,%.2f,%.2f,ns,%.6g\n", result.name.c_str(), result.iterations, result.realNanos,
+                result.cpuNanos, result.itemsPerSecond);
+}
+
+static void printJson(const std::vector<BenchmarkResult>& results, size_t maxRange) {
+    std::time_t now = std::time(NULL);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+    std::printf("{\n  \"context\": {\n");
+    std::printf("    \"date\": \"%s\",\n", date);
+    std::printf("    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+    std::printf("    \"library_build_type\": \"%s\",\n",
+#ifdef NDEBUG
+                "release"
+#else
+                "debug"
+#endif
+    );
+    std::printf("    \"max_shapes\": %zu\n  },\n  \"benchmarks\": [\n", maxRange);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult& result = results[i];
+        std::printf("    {\n      \"name\": \"%s\",\n      \"iterations\": %zu,\n      \"real_time\": %.2f,\n"
+                    "      \"cpu_time\": %.2f,\n      \"time_unit\": \"ns\",\n      \"items_per_second\": %.6g\n    }%s\n",
+                    jsonEscape(result.name).c_str(), result.iterations, result.realNanos, result.cpuNanos,
+                    result.itemsPerSecond, i + 1 < results.size() ? "," : "");
+    }
+    std::printf("  ]\n}\n");
+}
+
+static const char* flagValue(const char* argument, const char* flag) {
+    size_t length = std::strlen(flag);
+    if (std::strncmp(argument, flag, length) == 0 && argument[length] == '=') {
+        return argument + length + 1;
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    std::string filter = ".";
+    std::string format = "console";
+    double minSeconds = 0.2;
+    size_t maxRange = 1000000;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* value;
+        if ((value = flagValue(argv[i], "--benchmark_filter")) != NULL) {
+            filter = value;
+        } else if ((value = flagValue(argv[i], "--benchmark_format")) != NULL) {
+            format = value;
+        } else if ((value = flagValue(argv[i], "--benchmark_min_time")) != NULL) {
+            minSeconds = std::atof(value);
+        } else if ((value = flagValue(argv[i], "--max_shapes")) != NULL) {
+            maxRange = std::strtoul(value, NULL, 10);
+        } else {
+            std::fprintf(stderr, "usage: %s [--benchmark_filter=<regex>] [--benchmark_format=console|json|csv]"
+                                 " [--benchmark_min_time=<seconds>] [--max_shapes=<n>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (format != "console" && format != "json" && format != "csv") {
+        std::fprintf(stderr, "unknown format %s\n", format.c_str());
+        return 1;
+    }
+
+    std::vector<size_t> sizes;
+    sizes.push_back(1000);
+    sizes.push_back(10000);
+    sizes.push_back(100000);
+    sizes.push_back(1000000);
+
+    BenchmarkRunner runner;
+    runner.add("Canvas_addShape", benchAddShape, sizes);
+    runner.add("Canvas_addShapes", benchAddShapes, sizes);
+    runner.add("Canvas_captureCurrent_deep", benchCaptureDeep, sizes);
+    runner.add("Canvas_captureCurrent_deep_serial", benchCaptureDeepSerial, sizes);
+    runner.add("Canvas_captureCurrent_shared", benchCaptureShared, sizes);
+    runner.add("Canvas_undoAction_deep", benchUndoDeep, sizes);
+    runner.add("Canvas_undoAction_shared", benchUndoShared, sizes);
+    runner.add("Canvas_undoAction_move_deep", benchMoveUndoDeep, sizes);
+    runner.add("Canvas_undoAction_move_shared", benchMoveUndoShared, sizes);
+    runner.add("CareTaker_pushPop", benchCareTakerPushPop, sizes);
+    runner.add("Rectangle_clone", benchCloneRectangle, sizes);
+    runner.add("Square_clone", benchCloneSquare, sizes);
+    runner.add("Textbox_clone", benchCloneTextbox, sizes);
+    runner.add("RectangleFactory_createShape", benchCreateRectangle, sizes);
+    runner.add("SquareFactory_createShape", benchCreateSquare, sizes);
+    runner.add("TextboxFactory_createShape", benchCreateTextbox, sizes);
+    runner.add("RectangleFactory_createShapes", benchCreateBatch, sizes);
+    runner.add("PNGExporter_exportCanvas", benchExportPng, sizes);
+    runner.add("PDFExporter_exportCanvas", benchExportPdf, sizes);
+
+    std::regex pattern;
+    try {
+        pattern = std::regex(filter);
+    } catch (const std::regex_error&) {
+        std::fprintf(stderr, "invalid filter %s\n", filter.c_str());
+        return 1;
+    }
+
+    if (format == "console") {
+        std::printf("%-40s %18s %18s %12s %22s\n", "Benchmark", "Time", "CPU", "Iterations", "Throughput");
+    } else if (format == "csv") {
+        std::printf("name,iterations,real_time,cpu_time,time_unit,items_per_second\n");
+    }
+    std::vector<BenchmarkResult> results = runner.run(pattern, minSeconds, maxRange, [&format](const BenchmarkResult& result) {
+        if (format == "console") {
+            printConsole(result);
+        } else if (format == "csv") {
+            printCsv(result);
+        }
+        std::fflush(stdout);
+    });
+    if (format == "json") {
+        printJson(results, maxRange);
+    }
+    return 0;
+}
@@ -1,15 +1,119 @@
 #include "OpenCanvas.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define OPENCANVAS_HAVE_MMAP 1
+#endif
+#include <filesystem>
+#include <cstring>
 //////////////////////////////////////////////////////////////////////////////////////////////////
 // Shape constructors
 //We use shape as part of the Factory Method and the Prototype
 
 
 //default
-Shape::Shape() : length(0), width(0), colour("black"), positionX(0), positionY(0) {}
+Shape::Shape(ShapeKind kind) : length(0), width(0), colour(ColourPalette::global().intern("black")), positionX(0), positionY(0), kind(kind), refs(1), frozen(NULL), id(0), owner(NULL), allocator(NULL) {
+    Metrics::shapesLive.increment();
+}
 
 //normal
-Shape::Shape(int length, int width, std::string colour, int posX, int posY) :
-    length(length), width(width), colour(colour), positionX(posX), positionY(posY) {}
+Shape::Shape(int length, int width, std::string colour, int posX, int posY, ShapeKind kind) :
+    length(length), width(width), colour(ColourPalette::global().intern(colour)), positionX(posX), positionY(posY), kind(kind), refs(1), frozen(NULL), id(0), owner(NULL), allocator(NULL) {
+    Metrics::shapesLive.increment();
+}
+
+//from a palette entry, for batches that already resolved their colours
+Shape::Shape(int length, int width, const ColourEntry* colour, int posX, int posY, ShapeKind kind) :
+    length(length), width(width), colour(colour), positionX(posX), positionY(posY), kind(kind), refs(1), frozen(NULL), id(0), owner(NULL), allocator(NULL) {
+    Metrics::shapesLive.increment();
+}
+
+//copy, the clone starts unshared and off-canvas but keeps the id of the original
+Shape::Shape(const Shape& other) :
+    length(other.length), width(other.width), colour(other.colour),
+    positionX(other.positionX), positionY(other.positionY), kind(other.kind), refs(1), frozen(NULL),
+    id(other.id), owner(NULL), allocator(other.allocator) {
+    Metrics::shapesLive.increment();
+    Metrics::clonesPerformed.increment();
+}
+
+// Assignment copies the attributes only, the shape keeps its own id and canvas. It goes
+// through the setters, so the canvas journals and indexes each change like any other edit
+Shape& Shape::operator=(const Shape& other) {
+    if (this != &other) {
+        if (length != other.length || width != other.width) {
+            setSize(other.length, other.width);
+        }
+        if (colour != other.colour) {
+            assignColour(other.colour);
+        }
+        if (positionX != other.positionX || positionY != other.positionY) {
+            setPosition(other.positionX, other.positionY);
+        }
+    }
+    return *this;
+}
+
+Shape::~Shape() {
+    touch();
+    Metrics::shapesLive.decrement();
+}
+
+// Every shape block starts with a header naming its allocator, so delete needs
+// neither the dynamic type nor the shape's own fields
+struct alignas(16) ShapeBlockHeader {
+    ShapeAllocator* allocator;
+    size_t bytes;
+};
+
+void* Shape::operator new(size_t size) {
+    return Shape::operator new(size, static_cast<ShapeAllocator*>(NULL));
+}
+
+void* Shape::operator new(size_t size, ShapeAllocator* allocator) {
+    if (allocator == NULL) {
+        allocator = ShapeAllocator::getDefault();
+    }
+    size_t bytes = sizeof(ShapeBlockHeader) + size;
+    ShapeBlockHeader* header = static_cast<ShapeBlockHeader*>(allocator->allocate(bytes));
+    header->allocator = allocator;
+    header->bytes = bytes;
+    return header + 1;
+}
+
+void Shape::operator delete(void* block) {
+    if (block == NULL) {
+        return;
+    }
+    ShapeBlockHeader* header = static_cast<ShapeBlockHeader*>(block) - 1;
+    header->allocator->deallocate(header, header->bytes);
+}
+
+// Only reached when a constructor throws
+void Shape::operator delete(void* block, ShapeAllocator*) {
+    Shape::operator delete(block);
+}
+
+void Shape::allocateMany(size_t size, size_t count, ShapeAllocator* allocator, void** blocks) {
+    if (allocator == NULL) {
+        allocator = ShapeAllocator::getDefault();
+    }
+    size_t bytes = sizeof(ShapeBlockHeader) + size;
+    allocator->allocateMany(bytes, count, blocks);
+    for (size_t i = 0; i < count; ++i) {
+        ShapeBlockHeader* header = static_cast<ShapeBlockHeader*>(blocks[i]);
+        header->allocator = allocator;
+        header->bytes = bytes;
+        blocks[i] = header + 1;
+    }
+}
+
+ShapeAllocator* Shape::getAllocator() const {
+    return allocator != NULL ? allocator : ShapeAllocator::getDefault();
+}
 /////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -22,16 +126,127 @@ Shape::Shape(int length, int width, std::string colour, int posX, int posY) :
 // Getters, we added this it wasn't apart of the specs
 int Shape::getLength() const { return length; }
 int Shape::getWidth() const { return width; }
-std::string Shape::getColour() const { return colour; }
+const std::string& Shape::getColour() const { return colour->name; }
+unsigned Shape::getColourId() const { return colour->id; }
+uint32_t Shape::getColourRgba() const { return colour->rgba; }
 int Shape::getPositionX() const { return positionX; }
 int Shape::getPositionY() const { return positionY; }
+unsigned Shape::getId() const { return id; }
+Bounds Shape::getBounds() const { return Bounds::of(positionX, positionY, length, width); }
+
+// Setters, same here. Each one drops the shared twin first so snapshots keep the old values,
+// then tells the owning canvas so the edit can be journaled
+void Shape::setLength(int length) { setSize(length, width); }
+void Shape::setWidth(int width) { setSize(length, width); }
+void Shape::setPositionX(int x) { setPosition(x, positionY); }
+void Shape::setPositionY(int y) { setPosition(positionX, y); }
+
+void Shape::setColour(const std::string& colour) {
+    assignColour(ColourPalette::global().intern(colour));
+}
+
+void Shape::setColourId(unsigned colourId) {
+    const ColourEntry* entry = ColourPalette::global().find(colourId);
+    if (entry != NULL) {
+        assignColour(entry);
+    }
+}
+
+// Recolour records carry palette ids, so journaling a colour change copies no strings
+void Shape::assignColour(const ColourEntry* entry) {
+    touch();
+    const ColourEntry* old = colour;
+    colour = entry;
+    edited(EditKind::Recolour, static_cast<int>(old->id), 0, NULL);
+}
+
+void Shape::setPosition(int x, int y) {
+    touch();
+    int oldX = positionX;
+    int oldY = positionY;
+    positionX = x;
+    positionY = y;
+    edited(EditKind::Move, oldX, oldY, NULL);
+}
+
+void Shape::setSize(int length, int width) {
+    touch();
+    int oldLength = this->length;
+    int oldWidth = this->width;
+    this->length = length;
+    this->width = width;
+    edited(EditKind::Resize, oldLength, oldWidth, NULL);
+}
+
+// Heap bytes a string owns beyond its inline buffer
+size_t Shape::getByteSize() const {
+    return sizeof(Rectangle);
+}
+
+bool Shape::isOnCanvas() const {
+    return owner != NULL;
+}
+
+void Shape::edited(EditKind kind, int oldA, int oldB, const SharedText* oldText) {
+    if (owner != NULL) {
+        owner->onShapeEdit(*this, kind, oldA, oldB, oldText);
+    }
+}
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Structural sharing (copy-on-write snapshots)
+// A live shape keeps a pointer to an immutable twin that every memento taken since its
+// last change shares. Only the first capture after a change pays for a clone.
+
+Shape* Shape::snapshot(bool* created) const {
+    Shape* twin = frozen.load(std::memory_order_acquire);
+    bool fresh = twin == NULL;
+    if (fresh) {
+        twin = cloneShape(*this); // the link itself holds the first reference
+        Shape* linked = NULL;
+        if (!frozen.compare_exchange_strong(linked, twin, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            twin->release(); // another reader linked its twin first
+            twin = linked;
+            fresh = false;
+        }
+    }
+    if (created != NULL) {
+        *created = fresh;
+    }
+    twin->retain();
+    return twin;
+}
+
+// Live copy of a twin that stays linked to it, so capturing straight after a restore is free
+Shape* Shape::thaw() const {
+    Shape* live = cloneShape(*this);
+    retain();
+    live->frozen.store(const_cast<Shape*>(this), std::memory_order_release);
+    return live;
+}
+
+void Shape::retain() const {
+    refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Shape::release() const {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
 
-// Setters, same here
-void Shape::setLength(int length) { this->length = length; }
-void Shape::setWidth(int width) { this->width = width; }
-void Shape::setColour(const std::string& colour) { this->colour = colour; }
-void Shape::setPositionX(int x) { this->positionX = x; }
-void Shape::setPositionY(int y) { this->positionY = y; }
+void Shape::touch() {
+    if (frozen.load(std::memory_order_relaxed) != NULL) {
+        Shape* twin = frozen.exchange(NULL, std::memory_order_acq_rel);
+        if (twin != NULL) {
+            twin->release();
+        }
+    }
+}
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -40,39 +255,135 @@ void Shape::setPositionY(int y) { this->positionY = y; }
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // Rectangle Implementation, which is a concrete product
 
-Rectangle::Rectangle() : Shape() {}
+Rectangle::Rectangle() : Shape(ShapeKind::Rectangle) {}
 
 Rectangle::Rectangle(int length, int width, std::string colour, int posX, int posY) :
     Shape(length, width, colour, posX, posY) {}
 
+Rectangle::Rectangle(int length, int width, const ColourEntry* colour, int posX, int posY) :
+    Shape(length, width, colour, posX, posY, ShapeKind::Rectangle) {}
+
 Shape* Rectangle::clone() const {
-    return new Rectangle(*this); // Creates a new Rectangle with same attributes
+    return new (getAllocator()) Rectangle(*this); // Creates a new Rectangle with same attributes, from the same allocator
 }
 
 // Square Implementation, which is a concrete product
 
-Square::Square() : Shape() {}
+Square::Square() : Shape(ShapeKind::Square) {}
 
 Square::Square(int size, std::string colour, int posX, int posY) :
-    Shape(size, size, colour, posX, posY) {} // Note: length = width for square
+    Shape(size, size, colour, posX, posY, ShapeKind::Square) {} // Note: length = width for square
+
+Square::Square(int size, const ColourEntry* colour, int posX, int posY) :
+    Shape(size, size, colour, posX, posY, ShapeKind::Square) {}
 
 Shape* Square::clone() const {
-    return new Square(*this); // Creates a new Square with same attributes
+    return new (getAllocator()) Square(*this); // Creates a new Square with same attributes, from the same allocator
 }
 
 
 // Textbox Implementation which is a concrete product
-Textbox::Textbox() : Shape(), text("") {}
+Textbox::Textbox() : Shape(ShapeKind::Textbox), text("") {}
 
 Textbox::Textbox(int length, int width, std::string colour, int posX, int posY, std::string text) :
-    Shape(length, width, colour, posX, posY), text(text) {}
+    Shape(length, width, colour, posX, posY, ShapeKind::Textbox), text(text) {}
+
+Textbox::Textbox(int length, int width, const ColourEntry* colour, int posX, int posY, const SharedText& text) :
+    Shape(length, width, colour, posX, posY, ShapeKind::Textbox), text(text) {}
 
 Shape* Textbox::clone() const {
-    return new Textbox(*this); // Creates a new Textbox with same attributes
+    return new (getAllocator()) Textbox(*this); // Creates a new Textbox with same attributes, from the same allocator
+}
+
+std::string Textbox::getText() const { return text.str(); }
+std::string_view Textbox::getTextView() const { return text.view(); }
+const SharedText& Textbox::getSharedText() const { return text; }
+
+size_t Textbox::getByteSize() const {
+    return Shape::getByteSize() + sizeof(Textbox) - sizeof(Rectangle) + text.getHeapBytes();
+}
+
+void Textbox::setText(const std::string& t) {
+    setSharedText(SharedText(t));
+}
+
+void Textbox::setSharedText(const SharedText& t) {
+    touch();
+    if (!isOnCanvas()) {
+        text = t;
+        return;
+    }
+    SharedText old = text; // keeps the old buffer for the journal, no copy of the body
+    text = t;
+    edited(EditKind::SetText, 0, 0, &old);
+}
+
+// Shared text
+
+void SharedText::assign(std::string_view text) {
+    length = text.size();
+    if (isInline()) {
+        std::memcpy(local, text.data(), length);
+        local[length] = '\0';
+        return;
+    }
+    shared = static_cast<Buffer*>(::operator new(offsetof(Buffer, data) + length + 1));
+    new (&shared->refs) std::atomic<size_t>(1);
+    std::memcpy(shared->data, text.data(), length);
+    shared->data[length] = '\0';
+}
+
+void SharedText::drop() {
+    if (!isInline() && shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        shared->refs.~atomic();
+        ::operator delete(shared);
+    }
+}
+
+SharedText::SharedText(const SharedText& other) : length(other.length) {
+    if (isInline()) {
+        std::memcpy(local, other.local, length + 1);
+    } else {
+        shared = other.shared;
+        shared->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+SharedText::SharedText(SharedText&& other) noexcept : length(other.length) {
+    std::memcpy(local, other.local, sizeof(local)); // the characters or the buffer pointer
+    other.length = 0;
+    other.local[0] = '\0';
+}
+
+SharedText& SharedText::operator=(const SharedText& other) {
+    if (this != &other) {
+        SharedText copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+SharedText& SharedText::operator=(SharedText&& other) noexcept {
+    if (this != &other) {
+        drop();
+        length = other.length;
+        std::memcpy(local, other.local, sizeof(local));
+        other.length = 0;
+        other.local[0] = '\0';
+    }
+    return *this;
+}
+
+bool SharedText::isShared() const {
+    return !isInline() && shared->refs.load(std::memory_order_acquire) > 1;
 }
 
-std::string Textbox::getText() const { return text; }
-void Textbox::setText(const std::string& t) { text = t; }
+size_t SharedText::getHeapBytes() const {
+    if (isInline()) {
+        return 0;
+    }
+    return (offsetof(Buffer, data) + length + 1) / shared->refs.load(std::memory_order_relaxed);
+}
 
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -84,7 +395,7 @@ void Textbox::setText(const std::string& t) { text = t; }
 // Factory Implementations
 
 Shape* RectangleFactory::createShape() const {
-    return new Rectangle(); // Creates a default Rectangle
+    return adopt(new (allocator) Rectangle()); // Creates a default Rectangle
 }
 
 std::string RectangleFactory::toString() const {
@@ -92,7 +403,7 @@ std::string RectangleFactory::toString() const {
 }
 
 Shape* SquareFactory::createShape() const {
-    return new Square(); // Creates a default Square
+    return adopt(new (allocator) Square()); // Creates a default Square
 }
 
 std::string SquareFactory::toString() const {
@@ -100,13 +411,79 @@ std::string SquareFactory::toString() const {
 }
 
 Shape* TextboxFactory::createShape() const {
-    return new Textbox(); // Creates a default Textbox
+    return adopt(new (allocator) Textbox()); // Creates a default Textbox
 }
 
 std::string TextboxFactory::toString() const {
     return "Textbox Factory";
 }
 
+// Field i of a batch array, 0 when the batch leaves the field out
+static int batchValue(const int* values, size_t i) {
+    return values != NULL ? values[i] : 0;
+}
+
+size_t RectangleFactory::getShapeSize() const { return sizeof(Rectangle); }
+Shape* RectangleFactory::constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const {
+    return ::new (block) Rectangle(batchValue(batch.lengths, i), batchValue(batch.widths, i), colour,
+                                   batchValue(batch.positionsX, i), batchValue(batch.positionsY, i));
+}
+size_t SquareFactory::getShapeSize() const { return sizeof(Square); }
+Shape* SquareFactory::constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const {
+    return ::new (block) Square(batchValue(batch.lengths, i), colour, batchValue(batch.positionsX, i), batchValue(batch.positionsY, i));
+}
+size_t TextboxFactory::getShapeSize() const { return sizeof(Textbox); }
+Shape* TextboxFactory::constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const {
+    return ::new (block) Textbox(batchValue(batch.lengths, i), batchValue(batch.widths, i), colour,
+                                 batchValue(batch.positionsX, i), batchValue(batch.positionsY, i),
+                                 batch.texts != NULL ? batch.texts[i] : SharedText());
+}
+
+// The shapes are fresh and off-canvas, so each is built from its batch entry in one
+// step instead of through the setters. Colours come straight from the palette by id,
+// and the default one is looked up once for the whole batch
+std::vector<Shape*> ShapeFactory::createShapes(const ShapeBatch& batch) const {
+    std::vector<Shape*> created(batch.count);
+    if (batch.count == 0) {
+        return created;
+    }
+    std::vector<void*> blocks(batch.count);
+    Shape::allocateMany(getShapeSize(), batch.count, allocator, &blocks[0]);
+
+    ColourPalette& palette = ColourPalette::global();
+    const ColourEntry* fallback = palette.intern("black"); // what a default product gets
+    const ColourEntry* colour = fallback;
+    const ColourEntry* found = NULL;
+    unsigned colourId = 0;
+    for (size_t i = 0; i < batch.count; ++i) {
+        if (batch.colours != NULL) {
+            if (found == NULL || colourId != batch.colours[i]) {
+                colourId = batch.colours[i];
+                found = palette.find(colourId); // runs of one colour share a lookup
+            }
+            colour = found != NULL ? found : fallback;
+        }
+        Shape* shape = constructAt(blocks[i], batch, i, colour);
+        shape->allocator = allocator;
+        created[i] = shape;
+    }
+    return created;
+}
+
+void ShapeFactory::setAllocator(ShapeAllocator* allocator) {
+    this->allocator = allocator;
+}
+
+ShapeAllocator* ShapeFactory::getAllocator() const {
+    return allocator;
+}
+
+// Clones of a created shape come from the factory's allocator too
+Shape* ShapeFactory::adopt(Shape* shape) const {
+    shape->allocator = allocator;
+    return shape;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -118,202 +495,4863 @@ std::string TextboxFactory::toString() const {
 //Extra
 Canvas::~Canvas() {
     for (Shape* shape : shapes) {
-        delete shape;
+        if (shape != NULL) {
+            if (!frozenCopy) {
+                shape->owner = NULL; // journal records may outlive the canvas
+            }
+            shape->release();
+        }
+    }
+    delete store;
+    delete spatial;
+    if (arena != NULL) {
+        arena->release(); // the chunks go once the last shape from the arena is released
     }
 }
 
-void Canvas::addShape(Shape* shape) {
-    shapes.push_back(shape);
+void Canvas::setArenaEnabled(bool enabled) {
+    if (enabled && arena == NULL) {
+        arena = new ShapeArena();
+    } else if (!enabled && arena != NULL) {
+        arena->release();
+        arena = NULL;
+    }
 }
 
-std::vector<Shape*> Canvas::getShapes() const {
-    return shapes;
+ShapeAllocator* Canvas::getAllocator() const {
+    return arena != NULL ? static_cast<ShapeAllocator*>(arena) : ShapeAllocator::getDefault();
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
+void Canvas::setShapeStoreEnabled(bool enabled) {
+    if (!enabled) {
+        delete store;
+        store = NULL;
+        return;
+    }
+    if (store != NULL) {
+        return;
+    }
+    store = new ShapeStore();
+    store->reserve(shapes.size());
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL) {
+            store->insert(*shapes[i]);
+        }
+    }
+}
 
-//vector containing shape pointer
-Memento::Memento(const std::vector<Shape*>& elements){
-   std::cout << "Creating memento with " << elements.size() << " shapes...\n";
-    // Create deep copies of all shapes using their clone() method
+const ShapeStore* Canvas::getShapeStore() const {
+    return store;
+}
 
-     for (size_t i = 0; i < elements.size(); ++i) {
-        Shape* shape = elements[i];
-        if (shape != NULL) {
-            shapesSnapshot.push_back(shape->clone());
+Bounds Canvas::getBoundingBox() const {
+    if (store != NULL) {
+        return store->boundingBox();
+    }
+    Bounds box = { 0, 0, 0, 0 };
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL) {
+            box.expand(shapes[i]->getBounds());
         }
     }
+    return box;
+}
 
-    std::cout << "Memento created successfully with " << shapesSnapshot.size() << " shapes\n";
-   
+void Canvas::setSpatialIndexEnabled(bool enabled) {
+    if (!enabled) {
+        delete spatial;
+        spatial = NULL;
+        return;
+    }
+    if (spatial != NULL) {
+        return;
+    }
+    spatial = new SpatialIndex();
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL) {
+            spatial->insert(shapes[i]->id, shapes[i]->getBounds());
+        }
+    }
 }
 
-std::vector<Shape*> Memento::getSavedState() const {
+const DirtyLog& Canvas::getDirtyLog() const {
+    return dirty;
+}
 
-     std::cout << "Retrieving saved state with " << shapesSnapshot.size() << " shapes\n";
-    return shapesSnapshot;
+const SpatialIndex* Canvas::getSpatialIndex() const {
+    return spatial;
 }
 
-CareTaker::~CareTaker() {
-    std::cout << "CareTaker destructor: Cleaning up " << history.size() << " mementos\n";
-    
-    for (size_t i = 0; i < history.size(); ++i) {
-        Memento* memento = history[i];
-        if (memento != NULL) {
-            // Clean up the shapes in each memento
-            std::vector<Shape*> shapes = memento->getSavedState();
-            for (size_t j = 0; j < shapes.size(); ++j) {
-                delete shapes[j];
-            }
-            delete memento;
+// The index already answers in ascending ids, the store's rows need sorting into them and
+// a scan meets the shapes in canvas order
+std::vector<unsigned> Canvas::hitTest(int x, int y) const {
+    if (spatial != NULL) {
+        return spatial->queryPoint(x, y);
+    }
+    if (store != NULL) {
+        std::vector<unsigned> hits = store->hitTest(x, y);
+        std::sort(hits.begin(), hits.end());
+        return hits;
+    }
+    std::vector<unsigned> hits;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL && shapes[i]->getBounds().contains(x, y)) {
+            hits.push_back(shapes[i]->id);
         }
     }
-    history.clear();
-
+    return hits;
 }
 
+// Ids of every shape overlapping the area, in ascending order
+std::vector<unsigned> Canvas::queryRect(const Bounds& area) const {
+    if (spatial != NULL) {
+        return spatial->queryRect(area);
+    }
+    std::vector<unsigned> hits;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL && shapes[i]->getBounds().intersects(area)) {
+            hits.push_back(shapes[i]->id);
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
 
-void CareTaker::addMemento(Memento* m) {
-
-    if (m != NULL) {
-        history.push_back(m);
-        std::cout << "Memento added to history. Total mementos: " << history.size() << "\n";
+// Ids of the k shapes closest to the point, by distance to their bounds
+std::vector<unsigned> Canvas::nearest(int x, int y, size_t k) const {
+    if (spatial != NULL) {
+        return spatial->nearest(x, y, k);
+    }
+    std::vector<std::pair<long long, unsigned> > ranked;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL) {
+            ranked.push_back(std::make_pair(shapes[i]->getBounds().distanceSquared(x, y), shapes[i]->id));
+        }
+    }
+    if (k < ranked.size()) {
+        std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end());
+        ranked.resize(k);
     } else {
-        std::cout << "Warning: Attempted to add null memento\n";
+        std::sort(ranked.begin(), ranked.end());
     }
+    std::vector<unsigned> found;
+    for (size_t i = 0; i < ranked.size(); ++i) {
+        found.push_back(ranked[i].second);
+    }
+    return found;
 }
 
-Memento* CareTaker::getLastMemento() {
+void Canvas::setSnapshotMode(SnapshotMode mode) {
+    snapshotMode = mode;
+}
 
-if (!history.empty()) {
-        Memento* lastMemento = history.back();
-        history.pop_back();
-        std::cout << "Retrieved last memento. Remaining mementos: " << history.size() << "\n";
-        return lastMemento;
-    }
-    
-    std::cout << "No mementos available for retrieval\n";
-    return NULL;
+SnapshotMode Canvas::getSnapshotMode() const {
+    return snapshotMode;
+}
 
+void Canvas::setSnapshotThreads(unsigned threads) {
+    snapshotThreads = threads;
 }
 
-/*void Canvas::addShape(Shape* shape) {
- if (shape != NULL) {
-        shapes.push_back(shape);
-        std::cout << "Shape added to canvas. Total shapes: " << shapes.size() << "\n";
-    } else {
-        std::cout << "Warning: Attempted to add null shape to canvas\n";
-    }
-} */
+unsigned Canvas::getSnapshotThreads() const {
+    return snapshotThreads;
+}
 
-/*std::vector<Shape*> Canvas::getShapes() const {
-       return shapes;
-} */
+void Canvas::addShape(Shape* shape) {
+    std::unique_lock<std::recursive_mutex> lock = lockWrites();
+    if (shape != NULL) {
+        shape->id = nextId++; // always fresh, clones of shapes on this canvas get their own
+    }
+    insertAt(shapes.size(), shape);
 
-Memento* Canvas::captureCurrent() const{
- std::cout << "Capturing current canvas state...\n";
-std::cout << "Current canvas has " << shapes.size() << " shapes\n";
-    
-    // Create and return a new memento with the current shapes
-    return new Memento(shapes);
+    if (shape != NULL && journal != NULL && !replaying) {
+        ShapeDelta* delta = new ShapeDelta(EditKind::Add, shape->id);
+        delta->index = shapes.size() - 1;
+        delta->shape = shape;
+        shape->retain();
+        journal->recordEdit(delta);
+    }
+}
 
+void Canvas::addShapes(const std::vector<Shape*>& added) {
+    addShapes(added.data(), added.data() + added.size());
 }
 
-void Canvas::undoAction(Memento* prev) {
-      if (prev == NULL) {
-        std::cout << "Cannot undo: No memento provided\n";
+void Canvas::addShapes(Shape* const* first, Shape* const* last) {
+    if (first == last) {
         return;
     }
-    
-    std::cout << "Restoring canvas state from memento...\n";
-    std::cout << "Current canvas has " << shapes.size() << " shapes\n";
-    
-    // Clear current shapes
-    for (size_t i=0; i < shapes.size(); ++i) {
-        delete shapes[i];
+    std::unique_lock<std::recursive_mutex> lock = lockWrites();
+    size_t count = static_cast<size_t>(last - first);
+    size_t needed = shapes.size() + count;
+    if (shapes.capacity() < needed) {
+        shapes.reserve(std::max(needed, shapes.capacity() * 2)); // repeated batches still grow geometrically
     }
-    shapes.clear();
-    
-    // Restore shapes from memento (create new copies using clone)
-    std::vector<Shape*> savedShapes = prev->getSavedState();
-    for (size_t i = 0; i < savedShapes.size(); ++i) {
-        Shape* shape = savedShapes[i];
-        if (shape != NULL) {
-            shapes.push_back(shape->clone());
-        }
+    byId.reserve(byId.size() + count);
+    if (store != NULL) {
+        store->reserve(store->size() + count);
+    }
+    if (spatial != NULL) {
+        spatial->reserve(spatial->size() + count);
     }
-    
-    std::cout << "Canvas state restored. New canvas has " << shapes.size() << " shapes\n";
-}
-
 
-//template method
+    markShifted(shapes.size());
+    Bounds area = { 0, 0, 0, 0 };
+    for (Shape* const* it = first; it != last; ++it) {
+        Shape* shape = *it;
+        shapes.push_back(shape);
+        if (shape == NULL) {
+            continue;
+        }
+        shape->id = nextId++;
+        shape->owner = this;
+        byId[shape->id] = shape;
+        Bounds bounds = shape->getBounds();
+        if (store != NULL) {
+            store->insert(*shape);
+        }
+        if (spatial != NULL) {
+            spatial->insert(shape->id, bounds);
+        }
+        area.expand(bounds);
 
-ExportCanvas::ExportCanvas(Canvas* c) : canvas(c) {
-       std::cout << "ExportCanvas created for canvas with " 
-              << (canvas ? canvas->getShapes().size() : 0) << " shapes\n";
+        if (journal != NULL && !replaying) {
+            ShapeDelta* delta = new ShapeDelta(EditKind::Add, shape->id);
+            delta->index = shapes.size() - 1;
+            delta->shape = shape;
+            shape->retain();
+            journal->recordEdit(delta);
+        }
+    }
+    dirty.mark(area);
+    changed();
 }
 
-//Template method
-void ExportCanvas::exportCanvas() {
-
-     std::cout << "\n=== STARTING EXPORT PROCESS ===\n";
-    
-    if (canvas == NULL) {
-        std::cout << "Error: No canvas to export\n";
+void Canvas::removeShape(size_t index) {
+    std::unique_lock<std::recursive_mutex> lock = lockWrites();
+    if (index >= shapes.size()) {
+        return;
+    }
+    Shape* shape = detachAt(index);
+    if (shape == NULL) {
         return;
     }
-    
-    std::cout << "Exporting canvas with " << canvas->getShapes().size() << " shapes\n";
-    
-    // Template method algorithm - calls abstract methods in specific order
-    prepareCanvas();     // Step 1: Prepare the canvas for export
-    renderElements();    // Step 2: Render all elements
-    saveToFile();        // Step 3: Save to specific file format
-    
-    std::cout << "=== EXPORT PROCESS COMPLETED ===\n\n";
-}
-
-
-PNGExporter::PNGExporter(Canvas* c) : ExportCanvas(c) {
-     std::cout << "PNGExporter initialized";
-     
-}
 
-PDFExporter::PDFExporter(Canvas* c) : ExportCanvas(c) {
-    std::cout << "PDFExporter initialized" << std::endl;
+    if (journal != NULL && !replaying) {
+        ShapeDelta* delta = new ShapeDelta(EditKind::Remove, shape->id);
+        delta->index = index;
+        delta->shape = shape;
+        shape->retain();
+        journal->recordEdit(delta);
+    }
+    shape->release();
 }
 
-void PNGExporter::prepareCanvas() {
-    std::cout << "PNG: Preparing canvas for PNG export" << std::endl;
+Shape* Canvas::findShape(unsigned id) {
+    std::unordered_map<unsigned, Shape*>::const_iterator it = byId.find(id);
+    return it == byId.end() ? NULL : it->second;
 }
 
-void PNGExporter::renderElements() {
-    std::cout << "PNG: Rendering elements for PNG format" << std::endl;
+const Shape* Canvas::findShape(unsigned id) const {
+    std::unordered_map<unsigned, Shape*>::const_iterator it = byId.find(id);
+    return it == byId.end() ? NULL : it->second;
 }
 
-void PNGExporter::saveToFile() {
-    std::cout << "PNG: Saving file as PNG format" << std::endl;
+void Canvas::setJournal(CareTaker* caretaker) {
+    journal = caretaker;
 }
 
-
-void PDFExporter::prepareCanvas() {
-    std::cout << "PDF: Preparing canvas for PDF export" << std::endl;
+CareTaker* Canvas::getJournal() const {
+    return journal;
 }
 
-void PDFExporter::renderElements() {
-    std::cout << "PDF: Rendering elements for PDF format" << std::endl;
+// Places a shape the canvas already holds a reference to
+void Canvas::insertAt(size_t index, Shape* shape) {
+    shapes.insert(shapes.begin() + index, shape);
+    if (shape != NULL) {
+        shape->owner = this;
+        byId[shape->id] = shape;
+        if (store != NULL) {
+            store->insert(*shape);
+        }
+        if (spatial != NULL) {
+            spatial->insert(shape->id, shape->getBounds());
+        }
+        if (shape->id >= nextId) {
+            nextId = shape->id + 1;
+        }
+        dirty.mark(shape->getBounds());
+        markShifted(index);
+        changed();
+    }
 }
 
-void PDFExporter::saveToFile() {
-    std::cout << "PDF: Saving file as PDF format" << std::endl;
+// Takes a shape off the canvas, the caller inherits the canvas's reference
+Shape* Canvas::detachAt(size_t index) {
+    Shape* shape = shapes[index];
+    shapes.erase(shapes.begin() + index);
+    if (shape != NULL) {
+        shape->owner = NULL;
+        byId.erase(shape->id);
+        if (store != NULL) {
+            store->erase(shape->id);
+        }
+        if (spatial != NULL) {
+            spatial->erase(shape->id);
+        }
+        dirty.mark(shape->getBounds());
+        markShifted(index);
+        changed();
+    }
+    return shape;
 }
 
+void Canvas::onShapeEdit(Shape& shape, EditKind kind, int oldA, int oldB, const SharedText* oldText) {
+    if (store != NULL) {
+        store->update(shape);
+    }
+    if (spatial != NULL && (kind == EditKind::Move || kind == EditKind::Resize)) {
+        spatial->update(shape.id, shape.getBounds());
+    }
+    // Moves and resizes also uncover the area the shape used to cover
+    if (kind == EditKind::Move) {
+        dirty.mark(Bounds::of(oldA, oldB, shape.length, shape.width));
+    } else if (kind == EditKind::Resize) {
+        dirty.mark(Bounds::of(shape.positionX, shape.positionY, oldA, oldB));
+    }
+    dirty.mark(shape.getBounds());
+    markEdited(shape.id);
+    changed();
+    if (journal == NULL || replaying) {
+        return;
+    }
+
+    ShapeDelta* delta = new ShapeDelta(kind, shape.id);
+    delta->before[0] = oldA;
+    delta->before[1] = oldB;
+    switch (kind) {
+        case EditKind::Move:
+            delta->after[0] = shape.positionX;
+            delta->after[1] = shape.positionY;
+            break;
+        case EditKind::Resize:
+            delta->after[0] = shape.length;
+            delta->after[1] = shape.width;
+            break;
+        case EditKind::Recolour:
+            delta->after[0] = static_cast<int>(shape.colour->id);
+            break;
+        case EditKind::SetText:
+            delta->beforeText = *oldText;
+            delta->afterText = static_cast<Textbox&>(shape).getSharedText();
+            break;
+        default:
+            break;
+    }
+    journal->recordEdit(delta);
+}
+
+// Replays one journal record, forward for redo and backward (the inverse) for undo.
+// Records for shapes that are no longer on the canvas are skipped
+void Canvas::applyDelta(const ShapeDelta& delta, bool forward) {
+    std::unique_lock<std::recursive_mutex> lock = lockWrites();
+    replaying = true;
+
+    const int* values = forward ? delta.after : delta.before;
+    const SharedText& text = forward ? delta.afterText : delta.beforeText;
+    Shape* target = findShape(delta.shapeId);
+
+    bool insert = (delta.kind == EditKind::Add) == forward;
+    switch (delta.kind) {
+        case EditKind::Add:
+        case EditKind::Remove:
+            if (insert && target == NULL && delta.shape != NULL) {
+                delta.shape->retain();
+                insertAt(delta.index < shapes.size() ? delta.index : shapes.size(), delta.shape);
+            } else if (!insert && target != NULL) {
+                size_t index = delta.index;
+                if (index >= shapes.size() || shapes[index] != target) {
+                    for (index = 0; index < shapes.size() && shapes[index] != target; ++index) {}
+                }
+                detachAt(index)->release();
+            }
+            break;
+        case EditKind::Move:
+            if (target != NULL) target->setPosition(values[0], values[1]);
+            break;
+        case EditKind::Resize:
+            if (target != NULL) target->setSize(values[0], values[1]);
+            break;
+        case EditKind::Recolour:
+            if (target != NULL) target->setColourId(static_cast<unsigned>(values[0]));
+            break;
+        case EditKind::SetText:
+            if (Textbox* box = shapeCast<Textbox>(target)) box->setSharedText(text);
+            break;
+    }
+
+    replaying = false;
+}
+
+std::vector<Shape*> Canvas::getShapes() {
+    return shapes;
+}
+
+std::vector<const Shape*> Canvas::getShapes() const {
+    return std::vector<const Shape*>(shapes.begin(), shapes.end());
+}
+
+size_t Canvas::size() const {
+    return shapes.size();
+}
+
+ShapeView Canvas::view() const {
+    const Shape* const* first = shapes.data();
+    return ShapeView(first, first + shapes.size());
+}
+
+ShapeKindView Canvas::viewOf(ShapeKind kind) const {
+    return ShapeKindView(view(), kind);
+}
+
+size_t ShapeKindView::count() const {
+    size_t total = 0;
+    for (const_iterator it = begin(); it != end(); ++it) {
+        ++total;
+    }
+    return total;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Saved copy of one shape, adding what it allocated to bytes
+static Shape* captureShape(const Shape& shape, SnapshotMode mode, size_t& bytes) {
+    bool created = true;
+    Shape* saved = mode == SnapshotMode::Shared ? shape.snapshot(&created) : cloneShape(shape);
+    if (created) {
+        bytes += shapeByteSize(*saved);
+    }
+    return saved;
+}
+
+//vector containing shape pointer
+Memento::Memento(const std::vector<Shape*>& elements, SnapshotMode mode, unsigned threads) : mode(mode), bytes(sizeof(Memento)) {
+    Metrics::mementosLive.increment();
+    OPENCANVAS_LOG(LogLevel::Trace, "memento", "creating memento with %zu shapes", elements.size());
+    // Deep mode clones every shape, shared mode reuses each shape's twin and only
+    // clones the ones that changed since the previous capture
+    size_t workers = threads != 0 ? threads : std::thread::hardware_concurrency();
+    workers = std::min(std::max(workers, static_cast<size_t>(1)), elements.size() / captureChunk);
+
+    if (workers <= 1) {
+        shapesSnapshot.reserve(elements.size());
+        for (size_t i = 0; i < elements.size(); ++i) {
+            if (elements[i] != NULL) {
+                shapesSnapshot.push_back(captureShape(*elements[i], mode, bytes));
+            }
+        }
+    } else {
+        // Workers claim chunks in turn and fill their slots in place, so the result is in
+        // order without stitching. Each worker clones through its own thread's pool cache
+        shapesSnapshot.assign(elements.size(), NULL);
+        std::atomic<size_t> nextChunk(0);
+        std::atomic<size_t> allocated(0);
+        auto work = [&]() {
+            size_t made = 0;
+            for (size_t start = nextChunk.fetch_add(captureChunk); start < elements.size(); start = nextChunk.fetch_add(captureChunk)) {
+                size_t end = std::min(start + captureChunk, elements.size());
+                for (size_t i = start; i < end; ++i) {
+                    if (elements[i] != NULL) {
+                        shapesSnapshot[i] = captureShape(*elements[i], mode, made);
+                    }
+                }
+            }
+            allocated.fetch_add(made, std::memory_order_relaxed);
+        };
+        std::vector<std::thread> helpers;
+        for (size_t i = 1; i < workers; ++i) {
+            helpers.push_back(std::thread(work));
+        }
+        work();
+        for (size_t i = 0; i < helpers.size(); ++i) {
+            helpers[i].join();
+        }
+        shapesSnapshot.erase(std::remove(shapesSnapshot.begin(), shapesSnapshot.end(), static_cast<Shape*>(NULL)), shapesSnapshot.end());
+        bytes += allocated.load();
+    }
+    bytes += shapesSnapshot.capacity() * sizeof(Shape*);
+
+    OPENCANVAS_LOG(LogLevel::Debug, "memento", "memento created with %zu shapes, %zu bytes", shapesSnapshot.size(), bytes);
+   
+}
+
+Memento::Memento(std::vector<Shape*>& adopted, SnapshotMode mode, size_t bytes) : mode(mode), bytes(bytes) {
+    shapesSnapshot.swap(adopted);
+    Metrics::mementosLive.increment();
+}
+
+Memento::~Memento() {
+    Metrics::mementosLive.decrement();
+    for (size_t i = 0; i < shapesSnapshot.size(); ++i) {
+        shapesSnapshot[i]->release();
+    }
+}
+
+static bool sameShape(const Shape& a, const Shape& b) {
+    if (a.getKind() != b.getKind() || a.getLength() != b.getLength() || a.getWidth() != b.getWidth() ||
+        a.getColourId() != b.getColourId() || a.getPositionX() != b.getPositionX() || a.getPositionY() != b.getPositionY()) {
+        return false;
+    }
+    return a.getKind() != ShapeKind::Textbox ||
+        static_cast<const Textbox&>(a).getTextView() == static_cast<const Textbox&>(b).getTextView();
+}
+
+// Swaps each saved shape only this memento holds for the equal copy in previous, which
+// outlives it in the history. Both are immutable, so sharing is safe in either mode
+size_t Memento::shareUnchanged(const Memento& previous) {
+    std::unordered_map<unsigned, Shape*> earlier;
+    earlier.reserve(previous.shapesSnapshot.size());
+    for (size_t i = 0; i < previous.shapesSnapshot.size(); ++i) {
+        earlier[previous.shapesSnapshot[i]->id] = previous.shapesSnapshot[i];
+    }
+    size_t freed = 0;
+    for (size_t i = 0; i < shapesSnapshot.size(); ++i) {
+        Shape*& saved = shapesSnapshot[i];
+        std::unordered_map<unsigned, Shape*>::const_iterator match = earlier.find(saved->id);
+        if (match == earlier.end() || match->second == saved ||
+            saved->refs.load(std::memory_order_acquire) != 1 || !sameShape(*saved, *match->second)) {
+            continue;
+        }
+        freed += shapeByteSize(*saved);
+        saved->release();
+        saved = match->second;
+        saved->retain();
+    }
+    bytes -= std::min(freed, bytes);
+    return freed;
+}
+
+SnapshotMode Memento::getMode() const {
+    return mode;
+}
+
+size_t Memento::getByteSize() const {
+    return bytes;
+}
+
+ShapeView Memento::getSavedState() const {
+    const Shape* const* first = shapesSnapshot.data();
+    return ShapeView(first, first + shapesSnapshot.size());
+}
+
+ShapeDelta::ShapeDelta(EditKind kind, unsigned shapeId) :
+    kind(kind), shapeId(shapeId), index(0), shape(NULL), before{0, 0}, after{0, 0} {}
+
+ShapeDelta::~ShapeDelta() {
+    if (shape != NULL) {
+        shape->release();
+    }
+}
+
+size_t ShapeDelta::getByteSize() const {
+    size_t total = sizeof(ShapeDelta) + beforeText.getHeapBytes() + afterText.getHeapBytes();
+    if (shape != NULL) {
+        total += shapeByteSize(*shape);
+    }
+    return total;
+}
+
+CareTaker::~CareTaker() {
+    OPENCANVAS_LOG(LogLevel::Debug, "caretaker", "releasing %zu mementos", history.size());
+    
+    for (size_t i = 0; i < history.size(); ++i) {
+        delete history[i].memento; // the memento releases its own shapes
+    }
+    history.clear();
+    clearRedoStates();
+    delete backing; // the file keeps the states for the next run
+
+    for (size_t i = 0; i < undoJournal.size(); ++i) {
+        delete undoJournal[i].delta;
+    }
+    clearRedoEdits();
+}
+
+// A new edit invalidates everything that was undone before it
+void CareTaker::recordEdit(ShapeDelta* delta) {
+    if (delta == NULL) {
+        return;
+    }
+    SavedEdit edit = { delta, nextSeq++, delta->getByteSize() };
+    undoJournal.push_back(edit);
+    historyBytes += edit.bytes;
+    clearRedoEdits();
+    enforceLimits();
+}
+
+bool CareTaker::undoEdit(Canvas& canvas) {
+    if (undoJournal.empty()) {
+        return false;
+    }
+    SavedEdit edit = undoJournal.back();
+    undoJournal.pop_back();
+    canvas.applyDelta(*edit.delta, false);
+    redoJournal.push_back(edit);
+    return true;
+}
+
+bool CareTaker::redoEdit(Canvas& canvas) {
+    if (redoJournal.empty()) {
+        return false;
+    }
+    SavedEdit edit = redoJournal.back();
+    redoJournal.pop_back();
+    canvas.applyDelta(*edit.delta, true);
+    edit.seq = nextSeq++;
+    undoJournal.push_back(edit);
+    return true;
+}
+
+size_t CareTaker::getEditCount() const {
+    return undoJournal.size();
+}
+
+size_t CareTaker::getRedoCount() const {
+    return redoJournal.size();
+}
+
+void CareTaker::clearRedoEdits() {
+    for (size_t i = 0; i < redoJournal.size(); ++i) {
+        historyBytes -= redoJournal[i].bytes;
+        delete redoJournal[i].delta;
+    }
+    redoJournal.clear();
+}
+
+
+void CareTaker::addMemento(Memento* m) {
+
+    if (m != NULL) {
+        pushState(m);
+        clearRedoStates();
+        if (limits.compactInterval != 0 && ++statesSinceCompact >= limits.compactInterval) {
+            compactHistory();
+        }
+        enforceLimits();
+        OPENCANVAS_LOG(LogLevel::Debug, "caretaker", "memento added, %zu in history", history.size());
+    } else {
+        OPENCANVAS_LOG(LogLevel::Warning, "caretaker", "attempted to add a null memento");
+    }
+}
+
+Memento* CareTaker::getLastMemento() {
+    return popState(NULL);
+}
+
+// live, when there is one, is the canvas the state goes back onto
+Memento* CareTaker::popState(const Canvas* live) {
+    ScopedLatency timing(Metrics::getLastMementoLatency);
+
+if (!history.empty()) {
+        SavedState state = history.back();
+        Memento* lastMemento = state.memento;
+        if (lastMemento == NULL && backing != NULL) {
+            lastMemento = backing->loadState(state.offset, live); // paged out, read it back
+        }
+        if (lastMemento == NULL) {
+            // Left in place, in memory and in the file, so a later attempt can still reach it
+            OPENCANVAS_LOG(LogLevel::Warning, "caretaker", "last memento could not be read back");
+            return NULL;
+        }
+        historyBytes -= state.bytes;
+        history.pop_back();
+        if (backing != NULL) {
+            backing->appendPop();
+        }
+        OPENCANVAS_LOG(LogLevel::Debug, "caretaker", "retrieved last memento, %zu remaining", history.size());
+        return lastMemento;
+    }
+    
+    OPENCANVAS_LOG(LogLevel::Info, "caretaker", "no mementos available for retrieval");
+    return NULL;
+
+}
+
+void CareTaker::pushState(Memento* m) {
+    SavedState state = { m, nextSeq++, m->getByteSize(), -1 };
+    if (backing != NULL) {
+        state.offset = backing->appendState(*m);
+    }
+    history.push_back(state);
+    historyBytes += state.bytes;
+    pageOut();
+}
+
+// Keeps the newest residentStates mementos in memory. Older ones that made it to the
+// backing file are dropped, they are read back when getLastMemento() reaches them
+void CareTaker::pageOut() {
+    if (backing == NULL) {
+        return;
+    }
+    size_t resident = 0;
+    for (size_t i = history.size(); i-- > 0;) {
+        SavedState& state = history[i];
+        if (state.memento == NULL || ++resident <= residentStates || state.offset < 0) {
+            continue;
+        }
+        if (!pageOutState(state)) {
+            return; // the file is not keeping up, hold on to the rest
+        }
+    }
+}
+
+// Drops the oldest memento that is safely in the backing file, false if there is none
+bool CareTaker::pageOutOldest() {
+    for (size_t i = 0; i < history.size(); ++i) {
+        SavedState& state = history[i];
+        if (state.memento != NULL && state.offset >= 0) {
+            return pageOutState(state);
+        }
+    }
+    return false;
+}
+
+// Paging out is the checkpoint: the file is synced before the only other copy goes
+bool CareTaker::pageOutState(SavedState& state) {
+    if (!backing->isDurable(state.offset) && !backing->sync()) {
+        return false;
+    }
+    historyBytes -= state.bytes;
+    delete state.memento;
+    state.memento = NULL;
+    state.bytes = 0;
+    return true;
+}
+
+bool CareTaker::setBackingFile(const std::string& path, size_t resident) {
+    closeBackingFile();
+    HistoryJournal* journal = new HistoryJournal();
+    std::vector<std::streamoff> recovered;
+    if (!journal->open(path, recovered)) {
+        delete journal;
+        return false;
+    }
+    backing = journal;
+    residentStates = resident;
+
+    // States from the file predate everything in memory, which is appended after them
+    std::deque<SavedState> merged;
+    for (size_t i = 0; i < recovered.size(); ++i) {
+        SavedState state = { NULL, 0, 0, recovered[i] };
+        merged.push_back(state);
+    }
+    for (size_t i = 0; i < history.size(); ++i) {
+        history[i].offset = backing->appendState(*history[i].memento);
+        merged.push_back(history[i]);
+    }
+    history.swap(merged);
+    pageOut();
+    enforceLimits();
+    return true;
+}
+
+void CareTaker::closeBackingFile() {
+    if (backing == NULL) {
+        return;
+    }
+    std::deque<SavedState> kept;
+    for (size_t i = 0; i < history.size(); ++i) {
+        SavedState state = history[i];
+        if (state.memento == NULL) {
+            state.memento = backing->loadState(state.offset);
+            if (state.memento == NULL) {
+                continue; // failed its checksum, nothing to restore
+            }
+            state.bytes = state.memento->getByteSize();
+            historyBytes += state.bytes;
+        }
+        state.offset = -1;
+        kept.push_back(state);
+    }
+    history.swap(kept);
+    delete backing;
+    backing = NULL;
+    enforceLimits();
+}
+
+size_t CareTaker::getResidentStateCount() const {
+    size_t resident = 0;
+    for (size_t i = 0; i < history.size(); ++i) {
+        if (history[i].memento != NULL) {
+            ++resident;
+        }
+    }
+    return resident;
+}
+
+void CareTaker::clearRedoStates() {
+    for (size_t i = 0; i < redoHistory.size(); ++i) {
+        historyBytes -= redoHistory[i]->getByteSize();
+        delete redoHistory[i];
+    }
+    redoHistory.clear();
+}
+
+// Both hold the canvas's write lock, so the state captured for the other stack is the
+// one the restore replaces
+bool CareTaker::undoState(Canvas& canvas) {
+    if (history.empty()) {
+        return false;
+    }
+    std::unique_lock<std::recursive_mutex> lock = canvas.lockWrites();
+    Memento* previous = popState(&canvas);
+    if (previous == NULL) {
+        return false; // a paged-out state that could not be read back
+    }
+    Memento* current = canvas.captureCurrent();
+    canvas.undoAction(std::unique_ptr<Memento>(previous));
+
+    redoHistory.push_back(current);
+    historyBytes += current->getByteSize();
+    enforceLimits();
+    return true;
+}
+
+bool CareTaker::redoState(Canvas& canvas) {
+    if (redoHistory.empty()) {
+        return false;
+    }
+    std::unique_lock<std::recursive_mutex> lock = canvas.lockWrites();
+    Memento* next = redoHistory.back();
+    redoHistory.pop_back();
+    historyBytes -= next->getByteSize();
+
+    pushState(canvas.captureCurrent());
+    canvas.undoAction(std::unique_ptr<Memento>(next));
+    enforceLimits();
+    return true;
+}
+
+size_t CareTaker::getRedoStateCount() const {
+    return redoHistory.size();
+}
+
+void CareTaker::setLimits(const HistoryLimits& l) {
+    limits = l;
+    enforceLimits();
+}
+
+const HistoryLimits& CareTaker::getLimits() const {
+    return limits;
+}
+
+size_t CareTaker::getHistoryBytes() const {
+    return historyBytes;
+}
+
+size_t CareTaker::getEntryCount() const {
+    return history.size() + redoHistory.size() + undoJournal.size() + redoJournal.size();
+}
+
+// Evicts entries until the history fits the budget. Redo entries go first, furthest from
+// the current state first, as they are the least likely to be used; then the oldest undo
+// entry (memento or edit, whichever was recorded first). The next redo of each kind and
+// the newest undo step are always kept, so a redo straight after an undo still works
+void CareTaker::enforceLimits() {
+    while (true) {
+        bool overEntries = limits.maxEntries != 0 && getEntryCount() > limits.maxEntries;
+        bool overBytes = limits.maxBytes != 0 && historyBytes > limits.maxBytes;
+        if (!overEntries && !overBytes) {
+            break;
+        }
+        // With a backing file, memory pressure alone pages states out instead of losing them
+        if (!overEntries && backing != NULL && pageOutOldest()) {
+            continue;
+        }
+
+        if (redoHistory.size() > 1) {
+            historyBytes -= redoHistory.front()->getByteSize();
+            delete redoHistory.front();
+            redoHistory.erase(redoHistory.begin());
+            continue;
+        }
+        if (redoJournal.size() > 1) {
+            historyBytes -= redoJournal.front().bytes;
+            delete redoJournal.front().delta;
+            redoJournal.erase(redoJournal.begin());
+            continue;
+        }
+        if (history.size() + undoJournal.size() <= 1) {
+            break;
+        }
+
+        bool evictState = !history.empty() &&
+            (undoJournal.empty() || history.front().seq < undoJournal.front().seq);
+        if (evictState) {
+            historyBytes -= history.front().bytes;
+            delete history.front().memento;
+            history.pop_front();
+            if (backing != NULL) {
+                backing->appendDrop();
+            }
+        } else {
+            historyBytes -= undoJournal.front().bytes;
+            delete undoJournal.front().delta;
+            undoJournal.pop_front();
+        }
+    }
+}
+
+// Oldest first, so a run of unchanged shapes ends up sharing the first copy of it.
+// Paged-out states are left as they are
+void CareTaker::compactHistory() {
+    size_t pending = std::min(statesSinceCompact, history.size());
+    statesSinceCompact = 0;
+    for (size_t i = std::max(history.size() - pending, static_cast<size_t>(1)); i < history.size(); ++i) {
+        SavedState& state = history[i];
+        const SavedState& previous = history[i - 1];
+        if (state.memento == NULL || previous.memento == NULL) {
+            continue;
+        }
+        size_t freed = state.memento->shareUnchanged(*previous.memento);
+        state.bytes -= freed;
+        historyBytes -= freed;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Colour palette
+
+ColourPalette& ColourPalette::global() {
+    static ColourPalette palette;
+    return palette;
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Accepts a few common names and #rrggbb / #rrggbbaa, anything else is opaque black
+// and the empty string is fully transparent
+uint32_t ColourPalette::parseRgba(const std::string& name) {
+    static const struct { const char* name; uint32_t rgba; } named[] = {
+        { "black", 0x000000FF }, { "white", 0xFFFFFFFF }, { "red", 0xFF0000FF },
+        { "green", 0x008000FF }, { "blue", 0x0000FFFF }, { "yellow", 0xFFFF00FF },
+        { "purple", 0x800080FF }, { "orange", 0xFFA500FF }, { "grey", 0x808080FF },
+        { "gray", 0x808080FF }, { "cyan", 0x00FFFFFF }, { "magenta", 0xFF00FFFF },
+        { "pink", 0xFFC0CBFF }, { "brown", 0xA52A2AFF }
+    };
+
+    if (name.empty()) {
+        return 0;
+    }
+    if (name[0] == '#' && (name.size() == 7 || name.size() == 9)) {
+        uint32_t value = 0;
+        for (size_t i = 1; i < name.size(); ++i) {
+            int digit = hexDigit(name[i]);
+            if (digit < 0) {
+                return 0x000000FF;
+            }
+            value = (value << 4) | static_cast<uint32_t>(digit);
+        }
+        return name.size() == 7 ? (value << 8) | 0xFF : value;
+    }
+    for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); ++i) {
+        if (name == named[i].name) {
+            return named[i].rgba;
+        }
+    }
+    return 0x000000FF;
+}
+
+const ColourEntry* ColourPalette::intern(const std::string& name) {
+    // Shapes are usually created in runs of one colour, so skip the lock for a repeat
+    thread_local const ColourEntry* last = NULL;
+    thread_local const ColourPalette* lastPalette = NULL;
+    if (last != NULL && lastPalette == this && last->name == name) {
+        return last;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unordered_map<std::string, const ColourEntry*>::const_iterator it = byName.find(name);
+    if (it != byName.end()) {
+        last = it->second;
+    } else {
+        ColourEntry entry = { name, static_cast<unsigned>(entries.size()), parseRgba(name) };
+        entries.push_back(entry);
+        last = &entries.back();
+        byName[name] = last;
+    }
+    lastPalette = this;
+    return last;
+}
+
+const ColourEntry* ColourPalette::find(unsigned id) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return id < entries.size() ? &entries[id] : NULL;
+}
+
+size_t ColourPalette::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Shape allocators
+
+ShapeAllocator* ShapeAllocator::getDefault() {
+    return &ShapePool::global();
+}
+
+void ShapeAllocator::allocateMany(size_t bytes, size_t count, void** blocks) {
+    for (size_t i = 0; i < count; ++i) {
+        blocks[i] = allocate(bytes);
+    }
+}
+
+ShapePool::ShapePool(size_t blocksPerChunk) : blocksPerChunk(blocksPerChunk > 0 ? blocksPerChunk : 1) {}
+
+ShapePool::~ShapePool() {
+    for (size_t cls = 0; cls < classCount; ++cls) {
+        for (size_t i = 0; i < classes[cls].chunks.size(); ++i) {
+            ::operator delete(classes[cls].chunks[i]);
+        }
+    }
+}
+
+// Never destroyed, so shapes released during static destruction still have a home
+ShapePool& ShapePool::global() {
+    static ShapePool* pool = [] {
+        ShapePool* created = new ShapePool();
+        created->threadCached = true;
+        return created;
+    }();
+    return *pool;
+}
+
+// Blocks of the global pool a thread keeps to itself, moved to and from the shared
+// free lists in batches and handed back when the thread exits
+struct ShapePoolCache {
+    static const size_t batch = 32;
+
+    ShapePool::FreeBlock* heads[ShapePool::classCount];
+    size_t counts[ShapePool::classCount];
+
+    ShapePoolCache();
+    ~ShapePoolCache();
+};
+
+// Trivially destructible, so it can still be read after the cache itself is gone
+static thread_local bool cacheRetired = false;
+
+ShapePoolCache::ShapePoolCache() {
+    for (size_t cls = 0; cls < ShapePool::classCount; ++cls) {
+        heads[cls] = NULL;
+        counts[cls] = 0;
+    }
+}
+
+ShapePoolCache::~ShapePoolCache() {
+    cacheRetired = true;
+    for (size_t cls = 0; cls < ShapePool::classCount; ++cls) {
+        if (heads[cls] == NULL) {
+            continue;
+        }
+        ShapePool::FreeBlock* tail = heads[cls];
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        ShapePool::global().giveBack(cls, heads[cls], tail);
+    }
+}
+
+static ShapePoolCache* localCache() {
+    if (cacheRetired) {
+        return NULL;
+    }
+    thread_local ShapePoolCache cache;
+    return &cache;
+}
+
+// Takes count blocks off the shared free list as one chain, carving new chunks as needed
+ShapePool::FreeBlock* ShapePool::refill(size_t cls, size_t count) {
+    SizeClass& sc = classes[cls];
+    size_t blockBytes = (cls + 1) * granularity;
+    std::lock_guard<std::mutex> lock(sc.mutex);
+
+    FreeBlock* head = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        if (sc.freeList == NULL) {
+            char* chunk = static_cast<char*>(::operator new(blockBytes * blocksPerChunk));
+            sc.chunks.push_back(chunk);
+            for (size_t b = blocksPerChunk; b > 0; --b) {
+                FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + (b - 1) * blockBytes);
+                block->next = sc.freeList;
+                sc.freeList = block;
+            }
+        }
+        FreeBlock* block = sc.freeList;
+        sc.freeList = block->next;
+        block->next = head;
+        head = block;
+    }
+    return head;
+}
+
+void ShapePool::giveBack(size_t cls, FreeBlock* head, FreeBlock* tail) {
+    SizeClass& sc = classes[cls];
+    std::lock_guard<std::mutex> lock(sc.mutex);
+    tail->next = sc.freeList;
+    sc.freeList = head;
+}
+
+void* ShapePool::allocate(size_t bytes) {
+    if (bytes == 0 || bytes > maxBlockBytes) {
+        return ::operator new(bytes);
+    }
+    size_t cls = (bytes - 1) / granularity;
+
+    ShapePoolCache* cache = threadCached ? localCache() : NULL;
+    if (cache == NULL) {
+        return refill(cls, 1);
+    }
+    if (cache->heads[cls] == NULL) {
+        cache->heads[cls] = refill(cls, ShapePoolCache::batch);
+        cache->counts[cls] = ShapePoolCache::batch;
+    }
+    FreeBlock* block = cache->heads[cls];
+    cache->heads[cls] = block->next;
+    --cache->counts[cls];
+    return block;
+}
+
+void ShapePool::deallocate(void* block, size_t bytes) {
+    if (bytes == 0 || bytes > maxBlockBytes) {
+        ::operator delete(block);
+        return;
+    }
+    size_t cls = (bytes - 1) / granularity;
+    FreeBlock* freed = static_cast<FreeBlock*>(block);
+
+    ShapePoolCache* cache = threadCached ? localCache() : NULL;
+    if (cache == NULL) {
+        giveBack(cls, freed, freed);
+        return;
+    }
+    freed->next = cache->heads[cls];
+    cache->heads[cls] = freed;
+    // A thread that only frees (a consumer of another thread's shapes) passes the surplus on
+    if (++cache->counts[cls] > 2 * ShapePoolCache::batch) {
+        FreeBlock* tail = cache->heads[cls];
+        for (size_t i = 1; i < ShapePoolCache::batch; ++i) {
+            tail = tail->next;
+        }
+        FreeBlock* head = cache->heads[cls];
+        cache->heads[cls] = tail->next;
+        cache->counts[cls] -= ShapePoolCache::batch;
+        giveBack(cls, head, tail);
+    }
+}
+
+// Bypasses the thread cache: one trip to the shared list for the whole run, and blocks
+// from new chunks are handed out in address order without going through the list
+void ShapePool::allocateMany(size_t bytes, size_t count, void** blocks) {
+    if (bytes == 0 || bytes > maxBlockBytes || count == 0) {
+        ShapeAllocator::allocateMany(bytes, count, blocks);
+        return;
+    }
+    SizeClass& sc = classes[(bytes - 1) / granularity];
+    size_t blockBytes = ((bytes - 1) / granularity + 1) * granularity;
+    std::lock_guard<std::mutex> lock(sc.mutex);
+
+    size_t i = 0;
+    for (; i < count && sc.freeList != NULL; ++i) {
+        blocks[i] = sc.freeList;
+        sc.freeList = sc.freeList->next;
+    }
+    while (i < count) {
+        char* chunk = static_cast<char*>(::operator new(blockBytes * blocksPerChunk));
+        sc.chunks.push_back(chunk);
+        size_t used = 0;
+        for (; used < blocksPerChunk && i < count; ++used) {
+            blocks[i++] = chunk + used * blockBytes;
+        }
+        for (size_t b = blocksPerChunk; b > used; --b) { // the rest of the last chunk
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + (b - 1) * blockBytes);
+            block->next = sc.freeList;
+            sc.freeList = block;
+        }
+    }
+}
+
+size_t ShapePool::getChunkCount() const {
+    size_t total = 0;
+    for (size_t cls = 0; cls < classCount; ++cls) {
+        std::lock_guard<std::mutex> lock(classes[cls].mutex);
+        total += classes[cls].chunks.size();
+    }
+    return total;
+}
+
+// Blocks of a few arenas a thread keeps to itself, moved to and from each arena's free
+// lists in batches. A thread that turns to a new arena hands back the blocks of the one
+// it used least recently
+struct ShapeArenaCache {
+    static const size_t slotCount = 4;
+
+    struct Slot {
+        ShapeArena* arena;
+        ShapePool::FreeBlock* heads[ShapePool::classCount];
+        size_t counts[ShapePool::classCount];
+        unsigned long lastUse;
+    };
+    Slot slots[slotCount];
+    unsigned long clock = 0;
+
+    ShapeArenaCache();
+    ~ShapeArenaCache();
+    Slot& find(ShapeArena* arena);
+    static void flush(Slot& slot);
+};
+
+static thread_local bool arenaCacheRetired = false;
+
+ShapeArenaCache::ShapeArenaCache() {
+    for (size_t i = 0; i < slotCount; ++i) {
+        slots[i].arena = NULL;
+        slots[i].lastUse = 0;
+        for (size_t cls = 0; cls < ShapePool::classCount; ++cls) {
+            slots[i].heads[cls] = NULL;
+            slots[i].counts[cls] = 0;
+        }
+    }
+}
+
+ShapeArenaCache::~ShapeArenaCache() {
+    arenaCacheRetired = true;
+    for (size_t i = 0; i < slotCount; ++i) {
+        flush(slots[i]);
+    }
+}
+
+// Hands every cached block back to the arena, which may then go
+void ShapeArenaCache::flush(Slot& slot) {
+    ShapeArena* arena = slot.arena;
+    if (arena == NULL) {
+        return;
+    }
+    slot.arena = NULL;
+    size_t total = 0;
+    for (size_t cls = 0; cls < ShapePool::classCount; ++cls) {
+        if (slot.heads[cls] == NULL) {
+            continue;
+        }
+        ShapePool::FreeBlock* tail = slot.heads[cls];
+        while (tail->next != NULL) {
+            tail = tail->next;
+        }
+        arena->pool.giveBack(cls, slot.heads[cls], tail);
+        total += slot.counts[cls];
+        slot.heads[cls] = NULL;
+        slot.counts[cls] = 0;
+    }
+    if (total > 0) {
+        arena->cached.fetch_sub(total, std::memory_order_relaxed);
+        arena->unref(total);
+    }
+}
+
+// The slot for arena, claiming the least recently used one if it has none. Slots of
+// arenas whose owner let go are handed back on the way
+ShapeArenaCache::Slot& ShapeArenaCache::find(ShapeArena* arena) {
+    ++clock;
+    Slot* victim = NULL;
+    for (size_t i = 0; i < slotCount; ++i) {
+        Slot& slot = slots[i];
+        if (slot.arena == arena) {
+            slot.lastUse = clock;
+            return slot;
+        }
+        if (slot.arena != NULL && slot.arena->retired.load(std::memory_order_acquire)) {
+            flush(slot);
+        }
+        if (victim == NULL || (victim->arena != NULL && (slot.arena == NULL || slot.lastUse < victim->lastUse))) {
+            victim = &slot;
+        }
+    }
+    flush(*victim);
+    victim->arena = arena;
+    victim->lastUse = clock;
+    return *victim;
+}
+
+static ShapeArenaCache* localArenaCache() {
+    if (arenaCacheRetired) {
+        return NULL;
+    }
+    thread_local ShapeArenaCache cache;
+    return &cache;
+}
+
+ShapeArena::ShapeArena(size_t blocksPerChunk) : pool(blocksPerChunk), refs(1) {}
+
+void* ShapeArena::allocate(size_t bytes) {
+    ShapeArenaCache* cache = bytes == 0 || bytes > ShapePool::maxBlockBytes ? NULL : localArenaCache();
+    if (cache == NULL) {
+        void* block = pool.allocate(bytes);
+        refs.fetch_add(1, std::memory_order_relaxed);
+        return block;
+    }
+    size_t cls = (bytes - 1) / ShapePool::granularity;
+    ShapeArenaCache::Slot& slot = cache->find(this);
+    if (slot.heads[cls] == NULL) {
+        slot.heads[cls] = pool.refill(cls, ShapePoolCache::batch);
+        slot.counts[cls] = ShapePoolCache::batch;
+        refs.fetch_add(ShapePoolCache::batch, std::memory_order_relaxed);
+        cached.fetch_add(ShapePoolCache::batch, std::memory_order_relaxed);
+    }
+    ShapePool::FreeBlock* block = slot.heads[cls];
+    slot.heads[cls] = block->next;
+    --slot.counts[cls];
+    cached.fetch_sub(1, std::memory_order_relaxed);
+    return block;
+}
+
+void ShapeArena::allocateMany(size_t bytes, size_t count, void** blocks) {
+    pool.allocateMany(bytes, count, blocks);
+    refs.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Once the owner has let go, blocks go straight back so the arena can die
+void ShapeArena::deallocate(void* block, size_t bytes) {
+    bool cacheable = bytes != 0 && bytes <= ShapePool::maxBlockBytes && !retired.load(std::memory_order_acquire);
+    ShapeArenaCache* cache = cacheable ? localArenaCache() : NULL;
+    if (cache == NULL) {
+        pool.deallocate(block, bytes);
+        unref();
+        return;
+    }
+    size_t cls = (bytes - 1) / ShapePool::granularity;
+    ShapeArenaCache::Slot& slot = cache->find(this);
+    ShapePool::FreeBlock* freed = static_cast<ShapePool::FreeBlock*>(block);
+    freed->next = slot.heads[cls];
+    slot.heads[cls] = freed;
+    cached.fetch_add(1, std::memory_order_relaxed);
+    if (++slot.counts[cls] > 2 * ShapePoolCache::batch) {
+        ShapePool::FreeBlock* tail = slot.heads[cls];
+        for (size_t i = 1; i < ShapePoolCache::batch; ++i) {
+            tail = tail->next;
+        }
+        ShapePool::FreeBlock* head = slot.heads[cls];
+        slot.heads[cls] = tail->next;
+        slot.counts[cls] -= ShapePoolCache::batch;
+        pool.giveBack(cls, head, tail);
+        cached.fetch_sub(ShapePoolCache::batch, std::memory_order_relaxed);
+        unref(ShapePoolCache::batch);
+    }
+}
+
+// The owner's own thread cache goes back at once, other threads' on their next use
+void ShapeArena::release() {
+    retired.store(true, std::memory_order_release);
+    ShapeArenaCache* cache = localArenaCache();
+    if (cache != NULL) {
+        for (size_t i = 0; i < ShapeArenaCache::slotCount; ++i) {
+            if (cache->slots[i].arena == this) {
+                ShapeArenaCache::flush(cache->slots[i]);
+            }
+        }
+    }
+    unref();
+}
+
+void ShapeArena::unref(size_t count) {
+    if (refs.fetch_sub(count, std::memory_order_acq_rel) == count) {
+        delete this; // frees every chunk at once
+    }
+}
+
+size_t ShapeArena::getLiveBlocks() const {
+    return refs.load(std::memory_order_relaxed) - cached.load(std::memory_order_relaxed) - 1;
+}
+
+size_t ShapeArena::getChunkCount() const {
+    return pool.getChunkCount();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bounds
+
+Bounds Bounds::of(int x, int y, int length, int width) {
+    Bounds b;
+    b.minX = length < 0 ? x + length : x;
+    b.maxX = length < 0 ? x : x + length;
+    b.minY = width < 0 ? y + width : y;
+    b.maxY = width < 0 ? y : y + width;
+    return b;
+}
+
+bool Bounds::isEmpty() const {
+    return minX >= maxX || minY >= maxY;
+}
+
+bool Bounds::contains(int x, int y) const {
+    return x >= minX && x < maxX && y >= minY && y < maxY;
+}
+
+bool Bounds::intersects(const Bounds& other) const {
+    return !isEmpty() && !other.isEmpty() &&
+           minX < other.maxX && other.minX < maxX &&
+           minY < other.maxY && other.minY < maxY;
+}
+
+bool Bounds::encloses(const Bounds& other) const {
+    return other.minX >= minX && other.maxX <= maxX && other.minY >= minY && other.maxY <= maxY;
+}
+
+long long Bounds::distanceSquared(int x, int y) const {
+    long long dx = x < minX ? static_cast<long long>(minX) - x : (x > maxX ? static_cast<long long>(x) - maxX : 0);
+    long long dy = y < minY ? static_cast<long long>(minY) - y : (y > maxY ? static_cast<long long>(y) - maxY : 0);
+    return dx * dx + dy * dy;
+}
+
+void Bounds::expand(const Bounds& other) {
+    if (other.isEmpty()) {
+        return;
+    }
+    if (isEmpty()) {
+        *this = other;
+        return;
+    }
+    if (other.minX < minX) minX = other.minX;
+    if (other.minY < minY) minY = other.minY;
+    if (other.maxX > maxX) maxX = other.maxX;
+    if (other.maxY > maxY) maxY = other.maxY;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// DirtyLog
+
+static std::atomic<unsigned long> nextDirtyOrigin(1);
+
+DirtyLog::DirtyLog() : origin(nextDirtyOrigin++) {}
+
+void DirtyLog::mark(const Bounds& area) {
+    size_t slot = revision - first;
+    if (slot % chunkRegions == 0) {
+        if (chunks.size() >= maxRegions / chunkRegions) {
+            chunks.pop_front(); // whole chunks at a time, so slots keep their place
+            first += chunkRegions;
+            slot -= chunkRegions;
+        }
+        chunks.push_back(std::make_shared<Chunk>());
+    }
+    chunks[slot / chunkRegions]->regions[slot % chunkRegions] = area;
+    ++revision;
+}
+
+void DirtyLog::markAll() {
+    ++revision;
+    chunks.clear();
+    first = revision;
+}
+
+unsigned long DirtyLog::getRevision() const {
+    return revision;
+}
+
+unsigned long DirtyLog::getOrigin() const {
+    return origin;
+}
+
+bool DirtyLog::collect(unsigned long since, std::vector<Bounds>& out) const {
+    if (since < first || since > revision) {
+        return false;
+    }
+    for (size_t i = since - first; i < revision - first; ++i) {
+        out.push_back(chunks[i / chunkRegions]->regions[i % chunkRegions]);
+    }
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// ShapeStore, the structure-of-arrays mirror of a canvas
+
+void ShapeStore::insert(const Shape& shape) {
+    unsigned id = shape.getId();
+    if (rowOf(id) != npos) {
+        update(shape);
+        return;
+    }
+    if (id >= rowOfId.size()) {
+        rowOfId.resize(id + 1, npos);
+    }
+    rowOfId[id] = ids.size();
+
+    ids.push_back(id);
+    kinds.push_back(shape.getKind());
+    lengths.push_back(shape.getLength());
+    widths.push_back(shape.getWidth());
+    positionsX.push_back(shape.getPositionX());
+    positionsY.push_back(shape.getPositionY());
+    colours.push_back(shape.getColourId());
+    if (shape.getKind() == ShapeKind::Textbox) {
+        texts[id] = static_cast<const Textbox&>(shape).getSharedText();
+    }
+}
+
+void ShapeStore::update(const Shape& shape) {
+    size_t row = rowOf(shape.getId());
+    if (row == npos) {
+        return;
+    }
+    lengths[row] = shape.getLength();
+    widths[row] = shape.getWidth();
+    positionsX[row] = shape.getPositionX();
+    positionsY[row] = shape.getPositionY();
+    colours[row] = shape.getColourId();
+    if (shape.getKind() == ShapeKind::Textbox) {
+        texts[shape.getId()] = static_cast<const Textbox&>(shape).getSharedText();
+    }
+}
+
+// Swap-remove keeps the columns dense, the moved row's id is re-pointed
+void ShapeStore::erase(unsigned id) {
+    size_t row = rowOf(id);
+    if (row == npos) {
+        return;
+    }
+    size_t last = ids.size() - 1;
+    if (row != last) {
+        ids[row] = ids[last];
+        kinds[row] = kinds[last];
+        lengths[row] = lengths[last];
+        widths[row] = widths[last];
+        positionsX[row] = positionsX[last];
+        positionsY[row] = positionsY[last];
+        colours[row] = colours[last];
+        rowOfId[ids[row]] = row;
+    }
+    ids.pop_back();
+    kinds.pop_back();
+    lengths.pop_back();
+    widths.pop_back();
+    positionsX.pop_back();
+    positionsY.pop_back();
+    colours.pop_back();
+    rowOfId[id] = npos;
+    texts.erase(id);
+}
+
+void ShapeStore::clear() {
+    ids.clear();
+    kinds.clear();
+    lengths.clear();
+    widths.clear();
+    positionsX.clear();
+    positionsY.clear();
+    colours.clear();
+    texts.clear();
+    rowOfId.clear();
+}
+
+void ShapeStore::reserve(size_t rows) {
+    ids.reserve(rows);
+    kinds.reserve(rows);
+    lengths.reserve(rows);
+    widths.reserve(rows);
+    positionsX.reserve(rows);
+    positionsY.reserve(rows);
+    colours.reserve(rows);
+}
+
+size_t ShapeStore::size() const {
+    return ids.size();
+}
+
+size_t ShapeStore::rowOf(unsigned id) const {
+    return id < rowOfId.size() ? rowOfId[id] : npos;
+}
+
+unsigned ShapeStore::getId(size_t row) const { return ids[row]; }
+ShapeKind ShapeStore::getKind(size_t row) const { return kinds[row]; }
+int ShapeStore::getLength(size_t row) const { return lengths[row]; }
+int ShapeStore::getWidth(size_t row) const { return widths[row]; }
+int ShapeStore::getPositionX(size_t row) const { return positionsX[row]; }
+int ShapeStore::getPositionY(size_t row) const { return positionsY[row]; }
+const std::string& ShapeStore::getColour(size_t row) const { return ColourPalette::global().find(colours[row])->name; }
+unsigned ShapeStore::getColourId(size_t row) const { return colours[row]; }
+
+const SharedText* ShapeStore::getText(unsigned id) const {
+    std::unordered_map<unsigned, SharedText>::const_iterator it = texts.find(id);
+    return it == texts.end() ? NULL : &it->second;
+}
+
+Bounds ShapeStore::getBounds(size_t row) const {
+    return Bounds::of(positionsX[row], positionsY[row], lengths[row], widths[row]);
+}
+
+Bounds ShapeStore::boundingBox() const {
+    Bounds box = { 0, 0, 0, 0 };
+    for (size_t row = 0; row < ids.size(); ++row) {
+        box.expand(Bounds::of(positionsX[row], positionsY[row], lengths[row], widths[row]));
+    }
+    return box;
+}
+
+std::vector<unsigned> ShapeStore::hitTest(int x, int y) const {
+    std::vector<unsigned> hits;
+    for (size_t row = 0; row < ids.size(); ++row) {
+        if (Bounds::of(positionsX[row], positionsY[row], lengths[row], widths[row]).contains(x, y)) {
+            hits.push_back(ids[row]);
+        }
+    }
+    return hits;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// SpatialIndex, a quadtree over shape bounds
+
+SpatialIndex::Node::Node(const Bounds& area) : area(area) {}
+
+SpatialIndex::Node::~Node() {
+    for (int i = 0; i < 4; ++i) {
+        delete children[i];
+    }
+}
+
+bool SpatialIndex::Node::isLeaf() const {
+    return children[0] == NULL;
+}
+
+// Quadrant i of an area: bit 0 picks the right half, bit 1 the bottom half
+static Bounds quadrant(const Bounds& area, int i) {
+    int midX = area.minX + (area.maxX - area.minX) / 2;
+    int midY = area.minY + (area.maxY - area.minY) / 2;
+    Bounds q;
+    q.minX = (i & 1) ? midX : area.minX;
+    q.maxX = (i & 1) ? area.maxX : midX;
+    q.minY = (i & 2) ? midY : area.minY;
+    q.maxY = (i & 2) ? area.maxY : midY;
+    return q;
+}
+
+SpatialIndex::SpatialIndex() : root(NULL) {}
+
+SpatialIndex::~SpatialIndex() {
+    delete root;
+}
+
+// Doubles the root towards the bounds until it encloses them. Past maxRootSize the
+// root stops growing and keeps whatever still falls outside it in its own entries
+void SpatialIndex::grow(const Bounds& bounds) {
+    while (!root->area.encloses(bounds) && root->area.maxX - root->area.minX < maxRootSize) {
+        Bounds old = root->area;
+        int size = old.maxX - old.minX;
+        bool left = bounds.minX < old.minX;
+        bool up = bounds.minY < old.minY;
+
+        Bounds area;
+        area.minX = left ? old.minX - size : old.minX;
+        area.maxX = left ? old.maxX : old.maxX + size;
+        area.minY = up ? old.minY - size : old.minY;
+        area.maxY = up ? old.maxY : old.maxY + size;
+
+        Node* grown = new Node(area);
+        int oldQuadrant = (left ? 1 : 0) | (up ? 2 : 0);
+        for (int i = 0; i < 4; ++i) {
+            grown->children[i] = i == oldQuadrant ? root : new Node(quadrant(area, i));
+            grown->children[i]->parent = grown;
+        }
+        root = grown;
+    }
+}
+
+SpatialIndex::Node* SpatialIndex::childFor(Node* node, const Bounds& bounds) const {
+    if (node->isLeaf()) {
+        return NULL;
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (node->children[i]->area.encloses(bounds)) {
+            return node->children[i];
+        }
+    }
+    return NULL;
+}
+
+void SpatialIndex::place(Node* node, const Entry& entry) {
+    for (Node* child = childFor(node, entry.bounds); child != NULL; child = childFor(node, entry.bounds)) {
+        node = child;
+    }
+    node->entries.push_back(entry);
+    nodeOf[entry.id] = node;
+    if (node->isLeaf() && node->entries.size() > splitThreshold && node->area.maxX - node->area.minX > minNodeSize) {
+        split(node);
+    }
+}
+
+// Pushes every entry that fits a quadrant down into it, the rest stay put
+void SpatialIndex::split(Node* node) {
+    for (int i = 0; i < 4; ++i) {
+        node->children[i] = new Node(quadrant(node->area, i));
+        node->children[i]->parent = node;
+    }
+    std::vector<Entry> kept;
+    std::vector<Entry> entries;
+    entries.swap(node->entries);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        Node* child = childFor(node, entries[i].bounds);
+        if (child != NULL) {
+            place(child, entries[i]);
+        } else {
+            kept.push_back(entries[i]);
+        }
+    }
+    node->entries.swap(kept);
+}
+
+void SpatialIndex::insert(unsigned id, const Bounds& bounds) {
+    if (nodeOf.find(id) != nodeOf.end()) {
+        update(id, bounds);
+        return;
+    }
+    if (root == NULL) {
+        Bounds area = { 0, 0, 1024, 1024 };
+        root = new Node(area);
+    }
+    grow(bounds);
+    Entry entry = { id, bounds };
+    place(root, entry);
+}
+
+// A shape that still belongs to the same node is updated in place, which covers
+// most small drags
+void SpatialIndex::update(unsigned id, const Bounds& bounds) {
+    std::unordered_map<unsigned, Node*>::iterator it = nodeOf.find(id);
+    if (it == nodeOf.end()) {
+        insert(id, bounds);
+        return;
+    }
+    Node* node = it->second;
+    if (node->area.encloses(bounds) && childFor(node, bounds) == NULL) {
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+            if (node->entries[i].id == id) {
+                node->entries[i].bounds = bounds;
+                return;
+            }
+        }
+    }
+    erase(id);
+    insert(id, bounds);
+}
+
+void SpatialIndex::erase(unsigned id) {
+    std::unordered_map<unsigned, Node*>::iterator it = nodeOf.find(id);
+    if (it == nodeOf.end()) {
+        return;
+    }
+    Node* node = it->second;
+    std::vector<Entry>& entries = node->entries;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (entries[i].id == id) {
+            entries[i] = entries.back();
+            entries.pop_back();
+            break;
+        }
+    }
+    nodeOf.erase(it);
+    prune(node);
+}
+
+// Walks up from the node an entry left, turning nodes whose four children are empty
+// leaves back into leaves, so erasing a crowd does not leave its subdivisions behind
+void SpatialIndex::prune(Node* node) {
+    for (; node != NULL; node = node->parent) {
+        if (!node->isLeaf()) {
+            for (int i = 0; i < 4; ++i) {
+                if (!node->children[i]->isLeaf() || !node->children[i]->entries.empty()) {
+                    return;
+                }
+            }
+            for (int i = 0; i < 4; ++i) {
+                delete node->children[i];
+                node->children[i] = NULL;
+            }
+        }
+        if (!node->entries.empty()) {
+            return;
+        }
+    }
+}
+
+void SpatialIndex::clear() {
+    delete root;
+    root = NULL;
+    nodeOf.clear();
+}
+
+void SpatialIndex::reserve(size_t entries) {
+    nodeOf.reserve(entries);
+}
+
+size_t SpatialIndex::size() const {
+    return nodeOf.size();
+}
+
+size_t SpatialIndex::nodeCount() const {
+    size_t count = 0;
+    std::vector<const Node*> pending;
+    if (root != NULL) {
+        pending.push_back(root);
+    }
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        ++count;
+        if (!node->isLeaf()) {
+            pending.insert(pending.end(), node->children, node->children + 4);
+        }
+    }
+    return count;
+}
+
+std::vector<unsigned> SpatialIndex::queryPoint(int x, int y) const {
+    std::vector<unsigned> hits;
+    if (root == NULL) {
+        return hits;
+    }
+    std::vector<const Node*> pending(1, root);
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+            if (node->entries[i].bounds.contains(x, y)) {
+                hits.push_back(node->entries[i].id);
+            }
+        }
+        if (!node->isLeaf()) {
+            for (int i = 0; i < 4; ++i) {
+                if (node->children[i]->area.contains(x, y)) {
+                    pending.push_back(node->children[i]);
+                }
+            }
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+std::vector<unsigned> SpatialIndex::queryRect(const Bounds& area) const {
+    std::vector<unsigned> hits;
+    if (root == NULL) {
+        return hits;
+    }
+    std::vector<const Node*> pending(1, root);
+    while (!pending.empty()) {
+        const Node* node = pending.back();
+        pending.pop_back();
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+            if (node->entries[i].bounds.intersects(area)) {
+                hits.push_back(node->entries[i].id);
+            }
+        }
+        if (!node->isLeaf()) {
+            for (int i = 0; i < 4; ++i) {
+                if (node->children[i]->area.intersects(area)) {
+                    pending.push_back(node->children[i]);
+                }
+            }
+        }
+    }
+    std::sort(hits.begin(), hits.end());
+    return hits;
+}
+
+namespace {
+// Best-first search item, a node still to open or a shape ready to report. At equal
+// distance nodes come first so ties between shapes can be settled by id
+struct NearCandidate {
+    long long distance;
+    const void* node;
+    unsigned id;
+
+    bool operator>(const NearCandidate& other) const {
+        if (distance != other.distance) return distance > other.distance;
+        if ((node == NULL) != (other.node == NULL)) return node == NULL;
+        return id > other.id;
+    }
+};
+}
+
+std::vector<unsigned> SpatialIndex::nearest(int x, int y, size_t k) const {
+    std::vector<unsigned> found;
+    if (root == NULL || k == 0) {
+        return found;
+    }
+    std::priority_queue<NearCandidate, std::vector<NearCandidate>, std::greater<NearCandidate> > queue;
+    NearCandidate start = { 0, root, 0 };
+    queue.push(start);
+    while (!queue.empty() && found.size() < k) {
+        NearCandidate next = queue.top();
+        queue.pop();
+        if (next.node == NULL) {
+            found.push_back(next.id);
+            continue;
+        }
+        const Node* node = static_cast<const Node*>(next.node);
+        for (size_t i = 0; i < node->entries.size(); ++i) {
+            NearCandidate shape = { node->entries[i].bounds.distanceSquared(x, y), NULL, node->entries[i].id };
+            queue.push(shape);
+        }
+        if (!node->isLeaf()) {
+            for (int i = 0; i < 4; ++i) {
+                NearCandidate child = { node->children[i]->area.distanceSquared(x, y), node->children[i], 0 };
+                queue.push(child);
+            }
+        }
+    }
+    return found;
+}
+
+/*void Canvas::addShape(Shape* shape) {
+ if (shape != NULL) {
+        shapes.push_back(shape);
+        std::cout << "Shape added to canvas. Total shapes: " << shapes.size() << "\n";
+    } else {
+        std::cout << "Warning: Attempted to add null shape to canvas\n";
+    }
+} */
+
+/*std::vector<Shape*> Canvas::getShapes() const {
+       return shapes;
+} */
+
+const Canvas* Canvas::snapshot() const {
+    if (concurrent) {
+        return fromTwins(*currentTwins(true));
+    }
+    Canvas* copy = new Canvas();
+    copy->snapshotMode = snapshotMode;
+    copy->nextId = nextId;
+    copy->dirty = dirty;
+    copy->frozenCopy = true;
+    copy->snapshotEpoch = epoch.load(std::memory_order_relaxed);
+    copy->shapes.reserve(shapes.size());
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL) {
+            // Twins are shared as they are, asking them for a twin of their own would write to them
+            Shape* twin = frozenCopy ? shapes[i] : shapes[i]->snapshot();
+            if (frozenCopy) {
+                twin->retain();
+            }
+            copy->shapes.push_back(twin);
+            copy->byId[twin->id] = twin;
+        }
+    }
+    return copy;
+}
+
+void Canvas::changed() {
+    epoch.fetch_add(1, std::memory_order_release);
+}
+
+void Canvas::setConcurrent(bool enabled) {
+    std::unique_lock<std::recursive_mutex> lock(writeMutex);
+    concurrent = enabled;
+    std::atomic_store(&published, std::shared_ptr<const Canvas>());
+    std::atomic_store(&publishedTwins, std::shared_ptr<const TwinList>());
+    twinChunks.clear();
+    twinStale.clear();
+    twinStaleFrom = 0;
+    twinChunkOf.clear();
+    twinBytes.store(0, std::memory_order_relaxed);
+}
+
+bool Canvas::isConcurrent() const {
+    return concurrent;
+}
+
+std::unique_lock<std::recursive_mutex> Canvas::lockWrites() const {
+    return concurrent ? std::unique_lock<std::recursive_mutex>(writeMutex) : std::unique_lock<std::recursive_mutex>();
+}
+
+Canvas::TwinChunk::~TwinChunk() {
+    for (size_t i = 0; i < twins.size(); ++i) {
+        twins[i]->release();
+    }
+}
+
+// Shapes at index and after moved, so their chunks no longer line up
+void Canvas::markShifted(size_t index) {
+    if (concurrent) {
+        twinStaleFrom = std::min(twinStaleFrom, index / twinChunk);
+    }
+}
+
+// A shape that was never published sits in a shifted chunk already
+void Canvas::markEdited(unsigned id) {
+    if (!concurrent) {
+        return;
+    }
+    std::unordered_map<unsigned, size_t>::const_iterator it = twinChunkOf.find(id);
+    if (it != twinChunkOf.end() && it->second < twinStale.size()) {
+        twinStale[it->second] = 1;
+    }
+}
+
+// Under the write lock. Re-twins the stale chunks and publishes the chunk list, so the
+// cost is the edited chunks plus one pointer per chunk; unchanged chunks are shared
+void Canvas::publishTwins() const {
+    size_t count = (shapes.size() + twinChunk - 1) / twinChunk;
+    if (twinStaleFrom == 0) {
+        twinChunkOf.clear(); // everything is re-twinned, drop the ids that left
+    }
+    twinChunks.resize(count);
+    twinStale.resize(count, 1);
+    size_t total = 0;
+    size_t made = 0;
+    for (size_t c = 0; c < count; ++c) {
+        if (c >= twinStaleFrom || twinStale[c] != 0) {
+            TwinChunk* chunk = new TwinChunk();
+            size_t end = std::min((c + 1) * twinChunk, shapes.size());
+            chunk->twins.reserve(end - c * twinChunk);
+            for (size_t i = c * twinChunk; i < end; ++i) {
+                if (shapes[i] != NULL) {
+                    bool created = false;
+                    Shape* twin = shapes[i]->snapshot(&created);
+                    if (created) {
+                        made += twin->getByteSize();
+                    }
+                    chunk->twins.push_back(twin);
+                    twinChunkOf[twin->id] = c;
+                }
+            }
+            twinChunks[c].reset(chunk);
+            twinStale[c] = 0;
+        }
+        total += twinChunks[c]->twins.size();
+    }
+    twinStaleFrom = count;
+    twinBytes.fetch_add(made, std::memory_order_relaxed);
+
+    TwinList* list = new TwinList();
+    list->chunks = twinChunks;
+    list->epoch = epoch.load(std::memory_order_relaxed);
+    list->nextId = nextId;
+    list->snapshotMode = snapshotMode;
+    list->dirty = dirty;
+    list->count = total;
+    std::atomic_store(&publishedTwins, std::shared_ptr<const TwinList>(list));
+}
+
+// The twins for the current epoch. Without wait, a writer holding the lock means the
+// previous publish is returned rather than waiting for it
+std::shared_ptr<const Canvas::TwinList> Canvas::currentTwins(bool wait) const {
+    std::shared_ptr<const TwinList> twins = std::atomic_load(&publishedTwins);
+    if (twins != NULL && twins->epoch == epoch.load(std::memory_order_acquire)) {
+        return twins;
+    }
+    std::unique_lock<std::recursive_mutex> lock(writeMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        if (twins != NULL && !wait) {
+            return twins;
+        }
+        lock.lock();
+    }
+    twins = std::atomic_load(&publishedTwins);
+    if (twins == NULL || twins->epoch != epoch.load(std::memory_order_relaxed)) {
+        publishTwins();
+        twins = std::atomic_load(&publishedTwins);
+    }
+    return twins;
+}
+
+// A frozen copy over published twins; runs without the write lock
+Canvas* Canvas::fromTwins(const TwinList& list) {
+    Canvas* copy = new Canvas();
+    copy->snapshotMode = list.snapshotMode;
+    copy->nextId = list.nextId;
+    copy->dirty = list.dirty;
+    copy->frozenCopy = true;
+    copy->snapshotEpoch = list.epoch;
+    copy->shapes.reserve(list.count);
+    copy->byId.reserve(list.count);
+    for (size_t c = 0; c < list.chunks.size(); ++c) {
+        const std::vector<Shape*>& twins = list.chunks[c]->twins;
+        for (size_t i = 0; i < twins.size(); ++i) {
+            twins[i]->retain();
+            copy->shapes.push_back(twins[i]);
+            copy->byId[twins[i]->id] = twins[i];
+        }
+    }
+    return copy;
+}
+
+// Readers share one snapshot per epoch, built from the published twins outside the lock.
+// Racing readers each build one; the newest is kept
+std::shared_ptr<const Canvas> Canvas::read() const {
+    if (!concurrent) {
+        return std::shared_ptr<const Canvas>(snapshot());
+    }
+    std::shared_ptr<const Canvas> current = std::atomic_load(&published);
+    if (current != NULL && current->snapshotEpoch == epoch.load(std::memory_order_acquire)) {
+        return current;
+    }
+    std::shared_ptr<const TwinList> twins = currentTwins(false);
+    if (current != NULL && current->snapshotEpoch == twins->epoch) {
+        return current;
+    }
+    std::shared_ptr<const Canvas> built(fromTwins(*twins));
+    do {
+        if (current != NULL && current->snapshotEpoch >= built->snapshotEpoch) {
+            return current;
+        }
+    } while (!std::atomic_compare_exchange_weak(&published, &current, built));
+    return built;
+}
+
+Memento* Canvas::captureCurrent() const{
+    // Concurrent mode captures the published twins, see currentTwins()
+    if (concurrent) {
+        std::shared_ptr<const TwinList> twins = currentTwins(false);
+        ScopedLatency timing(Metrics::captureLatency);
+        std::vector<Shape*> shared;
+        shared.reserve(twins->count);
+        for (size_t c = 0; c < twins->chunks.size(); ++c) {
+            const std::vector<Shape*>& chunk = twins->chunks[c]->twins;
+            for (size_t i = 0; i < chunk.size(); ++i) {
+                chunk[i]->retain();
+                shared.push_back(chunk[i]);
+            }
+        }
+        // The twins published since the last capture count for this one
+        size_t bytes = sizeof(Memento) + shared.capacity() * sizeof(Shape*) + twinBytes.exchange(0, std::memory_order_relaxed);
+        return new Memento(shared, SnapshotMode::Shared, bytes);
+    }
+    ScopedLatency timing(Metrics::captureLatency);
+    OPENCANVAS_LOG(LogLevel::Trace, "canvas", "capturing state of %zu shapes", shapes.size());
+
+    // A snapshot's shapes are twins already, the memento just shares them
+    if (frozenCopy) {
+        std::vector<Shape*> twins;
+        twins.reserve(shapes.size());
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            shapes[i]->retain();
+            twins.push_back(shapes[i]);
+        }
+        size_t bytes = sizeof(Memento) + twins.capacity() * sizeof(Shape*);
+        return new Memento(twins, SnapshotMode::Shared, bytes);
+    }
+    
+    // Create and return a new memento with the current shapes
+    return new Memento(shapes, snapshotMode, snapshotThreads);
+
+}
+
+void Canvas::undoAction(Memento* prev) {
+      if (prev == NULL) {
+        OPENCANVAS_LOG(LogLevel::Warning, "canvas", "cannot undo, no memento provided");
+        return;
+    }
+    std::unique_lock<std::recursive_mutex> lock = lockWrites();
+    restoreFrom(*prev, false);
+}
+
+void Canvas::undoAction(std::unique_ptr<Memento> prev) {
+    if (prev == NULL) {
+        OPENCANVAS_LOG(LogLevel::Warning, "canvas", "cannot undo, no memento provided");
+        return;
+    }
+    std::unique_lock<std::recursive_mutex> lock = lockWrites();
+    restoreFrom(*prev, true);
+}
+
+// Each saved shape comes back the cheapest way it can: a live shape whose twin it is
+// has not changed since the capture and simply stays; with consume set, a saved shape
+// only the memento holds is moved onto the canvas. Anything else is copied, linked to
+// the memento's twin in shared mode so the next capture does not clone again. A consumed
+// memento is left empty and its shape list becomes the canvas's
+void Canvas::restoreFrom(Memento& saved, bool consume) {
+    ScopedLatency timing(Metrics::undoLatency);
+    OPENCANVAS_LOG(LogLevel::Trace, "canvas", "restoring memento over %zu shapes", shapes.size());
+
+    // Shapes still without an owner at the end were not carried over
+    std::vector<Shape*> previous;
+    previous.swap(shapes);
+    for (size_t i = 0; i < previous.size(); ++i) {
+        if (previous[i] != NULL) {
+            previous[i]->owner = NULL;
+        }
+    }
+    if (store != NULL) {
+        store->clear();
+    }
+    if (spatial != NULL) {
+        spatial->clear();
+    }
+
+    if (consume) {
+        shapes.swap(saved.shapesSnapshot);
+    } else {
+        shapes = saved.shapesSnapshot;
+    }
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        Shape* kept = shapes[i];
+        Shape* shape;
+        std::unordered_map<unsigned, Shape*>::iterator live = byId.find(kept->id);
+        if (live != byId.end() && live->second->owner == NULL && live->second->frozen.load(std::memory_order_relaxed) == kept) {
+            shape = live->second;
+        } else if (consume && kept->refs.load(std::memory_order_acquire) == 1) {
+            shape = kept;
+        } else {
+            shape = snapshotMode == SnapshotMode::Shared ? kept->thaw() : cloneShape(*kept);
+        }
+        if (consume && shape != kept) {
+            kept->release(); // the memento's reference
+        }
+
+        shapes[i] = shape;
+        shape->owner = this;
+        if (live != byId.end()) {
+            live->second = shape;
+        } else {
+            byId.emplace(shape->id, shape);
+        }
+        if (store != NULL) {
+            store->insert(*shape);
+        }
+        if (spatial != NULL) {
+            spatial->insert(shape->id, shape->getBounds());
+        }
+        if (shape->id >= nextId) {
+            nextId = shape->id + 1;
+        }
+    }
+
+    for (size_t i = 0; i < previous.size(); ++i) {
+        Shape* shape = previous[i];
+        if (shape == NULL || shape->owner != NULL) {
+            continue;
+        }
+        std::unordered_map<unsigned, Shape*>::iterator entry = byId.find(shape->id);
+        if (entry != byId.end() && entry->second == shape) {
+            byId.erase(entry);
+        }
+        shape->release();
+    }
+    if (consume) {
+        saved.shapesSnapshot.clear(); // the old list, nothing left to release
+    }
+
+    dirty.markAll();
+    markShifted(0);
+    changed();
+    OPENCANVAS_LOG(LogLevel::Debug, "canvas", "state restored, canvas has %zu shapes", shapes.size());
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Raster rendering
+
+Framebuffer::Framebuffer(int width, int height, uint32_t background) : width(0), height(0) {
+    resize(width, height, background);
+}
+
+void Framebuffer::resize(int width, int height, uint32_t background) {
+    this->width = width > 0 ? width : 0;
+    this->height = height > 0 ? height : 0;
+    pixels.assign(static_cast<size_t>(this->width) * static_cast<size_t>(this->height), background);
+}
+
+int Framebuffer::getWidth() const { return width; }
+int Framebuffer::getHeight() const { return height; }
+
+uint32_t Framebuffer::getPixel(int x, int y) const {
+    return pixels[static_cast<size_t>(y) * width + x];
+}
+
+const uint32_t* Framebuffer::row(int y) const {
+    return pixels.data() + static_cast<size_t>(y) * width;
+}
+
+void Framebuffer::fillSpan(int y, int x0, int x1, uint32_t rgba) {
+    uint32_t* out = pixels.data() + static_cast<size_t>(y) * width;
+    uint32_t alpha = rgba & 0xFF;
+    if (alpha == 0xFF) {
+        std::fill(out + x0, out + x1, rgba);
+        return;
+    }
+    uint32_t keep = 255 - alpha;
+    uint32_t r = (rgba >> 24) * alpha;
+    uint32_t g = ((rgba >> 16) & 0xFF) * alpha;
+    uint32_t b = ((rgba >> 8) & 0xFF) * alpha;
+    uint32_t a = alpha * 255;
+    for (int x = x0; x < x1; ++x) {
+        uint32_t dst = out[x];
+        uint32_t outR = (r + (dst >> 24) * keep) / 255;
+        uint32_t outG = (g + ((dst >> 16) & 0xFF) * keep) / 255;
+        uint32_t outB = (b + ((dst >> 8) & 0xFF) * keep) / 255;
+        uint32_t outA = (a + (dst & 0xFF) * keep) / 255;
+        out[x] = (outR << 24) | (outG << 16) | (outB << 8) | outA;
+    }
+}
+
+void Framebuffer::clear(const Bounds& area, uint32_t rgba) {
+    for (int y = area.minY; y < area.maxY; ++y) {
+        uint32_t* out = pixels.data() + static_cast<size_t>(y) * width;
+        std::fill(out + area.minX, out + area.maxX, rgba);
+    }
+}
+
+namespace {
+// One shape ready to paint, already moved into framebuffer space and clipped to it
+struct Paint {
+    Bounds area;
+    uint32_t rgba;
+};
+}
+
+// Threads shared by every render and encode, started once. Never destroyed, like the
+// global shape pool, so exports finishing during static destruction still have them
+static TaskScheduler& renderWorkers() {
+    static TaskScheduler* workers = new TaskScheduler();
+    return *workers;
+}
+
+// Runs work on the calling thread and on up to helpers render workers at once. work
+// shares its items out itself; a helper that only starts once the caller is done skips
+// it, so the caller never waits for a worker busy elsewhere
+static void runShared(size_t helpers, const std::function<void()>& work) {
+    struct Share {
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t running = 0;
+        bool closed = false;
+    };
+    std::shared_ptr<Share> share = std::make_shared<Share>();
+    for (size_t i = 0; i < helpers; ++i) {
+        renderWorkers().submit([share, &work]() {
+            {
+                std::lock_guard<std::mutex> lock(share->mutex);
+                if (share->closed) {
+                    return;
+                }
+                ++share->running;
+            }
+            work();
+            std::lock_guard<std::mutex> lock(share->mutex);
+            if (--share->running == 0) {
+                share->finished.notify_all();
+            }
+        });
+    }
+    work();
+    std::unique_lock<std::mutex> lock(share->mutex);
+    share->closed = true;
+    share->finished.wait(lock, [&share]() { return share->running == 0; });
+}
+
+SceneItem ExportScene::describe(const Shape& shape) {
+    SceneItem item;
+    item.bounds = shape.getBounds();
+    item.rgba = shape.getColourRgba();
+    item.shape = &shape;
+    item.textSize = 0;
+    item.ink = 0x000000FF;
+    if (shape.getKind() == ShapeKind::Textbox) {
+        // Dark fills get white text, light ones black
+        uint32_t rgba = item.rgba;
+        uint32_t luma = (rgba >> 24) * 299 + ((rgba >> 16) & 0xFF) * 587 + ((rgba >> 8) & 0xFF) * 114;
+        item.ink = luma < 128000 ? 0xFFFFFFFF : 0x000000FF;
+        int height = item.bounds.maxY - item.bounds.minY;
+        item.textSize = height >= 14 ? 12 : std::max(height - 2, 1);
+    }
+    return item;
+}
+
+void ExportScene::build(const Canvas& canvas) {
+    items.clear();
+    items.reserve(canvas.size());
+    Bounds box = { 0, 0, 0, 0 };
+    canvas.forEach([&](const Shape& shape) {
+        SceneItem item = describe(shape);
+        box.expand(item.bounds);
+        items.push_back(item);
+    });
+    bounds = box;
+}
+
+const std::vector<SceneItem>& ExportScene::getItems() const {
+    return items;
+}
+
+const Bounds& ExportScene::getBounds() const {
+    return bounds;
+}
+
+void Rasterizer::render(const Canvas& canvas, Framebuffer& target, const RasterOptions& options) {
+    render(canvas, target, options, std::function<bool(int)>());
+}
+
+void Rasterizer::render(const Canvas& canvas, Framebuffer& target, const RasterOptions& options,
+                        const std::function<bool(int rowsDone)>& onBand) {
+    ExportScene scene;
+    scene.build(canvas);
+    render(scene, target, options, onBand);
+}
+
+void Rasterizer::render(const ExportScene& scene, Framebuffer& target, const RasterOptions& options,
+                        const std::function<bool(int rowsDone)>& onBand,
+                        const std::vector<unsigned char>* tileMask) {
+    int width = target.getWidth();
+    int height = target.getHeight();
+    int tileSize = options.tileSize > 0 ? options.tileSize : 256;
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    Bounds frame = { 0, 0, width, height };
+    const std::vector<SceneItem>& items = scene.getItems();
+    std::vector<Paint> paints;
+    paints.reserve(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        const Bounds& b = items[i].bounds;
+        Paint paint;
+        paint.area.minX = std::max(b.minX - options.originX, 0);
+        paint.area.minY = std::max(b.minY - options.originY, 0);
+        paint.area.maxX = std::min(b.maxX - options.originX, width);
+        paint.area.maxY = std::min(b.maxY - options.originY, height);
+        paint.rgba = items[i].rgba;
+        if ((paint.rgba & 0xFF) != 0 && paint.area.intersects(frame)) {
+            paints.push_back(paint);
+        }
+    }
+
+    // Bin shapes per tile, keeping canvas order inside every bin
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    std::vector<std::vector<unsigned> > bins(static_cast<size_t>(tilesX) * tilesY);
+    if (tileMask != NULL && tileMask->size() != bins.size()) {
+        tileMask = NULL;
+    }
+    for (size_t i = 0; i < paints.size(); ++i) {
+        const Bounds& a = paints[i].area;
+        for (int ty = a.minY / tileSize; ty <= (a.maxY - 1) / tileSize; ++ty) {
+            for (int tx = a.minX / tileSize; tx <= (a.maxX - 1) / tileSize; ++tx) {
+                size_t tile = static_cast<size_t>(ty) * tilesX + tx;
+                if (tileMask == NULL || (*tileMask)[tile]) {
+                    bins[tile].push_back(static_cast<unsigned>(i));
+                }
+            }
+        }
+    }
+
+    // Without a callback the whole frame is one band
+    size_t bandTiles = onBand ? static_cast<size_t>(tilesX) : bins.size();
+    size_t threads = options.threads != 0 ? options.threads : std::thread::hardware_concurrency();
+    threads = std::min(std::max(threads, static_cast<size_t>(1)), bandTiles);
+
+    for (size_t bandStart = 0; bandStart < bins.size(); bandStart += bandTiles) {
+        size_t bandEnd = bandStart + bandTiles;
+        std::atomic<size_t> nextTile(bandStart);
+        auto work = [&]() {
+            for (size_t tile = nextTile++; tile < bandEnd; tile = nextTile++) {
+                if (tileMask != NULL && !(*tileMask)[tile]) {
+                    continue;
+                }
+                int x0 = static_cast<int>(tile % tilesX) * tileSize;
+                int y0 = static_cast<int>(tile / tilesX) * tileSize;
+                int x1 = std::min(x0 + tileSize, width);
+                int y1 = std::min(y0 + tileSize, height);
+                if (tileMask != NULL) {
+                    Bounds area = { x0, y0, x1, y1 };
+                    target.clear(area, options.background);
+                }
+                const std::vector<unsigned>& bin = bins[tile];
+                for (size_t i = 0; i < bin.size(); ++i) {
+                    const Paint& paint = paints[bin[i]];
+                    int spanX0 = std::max(paint.area.minX, x0);
+                    int spanX1 = std::min(paint.area.maxX, x1);
+                    int spanY1 = std::min(paint.area.maxY, y1);
+                    for (int y = std::max(paint.area.minY, y0); y < spanY1; ++y) {
+                        target.fillSpan(y, spanX0, spanX1, paint.rgba);
+                    }
+                }
+            }
+        };
+
+        size_t marked = bandTiles;
+        if (tileMask != NULL) {
+            marked = static_cast<size_t>(std::count(tileMask->begin() + bandStart, tileMask->begin() + bandEnd, 1));
+        }
+        if (marked > 0) {
+            runShared(std::min(threads, marked) - 1, work);
+        }
+
+        if (onBand) {
+            int rowsDone = std::min(static_cast<int>(bandEnd / tilesX) * tileSize, height);
+            if (!onBand(rowsDone)) {
+                return;
+            }
+        }
+    }
+}
+
+// Deflate output, packed least significant bit first
+class DeflateWriter {
+public:
+    std::vector<unsigned char> bytes;
+    uint32_t buffer = 0;
+    int used = 0;
+
+    void bits(uint32_t value, int count) {
+        buffer |= value << used;
+        used += count;
+        while (used >= 8) {
+            bytes.push_back(static_cast<unsigned char>(buffer));
+            buffer >>= 8;
+            used -= 8;
+        }
+    }
+
+    // Huffman codes go out most significant bit first
+    void code(uint32_t value, int length) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; ++i) {
+            reversed = (reversed << 1) | ((value >> i) & 1);
+        }
+        bits(reversed, length);
+    }
+
+    void flush() {
+        if (used > 0) {
+            bytes.push_back(static_cast<unsigned char>(buffer));
+        }
+        buffer = 0;
+        used = 0;
+    }
+
+    // Fixed literal/length code (RFC 1951, 3.2.6)
+    void symbol(unsigned value) {
+        if (value < 144) code(0x30 + value, 8);
+        else if (value < 256) code(0x190 + value - 144, 9);
+        else if (value < 280) code(value - 256, 7);
+        else code(0xC0 + value - 280, 8);
+    }
+
+    void match(unsigned length, unsigned distanceCode) {
+        static const unsigned base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                           35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const int extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                       3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        unsigned index = 28;
+        while (base[index] > length) {
+            --index;
+        }
+        symbol(257 + index);
+        bits(length - base[index], extra[index]);
+        code(distanceCode, 5);
+    }
+};
+
+namespace {
+struct CrcTable {
+    uint32_t entries[256];
+
+    CrcTable() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[n] = c;
+        }
+    }
+};
+
+const uint32_t* crcTable() {
+    static const CrcTable table;
+    return table.entries;
+}
+
+void putBigEndian(std::vector<unsigned char>& out, uint32_t value) {
+    out.push_back(static_cast<unsigned char>(value >> 24));
+    out.push_back(static_cast<unsigned char>(value >> 16));
+    out.push_back(static_cast<unsigned char>(value >> 8));
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+void putChunk(std::ostream& out, const char* type, const unsigned char* data, size_t length) {
+    const uint32_t* table = crcTable();
+    std::vector<unsigned char> head;
+    putBigEndian(head, static_cast<uint32_t>(length));
+    head.insert(head.end(), type, type + 4);
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 4; i < head.size(); ++i) {
+        crc = table[(crc ^ head[i]) & 0xFF] ^ (crc >> 8);
+    }
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    std::vector<unsigned char> tail;
+    putBigEndian(tail, crc ^ 0xFFFFFFFFu);
+
+    out.write(reinterpret_cast<const char*>(head.data()), static_cast<std::streamsize>(head.size()));
+    out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(length));
+    out.write(reinterpret_cast<const char*>(tail.data()), static_cast<std::streamsize>(tail.size()));
+}
+}
+
+PngEncoder::~PngEncoder() {
+    delete deflate;
+}
+
+bool PngEncoder::begin(std::ostream& stream, int width, int height) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    out = &stream;
+    this->width = width;
+    this->height = height;
+    rowsWritten = 0;
+    adler = 1;
+    out->write(reinterpret_cast<const char*>(signature), 8);
+
+    std::vector<unsigned char> header;
+    putBigEndian(header, static_cast<uint32_t>(width));
+    putBigEndian(header, static_cast<uint32_t>(height));
+    header.push_back(8); // bit depth
+    header.push_back(6); // RGBA
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    putChunk(*out, "IHDR", header.data(), header.size());
+
+    // zlib stream, one fixed-Huffman block per band
+    delete deflate;
+    deflate = new DeflateWriter();
+    deflate->bytes.push_back(0x78);
+    deflate->bytes.push_back(0x01);
+    return static_cast<bool>(*out);
+}
+
+// Adler-32 of two pieces joined, from the checksums of the pieces (as zlib's adler32_combine)
+static uint32_t adlerCombine(uint32_t first, uint32_t second, size_t secondLength) {
+    const uint64_t base = 65521;
+    uint64_t rem = secondLength % base;
+    uint64_t sum1 = first & 0xFFFF;
+    uint64_t sum2 = (rem * sum1) % base;
+    sum1 += (second & 0xFFFF) + base - 1;
+    sum2 += ((first >> 16) & 0xFFFF) + ((second >> 16) & 0xFFFF) + base - rem;
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= (base << 1)) sum2 -= (base << 1);
+    if (sum2 >= base) sum2 -= base;
+    return static_cast<uint32_t>(sum1 | (sum2 << 16));
+}
+
+// Each scanline is "filter none" and its pixels. A byte that repeats the one four
+// back (the same channel of the previous pixel) becomes a match
+void PngEncoder::addRows(const Framebuffer& image, int y0, int y1, PngSegment* keep) {
+    if (deflate == NULL) {
+        return;
+    }
+    size_t start = deflate->bytes.size();
+    deflate->bits(0, 1); // not the final block
+    deflate->bits(1, 2); // fixed codes
+
+    uint32_t adlerA = 1;
+    uint32_t adlerB = 0;
+    int rows = 0;
+    size_t stride = static_cast<size_t>(width) * 4 + 1;
+    std::vector<unsigned char> line(stride);
+    for (int y = y0; y < y1 && rowsWritten < height; ++y, ++rowsWritten, ++rows) {
+        const uint32_t* pixels = image.row(y);
+        line[0] = 0;
+        for (int x = 0; x < width; ++x) {
+            line[1 + 4 * x] = static_cast<unsigned char>(pixels[x] >> 24);
+            line[2 + 4 * x] = static_cast<unsigned char>(pixels[x] >> 16);
+            line[3 + 4 * x] = static_cast<unsigned char>(pixels[x] >> 8);
+            line[4 + 4 * x] = static_cast<unsigned char>(pixels[x]);
+        }
+        for (size_t i = 0; i < stride; ++i) {
+            adlerA = (adlerA + line[i]) % 65521;
+            adlerB = (adlerB + adlerA) % 65521;
+        }
+
+        size_t i = 0;
+        while (i < stride) {
+            size_t run = 0;
+            if (i >= 4) {
+                while (i + run < stride && run < 258 && line[i + run] == line[i + run - 4]) {
+                    ++run;
+                }
+            }
+            if (run >= 3) {
+                deflate->match(static_cast<unsigned>(run), 3); // distance code 3 is distance 4
+                i += run;
+            } else {
+                deflate->symbol(line[i]);
+                ++i;
+            }
+        }
+    }
+    deflate->symbol(256); // end of block
+    // An empty stored block brings the stream back to a byte boundary
+    deflate->bits(0, 3);
+    deflate->flush();
+    deflate->bytes.push_back(0x00);
+    deflate->bytes.push_back(0x00);
+    deflate->bytes.push_back(0xFF);
+    deflate->bytes.push_back(0xFF);
+
+    uint32_t bandAdler = (adlerB << 16) | adlerA;
+    size_t rawBytes = stride * rows;
+    adler = adlerCombine(adler, bandAdler, rawBytes);
+    if (keep != NULL) {
+        keep->bytes.assign(deflate->bytes.begin() + start, deflate->bytes.end());
+        keep->adler = bandAdler;
+        keep->rawBytes = rawBytes;
+        keep->rows = rows;
+    }
+    flushChunks(false);
+}
+
+void PngEncoder::addSegment(const PngSegment& band) {
+    if (deflate == NULL || rowsWritten + band.rows > height) {
+        return;
+    }
+    deflate->bytes.insert(deflate->bytes.end(), band.bytes.begin(), band.bytes.end());
+    adler = adlerCombine(adler, band.adler, band.rawBytes);
+    rowsWritten += band.rows;
+    flushChunks(false);
+}
+
+// Writes finished compressed bytes out as IDAT chunks once enough have built up
+void PngEncoder::flushChunks(bool all) {
+    const size_t chunkBytes = 1 << 16;
+    if (deflate->bytes.empty() || (!all && deflate->bytes.size() < chunkBytes)) {
+        return;
+    }
+    putChunk(*out, "IDAT", deflate->bytes.data(), deflate->bytes.size());
+    deflate->bytes.clear();
+}
+
+bool PngEncoder::finish() {
+    if (deflate == NULL) {
+        return false;
+    }
+    deflate->bits(1, 1); // empty final block
+    deflate->bits(1, 2);
+    deflate->symbol(256);
+    deflate->flush();
+    putBigEndian(deflate->bytes, adler);
+    flushChunks(true);
+    putChunk(*out, "IEND", NULL, 0);
+
+    delete deflate;
+    deflate = NULL;
+    bool ok = rowsWritten == height && static_cast<bool>(*out);
+    out = NULL;
+    return ok;
+}
+
+bool PngEncoder::isOpen() const {
+    return deflate != NULL;
+}
+
+std::vector<unsigned char> PngEncoder::encode(const Framebuffer& image) {
+    std::ostringstream buffer;
+    PngEncoder encoder;
+    encoder.begin(buffer, image.getWidth(), image.getHeight());
+    encoder.addRows(image, 0, image.getHeight());
+    encoder.finish();
+    std::string bytes = buffer.str();
+    return std::vector<unsigned char>(bytes.begin(), bytes.end());
+}
+
+bool PngEncoder::writeFile(const Framebuffer& image, const std::string& path) {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    if (!out) {
+        return false;
+    }
+    PngEncoder encoder;
+    encoder.begin(out, image.getWidth(), image.getHeight());
+    encoder.addRows(image, 0, image.getHeight());
+    return encoder.finish();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Streaming PDF writer
+// Objects: 1 catalog, 2 page tree, 3 page, 4 font, 5 content stream, 6 its length
+
+void PdfStreamWriter::print(const char* format, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length > 0) {
+        out.write(buffer, std::min(length, static_cast<int>(sizeof(buffer)) - 1));
+    }
+}
+
+void PdfStreamWriter::beginObject(int number) {
+    offsets[number] = out.tellp();
+    print("%d 0 obj\n", number);
+}
+
+bool PdfStreamWriter::begin(const std::string& path, const Bounds& pageBox) {
+    out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    this->path = path;
+    page = pageBox;
+    for (int i = 0; i < 7; ++i) {
+        offsets[i] = 0;
+    }
+    alphas.reset();
+    open = true;
+
+    print("%%PDF-1.4\n%%\xE2\xE3\xCF\xD3\n");
+    beginObject(5);
+    print("<< /Length 6 0 R >>\nstream\n");
+    streamStart = out.tellp();
+    return static_cast<bool>(out);
+}
+
+// The colour operator, preceded by the graphics state /A<alpha> for translucent colours
+static void pdfColour(char* buffer, size_t size, uint32_t rgba, const char* op) {
+    uint32_t alpha = rgba & 0xFF;
+    int used = alpha == 255 ? 0 : std::snprintf(buffer, size, "/A%u gs ", alpha);
+    std::snprintf(buffer + used, size - used, "%.3f %.3f %.3f %s", (rgba >> 24) / 255.0, ((rgba >> 16) & 0xFF) / 255.0,
+                  ((rgba >> 8) & 0xFF) / 255.0, op);
+}
+
+void PdfStreamWriter::fillRect(const Bounds& area, uint32_t rgba) {
+    uint32_t alpha = rgba & 0xFF;
+    if (!open || area.isEmpty() || alpha == 0) {
+        return;
+    }
+    char colour[64];
+    pdfColour(colour, sizeof(colour), rgba, "rg");
+    if (alpha == 255) {
+        print("%s %d %d %d %d re f\n", colour, area.minX - page.minX, page.maxY - area.maxY,
+              area.maxX - area.minX, area.maxY - area.minY);
+    } else {
+        alphas.set(alpha);
+        print("q %s %d %d %d %d re f Q\n", colour, area.minX - page.minX, page.maxY - area.maxY,
+              area.maxX - area.minX, area.maxY - area.minY);
+    }
+}
+
+// (x, y) is the top left of the text line. Only Latin-1 survives the standard font,
+// bytes outside printable ASCII are written as octal escapes
+void PdfStreamWriter::text(int x, int y, int size, std::string_view value, uint32_t rgba) {
+    uint32_t alpha = rgba & 0xFF;
+    if (!open || value.empty() || alpha == 0) {
+        return;
+    }
+    char colour[64];
+    pdfColour(colour, sizeof(colour), rgba, "rg");
+    if (alpha != 255) {
+        alphas.set(alpha);
+        print("q ");
+    }
+    print("BT %s /F1 %d Tf %d %d Td (", colour, size, x - page.minX, page.maxY - y - size);
+    for (size_t i = 0; i < value.size(); ++i) {
+        unsigned char c = static_cast<unsigned char>(value[i]);
+        if (c == '(' || c == ')' || c == '\\') {
+            out.put('\\');
+            out.put(static_cast<char>(c));
+        } else if (c < 32 || c > 126) {
+            print("\\%03o", c);
+        } else {
+            out.put(static_cast<char>(c));
+        }
+    }
+    print(alpha == 255 ? ") Tj ET\n" : ") Tj ET Q\n");
+}
+
+bool PdfStreamWriter::finish() {
+    if (!open) {
+        return false;
+    }
+    open = false;
+    std::streamoff length = out.tellp() - streamStart;
+    print("\nendstream\nendobj\n");
+
+    beginObject(6);
+    print("%lld\nendobj\n", static_cast<long long>(length));
+    beginObject(4);
+    print("<< /Type /Font /Subtype /Type1 /BaseFont /Helvetica /Encoding /WinAnsiEncoding >>\nendobj\n");
+    beginObject(3);
+    print("<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %d %d] /Contents 5 0 R /Resources << /Font << /F1 4 0 R >>",
+          page.maxX - page.minX, page.maxY - page.minY);
+    if (alphas.any()) {
+        print(" /ExtGState <<");
+        for (unsigned alpha = 1; alpha < 255; ++alpha) {
+            if (alphas.test(alpha)) {
+                print(" /A%u << /ca %.3f /CA %.3f >>", alpha, alpha / 255.0, alpha / 255.0);
+            }
+        }
+        print(" >>");
+    }
+    print(" >> >>\nendobj\n");
+    beginObject(2);
+    print("<< /Type /Pages /Kids [3 0 R] /Count 1 >>\nendobj\n");
+    beginObject(1);
+    print("<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+
+    std::streamoff xref = out.tellp();
+    print("xref\n0 7\n0000000000 65535 f \n");
+    for (int i = 1; i < 7; ++i) {
+        print("%010lld 00000 n \n", static_cast<long long>(offsets[i]));
+    }
+    print("trailer\n<< /Size 7 /Root 1 0 R >>\nstartxref\n%lld\n%%%%EOF\n", static_cast<long long>(xref));
+    out.close();
+    return !out.fail();
+}
+
+void PdfStreamWriter::abandon() {
+    if (!open) {
+        return;
+    }
+    open = false;
+    out.close();
+    std::remove(path.c_str());
+}
+
+bool PdfStreamWriter::isOpen() const {
+    return open;
+}
+
+
+//template method
+
+ExportCanvas::ExportCanvas(Canvas* c) : canvas(c) {
+    OPENCANVAS_LOG(LogLevel::Trace, "export", "exporter created for a canvas with %zu shapes", canvas ? canvas->size() : 0);
+}
+
+ExportJob::ExportJob() : progress(0), cancelRequested(false), failed(false) {}
+
+void ExportJob::cancel() {
+    cancelRequested.store(true);
+}
+
+bool ExportJob::isCancelled() const {
+    return cancelRequested.load();
+}
+
+double ExportJob::getProgress() const {
+    return progress.load(std::memory_order_relaxed) / 1000.0;
+}
+
+bool ExportJob::isDone() const {
+    return task.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void ExportJob::wait() const {
+    task.wait();
+}
+
+bool ExportJob::get() {
+    return task.valid() ? task.get() : false;
+}
+
+void ExportCanvas::reportProgress(double done) {
+    if (job != NULL) {
+        job->progress.store(static_cast<int>(done * 1000), std::memory_order_relaxed);
+    }
+}
+
+void ExportCanvas::reportFailure() {
+    if (job != NULL) {
+        job->failed.store(true);
+    }
+}
+
+bool ExportCanvas::isCancelled() const {
+    return job != NULL && job->isCancelled();
+}
+
+bool ExportCanvas::usesScene() const {
+    return true;
+}
+
+// Runs the template method against another canvas (and scene) for one job
+bool ExportCanvas::runOn(const Canvas* target, const ExportScene* shared, ExportJob* running) {
+    const Canvas* live = canvas;
+    canvas = target;
+    scene = shared;
+    job = running;
+    exportCanvas();
+    job = NULL;
+    scene = NULL;
+    canvas = live;
+
+    bool ok = target != NULL && !running->isCancelled() && !running->failed.load();
+    if (ok) {
+        running->progress.store(1000);
+    }
+    return ok;
+}
+
+ExportJob* ExportCanvas::exportAsync() {
+    ExportJob* running = new ExportJob();
+    std::shared_ptr<const Canvas> frozen;
+    if (canvas != NULL) {
+        frozen = canvas->read();
+    }
+    running->task = std::async(std::launch::async, [this, frozen, running]() {
+        return runOn(frozen.get(), NULL, running);
+    });
+    return running;
+}
+
+//Template method
+void ExportCanvas::exportCanvas() {
+
+    
+    if (canvas == NULL) {
+        OPENCANVAS_LOG(LogLevel::Error, "export", "no canvas to export");
+        return;
+    }
+
+    OPENCANVAS_LOG(LogLevel::Info, "export", "exporting canvas with %zu shapes", canvas->size());
+    
+    // The steps read the shapes from a scene, gathered here unless a batch shares one
+    // or the exporter streams from the canvas
+    ExportScene own;
+    bool shared = scene != NULL;
+    if (!shared && usesScene()) {
+        own.build(*canvas);
+        scene = &own;
+    }
+
+    // Template method algorithm - calls abstract methods in specific order
+    {
+        ScopedLatency timing(Metrics::exportPrepareLatency);
+        prepareCanvas();     // Step 1: Prepare the canvas for export
+    }
+    if (!isCancelled()) {
+        ScopedLatency timing(Metrics::exportRenderLatency);
+        renderElements();    // Step 2: Render all elements
+    }
+    {
+        ScopedLatency timing(Metrics::exportSaveLatency);
+        saveToFile();        // Step 3: Save to specific file format, or drop it when cancelled
+    }
+
+    if (!shared) {
+        scene = NULL;
+    }
+    
+    OPENCANVAS_LOG(LogLevel::Info, "export", "export finished%s", isCancelled() ? " (cancelled)" : "");
+}
+
+
+PNGExporter::PNGExporter(Canvas* c) : ExportCanvas(c) {
+}
+
+void PNGExporter::setOptions(const RasterOptions& o) { options = o; }
+const RasterOptions& PNGExporter::getOptions() const { return options; }
+void PNGExporter::setOutputPath(const std::string& p) { path = p; }
+const std::string& PNGExporter::getOutputPath() const { return path; }
+const Framebuffer& PNGExporter::getFramebuffer() const { return framebuffer; }
+
+PDFExporter::PDFExporter(Canvas* c) : ExportCanvas(c) {
+}
+
+void PDFExporter::setOutputPath(const std::string& p) { path = p; }
+const std::string& PDFExporter::getOutputPath() const { return path; }
+
+// Sizes the framebuffer, either to the options or to the shapes' bounding box
+static bool sameFrame(const RasterOptions& a, const RasterOptions& b) {
+    return a.width == b.width && a.height == b.height && a.originX == b.originX && a.originY == b.originY &&
+           a.background == b.background && a.tileSize == b.tileSize;
+}
+
+// Sizes the framebuffer and works out whether the previous output can be patched:
+// same canvas, same frame and a dirty log that reaches back to the last export
+void PNGExporter::prepareCanvas() {
+    OPENCANVAS_LOG(LogLevel::Debug, "png", "preparing canvas");
+    if (options.fitToShapes) {
+        Bounds box = scene->getBounds();
+        options.originX = box.minX;
+        options.originY = box.minY;
+        options.width = box.isEmpty() ? 1 : box.maxX - box.minX;
+        options.height = box.isEmpty() ? 1 : box.maxY - box.minY;
+    }
+    if (options.tileSize <= 0) {
+        options.tileSize = 256;
+    }
+    int tilesX = (std::max(options.width, 0) + options.tileSize - 1) / options.tileSize;
+    int tilesY = (std::max(options.height, 0) + options.tileSize - 1) / options.tileSize;
+
+    const DirtyLog& log = canvas->getDirtyLog();
+    std::vector<Bounds> regions;
+    incremental = cached && log.getOrigin() == cachedOrigin && sameFrame(options, cachedOptions) &&
+                  log.collect(cachedRevision, regions);
+    if (incremental) {
+        tileMask.assign(static_cast<size_t>(tilesX) * tilesY, 0);
+        Bounds frame = { 0, 0, options.width, options.height };
+        for (size_t i = 0; i < regions.size(); ++i) {
+            Bounds area = regions[i];
+            area.minX = std::max(area.minX - options.originX, 0);
+            area.minY = std::max(area.minY - options.originY, 0);
+            area.maxX = std::min(area.maxX - options.originX, options.width);
+            area.maxY = std::min(area.maxY - options.originY, options.height);
+            if (!area.intersects(frame)) {
+                continue;
+            }
+            for (int ty = area.minY / options.tileSize; ty <= (area.maxY - 1) / options.tileSize; ++ty) {
+                for (int tx = area.minX / options.tileSize; tx <= (area.maxX - 1) / options.tileSize; ++tx) {
+                    tileMask[static_cast<size_t>(ty) * tilesX + tx] = 1;
+                }
+            }
+        }
+        redrawnTiles = static_cast<size_t>(std::count(tileMask.begin(), tileMask.end(), 1));
+    } else {
+        tileMask.clear();
+        framebuffer.resize(options.width, options.height, options.background);
+        bands.assign(tilesY, PngSegment());
+        redrawnTiles = static_cast<size_t>(tilesX) * tilesY;
+    }
+
+    // Remembered now, trusted only once this export has been saved
+    cached = false;
+    cachedOrigin = log.getOrigin();
+    cachedRevision = log.getRevision();
+    cachedOptions = options;
+
+    file.open(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file || !encoder.begin(file, framebuffer.getWidth(), framebuffer.getHeight())) {
+        OPENCANVAS_LOG(LogLevel::Error, "png", "could not open %s", path.c_str());
+        file.close();
+    }
+}
+
+// Each finished band of rows is compressed on a render worker while the next band
+// renders, so encoding overlaps rasterization instead of following it. Bands with
+// no redrawn tile reuse their compressed bytes from the previous export
+void PNGExporter::renderElements() {
+    OPENCANVAS_LOG(LogLevel::Debug, "png", "rendering elements");
+    std::future<void> encoding;
+    int encodedRows = 0;
+    size_t tilesX = (framebuffer.getWidth() + options.tileSize - 1) / options.tileSize;
+    Rasterizer::render(*scene, framebuffer, options, [&](int rowsDone) {
+        if (encoder.isOpen()) {
+            if (encoding.valid()) {
+                encoding.get();
+            }
+            size_t band = static_cast<size_t>(encodedRows / options.tileSize);
+            bool redrawn = !incremental || std::count(tileMask.begin() + band * tilesX,
+                                                      tileMask.begin() + (band + 1) * tilesX, 1) > 0;
+            int from = encodedRows;
+            encodedRows = rowsDone;
+            if (redrawn) {
+                PngSegment* keep = &bands[band];
+                std::shared_ptr<std::promise<void>> encoded = std::make_shared<std::promise<void>>();
+                encoding = encoded->get_future();
+                renderWorkers().submit([this, from, rowsDone, keep, encoded]() {
+                    try {
+                        encoder.addRows(framebuffer, from, rowsDone, keep);
+                        encoded->set_value();
+                    } catch (...) {
+                        encoded->set_exception(std::current_exception());
+                    }
+                });
+            } else {
+                encoder.addSegment(bands[band]);
+            }
+        }
+        reportProgress(0.99 * rowsDone / framebuffer.getHeight());
+        return !isCancelled();
+    }, incremental ? &tileMask : NULL);
+    if (encoding.valid()) {
+        encoding.get();
+    }
+}
+
+void PNGExporter::saveToFile() {
+    OPENCANVAS_LOG(LogLevel::Debug, "png", "saving %s", path.c_str());
+    if (!encoder.isOpen()) {
+        reportFailure();
+        return;
+    }
+    if (isCancelled()) {
+        encoder.finish();
+        file.close();
+        std::remove(path.c_str());
+        return;
+    }
+    bool ok = encoder.finish();
+    file.close();
+    if (!ok || file.fail()) {
+        OPENCANVAS_LOG(LogLevel::Error, "png", "could not write %s", path.c_str());
+        reportFailure();
+        return;
+    }
+    cached = true;
+}
+
+bool PNGExporter::wasIncremental() const {
+    return incremental;
+}
+
+size_t PNGExporter::getRedrawnTiles() const {
+    return redrawnTiles;
+}
+
+bool PDFExporter::usesScene() const {
+    return false;
+}
+
+// Opens the file and the page content stream, the page covers the shapes' bounding box
+void PDFExporter::prepareCanvas() {
+    OPENCANVAS_LOG(LogLevel::Debug, "pdf", "preparing canvas");
+    Bounds page = { 0, 0, 0, 0 };
+    if (scene != NULL) {
+        page = scene->getBounds();
+    } else {
+        canvas->forEach([&](const Shape& shape) { page.expand(shape.getBounds()); });
+    }
+    if (page.isEmpty()) {
+        page.maxX = page.minX + 1;
+        page.maxY = page.minY + 1;
+    }
+    if (!writer.begin(path, page)) {
+        OPENCANVAS_LOG(LogLevel::Error, "pdf", "could not open %s", path.c_str());
+    }
+}
+
+// Shapes go to disk one by one, described as they are reached, so only one item is
+// held at a time. Fills are rectangles, textbox text goes on top of its box
+void PDFExporter::renderElements() {
+    OPENCANVAS_LOG(LogLevel::Debug, "pdf", "rendering elements");
+    if (!writer.isOpen()) {
+        return;
+    }
+    const std::vector<SceneItem>* items = scene != NULL ? &scene->getItems() : NULL;
+    ShapeView shapes = canvas->view();
+    size_t count = items != NULL ? items->size() : shapes.size();
+    for (size_t i = 0; i < count; ++i) {
+        if ((i & 1023) == 0) {
+            reportProgress(0.99 * i / count);
+            if (isCancelled()) {
+                return;
+            }
+        }
+        if (items != NULL) {
+            draw((*items)[i]);
+        } else if (shapes[i] != NULL) {
+            draw(ExportScene::describe(*shapes[i]));
+        }
+    }
+}
+
+void PDFExporter::draw(const SceneItem& item) {
+    writer.fillRect(item.bounds, item.rgba);
+    if (item.textSize > 0) {
+        writer.text(item.bounds.minX + 2, item.bounds.minY + 1, item.textSize,
+                    static_cast<const Textbox*>(item.shape)->getTextView(), item.ink);
+    }
+}
+
+void PDFExporter::saveToFile() {
+    OPENCANVAS_LOG(LogLevel::Debug, "pdf", "saving %s", path.c_str());
+    if (isCancelled()) {
+        writer.abandon();
+        return;
+    }
+    if (!writer.finish()) {
+        OPENCANVAS_LOG(LogLevel::Error, "pdf", "could not write %s", path.c_str());
+        reportFailure();
+    }
+}
+
+
+ExportBatch::ExportBatch(Canvas* c) : canvas(c) {}
+
+void ExportBatch::add(ExportCanvas* exporter) {
+    if (exporter != NULL) {
+        exporters.push_back(exporter);
+    }
+}
+
+size_t ExportBatch::size() const {
+    return exporters.size();
+}
+
+bool ExportBatch::run() {
+    if (canvas == NULL) {
+        OPENCANVAS_LOG(LogLevel::Error, "export", "no canvas to export");
+        return false;
+    }
+    std::shared_ptr<const Canvas> frozen = canvas->read();
+    ExportScene scene;
+    scene.build(*frozen);
+
+    std::vector<ExportJob*> jobs;
+    for (size_t i = 0; i < exporters.size(); ++i) {
+        ExportJob* running = new ExportJob();
+        ExportCanvas* exporter = exporters[i];
+        const Canvas* target = frozen.get();
+        running->task = std::async(std::launch::async, [exporter, target, &scene, running]() {
+            return exporter->runOn(target, &scene, running);
+        });
+        jobs.push_back(running);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        ok = jobs[i]->get() && ok;
+        delete jobs[i];
+    }
+    return ok;
+}
+
+/*void PDFExporter::saveToFile() {
+    std::cout << "File saved";
+
+
+} */
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Binary board files
+// Header: 0 magic, 4 version, 8 record count, 16 text offset, 24 text bytes, 32 colour offset,
+// 40 colour count, 44 reserved. Record: 0 kind, 1-3 zero, 4 colour index, 8 length, 12 width,
+// 16 x, 20 y, 24 text offset within the blob, 28 text length
+
+static const char canvasFileMagic[4] = { 'O', 'C', 'N', 'B' };
+
+static void storeLE32(unsigned char* at, uint32_t value) {
+    at[0] = static_cast<unsigned char>(value);
+    at[1] = static_cast<unsigned char>(value >> 8);
+    at[2] = static_cast<unsigned char>(value >> 16);
+    at[3] = static_cast<unsigned char>(value >> 24);
+}
+
+static void storeLE64(unsigned char* at, uint64_t value) {
+    storeLE32(at, static_cast<uint32_t>(value));
+    storeLE32(at + 4, static_cast<uint32_t>(value >> 32));
+}
+
+static uint32_t loadLE32(const unsigned char* at) {
+    return static_cast<uint32_t>(at[0]) | static_cast<uint32_t>(at[1]) << 8 |
+           static_cast<uint32_t>(at[2]) << 16 | static_cast<uint32_t>(at[3]) << 24;
+}
+
+static uint64_t loadLE64(const unsigned char* at) {
+    return static_cast<uint64_t>(loadLE32(at)) | static_cast<uint64_t>(loadLE32(at + 4)) << 32;
+}
+
+bool CanvasFile::write(const Canvas& canvas, const std::string& path) {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+    bool ok = write(canvas.view(), out);
+    out.close();
+    if (!ok || !out) {
+        std::remove(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CanvasFile::write(const ShapeView& shapes, std::ostream& out) {
+    std::streampos start = out.tellp();
+    // Records stream out in blocks as the shapes are walked; texts and colour names
+    // are gathered on the way and follow the records
+    unsigned char header[headerBytes] = {};
+    out.write(reinterpret_cast<const char*>(header), headerBytes);
+
+    std::unordered_map<unsigned, uint32_t> colourIndex; // palette id to file index
+    std::vector<const ColourEntry*> colourTable;
+    std::string blob;
+    std::vector<unsigned char> block;
+    block.reserve(recordBytes * 2048);
+    uint64_t written = 0;
+    bool ok = true;
+
+    for (ShapeView::const_iterator it = shapes.begin(); it != shapes.end() && ok; ++it) {
+        const Shape* shape = *it;
+        if (shape == NULL) {
+            continue;
+        }
+        std::pair<std::unordered_map<unsigned, uint32_t>::iterator, bool> slot =
+            colourIndex.insert(std::make_pair(shape->getColourId(), static_cast<uint32_t>(colourTable.size())));
+        if (slot.second) {
+            colourTable.push_back(shape->colour);
+        }
+
+        size_t textStart = blob.size();
+        if (shape->getKind() == ShapeKind::Textbox) {
+            blob += static_cast<const Textbox*>(shape)->getTextView();
+        }
+        if (blob.size() > 0xFFFFFFFFu) {
+            ok = false; // text spans are 32-bit
+            break;
+        }
+
+        size_t at = block.size();
+        block.resize(at + recordBytes);
+        unsigned char* record = &block[at];
+        record[0] = static_cast<unsigned char>(shape->getKind());
+        record[1] = record[2] = record[3] = 0;
+        storeLE32(record + 4, slot.first->second);
+        storeLE32(record + 8, static_cast<uint32_t>(shape->getLength()));
+        storeLE32(record + 12, static_cast<uint32_t>(shape->getWidth()));
+        storeLE32(record + 16, static_cast<uint32_t>(shape->getPositionX()));
+        storeLE32(record + 20, static_cast<uint32_t>(shape->getPositionY()));
+        storeLE32(record + 24, static_cast<uint32_t>(textStart));
+        storeLE32(record + 28, static_cast<uint32_t>(blob.size() - textStart));
+        ++written;
+
+        if (block.size() == block.capacity()) {
+            out.write(reinterpret_cast<const char*>(&block[0]), block.size());
+            block.clear();
+        }
+    }
+    if (!block.empty()) {
+        out.write(reinterpret_cast<const char*>(&block[0]), block.size());
+    }
+
+    uint64_t textOffset = headerBytes + written * recordBytes;
+    out.write(blob.data(), blob.size());
+    uint64_t colourOffset = textOffset + blob.size();
+    for (size_t i = 0; i < colourTable.size(); ++i) {
+        const std::string& name = colourTable[i]->name;
+        unsigned char size[4];
+        storeLE32(size, static_cast<uint32_t>(name.size()));
+        out.write(reinterpret_cast<const char*>(size), 4);
+        out.write(name.data(), name.size());
+    }
+
+    std::copy(canvasFileMagic, canvasFileMagic + 4, header);
+    storeLE32(header + 4, currentVersion);
+    storeLE64(header + 8, written);
+    storeLE64(header + 16, textOffset);
+    storeLE64(header + 24, blob.size());
+    storeLE64(header + 32, colourOffset);
+    storeLE32(header + 40, static_cast<uint32_t>(colourTable.size()));
+    out.seekp(start);
+    out.write(reinterpret_cast<const char*>(header), headerBytes);
+    out.seekp(0, std::ios::end);
+    return ok && static_cast<bool>(out);
+}
+
+CanvasFile::~CanvasFile() {
+    close();
+}
+
+bool CanvasFile::open(const std::string& path) {
+    close();
+#ifdef OPENCANVAS_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* view = mmap(NULL, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            data = static_cast<const unsigned char*>(view);
+            length = static_cast<size_t>(info.st_size);
+            mapped = true;
+        }
+    }
+    ::close(fd); // the mapping keeps the file alive
+#endif
+    if (data == NULL) {
+        // No mmap here (or it failed), fall back to reading the whole file
+        std::ifstream in(path.c_str(), std::ios::binary);
+        if (!in) {
+            return false;
+        }
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (buffer.empty()) {
+            return false;
+        }
+        data = &buffer[0];
+        length = buffer.size();
+    }
+    if (!parse()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool CanvasFile::open(std::vector<unsigned char>& bytes) {
+    close();
+    if (bytes.empty()) {
+        return false;
+    }
+    buffer.swap(bytes);
+    data = &buffer[0];
+    length = buffer.size();
+    if (!parse()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// Checks the header and section bounds and interns the colour table
+bool CanvasFile::parse() {
+    if (length < headerBytes || !std::equal(canvasFileMagic, canvasFileMagic + 4, data)) {
+        return false;
+    }
+    version = loadLE32(data + 4);
+    uint64_t recordCount = loadLE64(data + 8);
+    uint64_t textOffset = loadLE64(data + 16);
+    uint64_t textSize = loadLE64(data + 24);
+    uint64_t colourOffset = loadLE64(data + 32);
+    uint32_t colourCount = loadLE32(data + 40);
+    if (version == 0 || version > currentVersion) {
+        return false;
+    }
+    if (recordCount > (length - headerBytes) / recordBytes ||
+        textOffset != headerBytes + recordCount * recordBytes ||
+        textSize > length - textOffset ||
+        colourOffset != textOffset + textSize ||
+        colourCount > (length - colourOffset) / 4) {
+        return false;
+    }
+
+    ColourPalette& palette = ColourPalette::global();
+    size_t at = static_cast<size_t>(colourOffset);
+    colours.reserve(colourCount);
+    for (uint32_t i = 0; i < colourCount; ++i) {
+        if (length - at < 4) {
+            return false;
+        }
+        size_t size = loadLE32(data + at);
+        at += 4;
+        if (length - at < size) {
+            return false;
+        }
+        colours.push_back(palette.intern(std::string(reinterpret_cast<const char*>(data + at), size)));
+        at += size;
+    }
+
+    count = static_cast<size_t>(recordCount);
+    records = data + headerBytes;
+    texts = data + textOffset;
+    textBytes = static_cast<size_t>(textSize);
+    return true;
+}
+
+void CanvasFile::close() {
+#ifdef OPENCANVAS_HAVE_MMAP
+    if (mapped) {
+        munmap(const_cast<unsigned char*>(data), length);
+    }
+#endif
+    buffer.clear();
+    data = NULL;
+    length = 0;
+    mapped = false;
+    version = 0;
+    count = 0;
+    records = NULL;
+    texts = NULL;
+    textBytes = 0;
+    colours.clear();
+}
+
+bool CanvasFile::isOpen() const { return data != NULL; }
+uint32_t CanvasFile::getVersion() const { return version; }
+size_t CanvasFile::size() const { return count; }
+
+ShapeKind CanvasFile::getKind(size_t i) const {
+    return static_cast<ShapeKind>(records[i * recordBytes]);
+}
+
+Bounds CanvasFile::getBounds(size_t i) const {
+    const unsigned char* record = records + i * recordBytes;
+    return Bounds::of(static_cast<int>(loadLE32(record + 16)), static_cast<int>(loadLE32(record + 20)),
+                      static_cast<int>(loadLE32(record + 8)), static_cast<int>(loadLE32(record + 12)));
+}
+
+const ColourEntry* CanvasFile::getColour(size_t i) const {
+    uint32_t index = loadLE32(records + i * recordBytes + 4);
+    return index < colours.size() ? colours[index] : NULL;
+}
+
+Shape* CanvasFile::materialize(size_t i, ShapeAllocator* allocator) const {
+    if (i >= count) {
+        return NULL;
+    }
+    const unsigned char* record = records + i * recordBytes;
+    const ColourEntry* colour = getColour(i);
+    uint32_t textStart = loadLE32(record + 24);
+    uint32_t textSize = loadLE32(record + 28);
+    if (colour == NULL || textStart > textBytes || textSize > textBytes - textStart) {
+        return NULL;
+    }
+
+    Shape* shape;
+    switch (getKind(i)) {
+    case ShapeKind::Rectangle:
+        shape = new (allocator) Rectangle();
+        break;
+    case ShapeKind::Square:
+        shape = new (allocator) Square();
+        break;
+    case ShapeKind::Textbox:
+        shape = new (allocator) Textbox();
+        static_cast<Textbox*>(shape)->setSharedText(std::string_view(reinterpret_cast<const char*>(texts + textStart), textSize));
+        break;
+    default:
+        return NULL;
+    }
+    // Fresh and off-canvas, so the fields are set directly rather than through the journaled setters
+    shape->length = static_cast<int>(loadLE32(record + 8));
+    shape->width = static_cast<int>(loadLE32(record + 12));
+    shape->positionX = static_cast<int>(loadLE32(record + 16));
+    shape->positionY = static_cast<int>(loadLE32(record + 20));
+    shape->colour = colour;
+    shape->allocator = allocator;
+    return shape;
+}
+
+size_t CanvasFile::loadInto(Canvas& canvas) const {
+    ShapeAllocator* allocator = canvas.getAllocator();
+    std::vector<Shape*> loaded;
+    loaded.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        Shape* shape = materialize(i, allocator);
+        if (shape != NULL) {
+            loaded.push_back(shape);
+        }
+    }
+    canvas.addShapes(loaded);
+    return loaded.size();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// History journal
+// File: 8-byte signature, then frames. Frame header: 0 type, 4 payload length, 8 payload CRC-32,
+// 12 CRC-32 of the first 12 bytes. State payload: 0 snapshot mode, 4 shape count n, 8 n entries
+// of 16 bytes (shape id, offset of the frame holding its record, index of the record there),
+// then the records of the shapes that changed since the previous state, in the CanvasFile
+// format. Data frames only keep records that live states still refer to, with n = 0
+
+static const unsigned char historySignature[8] = { 'O', 'C', 'H', 'J', 2, 0, 0, 0 }; // magic, version 2
+static const size_t frameHeaderBytes = 16;
+static const size_t stateEntryBytes = 16;
+enum : uint32_t { StateFrame = 1, PopFrame = 2, DropFrame = 3, DataFrame = 4 };
+
+static uint32_t checksum(const unsigned char* data, size_t length) {
+    const uint32_t* table = crcTable();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void storeFrameHeader(unsigned char* head, uint32_t type, const unsigned char* payload, size_t length) {
+    storeLE32(head, type);
+    storeLE32(head + 4, static_cast<uint32_t>(length));
+    storeLE32(head + 8, checksum(payload, length));
+    storeLE32(head + 12, checksum(head, 12));
+}
+
+// Number of entries of a state or data payload, or -1 if they do not fit in it
+static long stateEntryCount(const std::vector<unsigned char>& payload) {
+    if (payload.size() < 8) {
+        return -1;
+    }
+    size_t count = loadLE32(&payload[4]);
+    return count > (payload.size() - 8) / stateEntryBytes ? -1 : static_cast<long>(count);
+}
+
+// Decodes the records that follow the entries of a state or data payload
+static bool openRecords(const std::vector<unsigned char>& payload, CanvasFile& records) {
+    long count = stateEntryCount(payload);
+    if (count < 0) {
+        return false;
+    }
+    std::vector<unsigned char> encoded(payload.begin() + 8 + stateEntryBytes * count, payload.end());
+    return records.open(encoded);
+}
+
+// Waits for the file's data to reach the disk. The stream must have been flushed
+static bool syncFile(const std::string& path) {
+#if OPENCANVAS_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+#else
+    (void)path;
+    return true; // flushing is all a portable stream offers
+#endif
+}
+
+HistoryJournal::~HistoryJournal() {
+    close();
+}
+
+bool HistoryJournal::open(const std::string& path, std::vector<std::streamoff>& states) {
+    close();
+    states.clear();
+    {
+        std::ofstream create(path.c_str(), std::ios::binary | std::ios::app); // leaves an existing file as it is
+        if (!create) {
+            return false;
+        }
+    }
+    file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    std::streamoff size = file.tellg();
+    unsigned char signature[sizeof(historySignature)];
+    if (size == 0) {
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(historySignature), sizeof(historySignature));
+        file.flush();
+        size = sizeof(historySignature);
+    } else {
+        file.seekg(0);
+        file.read(reinterpret_cast<char*>(signature), sizeof(signature));
+        if (!file || !std::equal(signature, signature + sizeof(signature), historySignature)) {
+            file.close();
+            return false; // not a history journal, leave it alone
+        }
+    }
+
+    // Replay the frames. A header that fails its checksum or runs past the end marks a
+    // torn write; the last frame's payload is checked too as it is the one most at risk
+    std::deque<std::streamoff> live;
+    std::streamoff at = sizeof(historySignature);
+    size_t frames = 0;
+    unsigned char head[frameHeaderBytes];
+    while (size - at >= static_cast<std::streamoff>(frameHeaderBytes)) {
+        file.seekg(at);
+        file.read(reinterpret_cast<char*>(head), frameHeaderBytes);
+        if (!file || checksum(head, 12) != loadLE32(head + 12)) {
+            break;
+        }
+        uint32_t type = loadLE32(head);
+        std::streamoff next = at + static_cast<std::streamoff>(frameHeaderBytes + loadLE32(head + 4));
+        if (next > size || type < StateFrame || type > DataFrame) {
+            break;
+        }
+        if (next == size) {
+            std::vector<unsigned char> payload(loadLE32(head + 4));
+            file.read(reinterpret_cast<char*>(payload.data()), payload.size());
+            if (!file || checksum(payload.data(), payload.size()) != loadLE32(head + 8)) {
+                break;
+            }
+        }
+        if (type == StateFrame) {
+            live.push_back(at);
+        } else if (type == PopFrame && !live.empty()) {
+            live.pop_back();
+        } else if (type == DropFrame && !live.empty()) {
+            live.pop_front();
+        }
+        at = next;
+        ++frames;
+    }
+    file.clear();
+    if (at < size) {
+        file.close();
+        std::error_code error;
+        std::filesystem::resize_file(path, static_cast<uintmax_t>(at), error);
+        file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        if (error || !file) {
+            file.close();
+            return false;
+        }
+    }
+    this->path = path;
+    end = at;
+    durable = at;
+    states.assign(live.begin(), live.end());
+
+    // Mostly frames for states that have left the history: rewrite with the live ones only
+    if (frames > 64 && frames > 2 * states.size()) {
+        compact(states);
+    }
+    return true;
+}
+
+// Copies the live keyframes, and the frames holding records they refer to, to a fresh file
+// that then replaces the journal. Frames only referred to become data frames. References
+// only ever point backwards, so copying in file order always knows where the target went.
+// On failure the old file stays in use and states is unchanged
+bool HistoryJournal::compact(std::vector<std::streamoff>& states) {
+    std::map<std::streamoff, bool> keep; // frame to whether it is a live state
+    std::vector<unsigned char> payload;
+    uint32_t type;
+    for (size_t i = 0; i < states.size(); ++i) {
+        long count;
+        if (!readFrame(states[i], type, payload) || (count = stateEntryCount(payload)) < 0) {
+            return false;
+        }
+        keep[states[i]] = true;
+        for (long e = 0; e < count; ++e) {
+            keep.emplace(static_cast<std::streamoff>(loadLE64(&payload[8 + stateEntryBytes * e + 4])), false);
+        }
+    }
+
+    std::string fresh = path + ".compact";
+    std::ofstream out(fresh.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(historySignature), sizeof(historySignature));
+    std::map<std::streamoff, std::streamoff> moved;
+    std::vector<std::streamoff> movedStates;
+    unsigned char head[frameHeaderBytes];
+    for (std::map<std::streamoff, bool>::const_iterator frame = keep.begin(); frame != keep.end() && out; ++frame) {
+        long count;
+        if (!readFrame(frame->first, type, payload) || (count = stateEntryCount(payload)) < 0) {
+            break;
+        }
+        std::streamoff here = out.tellp();
+        if (frame->second) {
+            for (long e = 0; e < count; ++e) {
+                unsigned char* entry = &payload[8 + stateEntryBytes * e];
+                std::map<std::streamoff, std::streamoff>::const_iterator target = moved.find(static_cast<std::streamoff>(loadLE64(entry + 4)));
+                storeLE64(entry + 4, static_cast<uint64_t>(target != moved.end() ? target->second : here));
+            }
+            movedStates.push_back(here);
+        } else {
+            payload.erase(payload.begin() + 8, payload.begin() + 8 + stateEntryBytes * count);
+            storeLE32(&payload[4], 0);
+            type = DataFrame;
+        }
+        moved[frame->first] = here;
+        storeFrameHeader(head, type, payload.data(), payload.size());
+        out.write(reinterpret_cast<const char*>(head), frameHeaderBytes);
+        out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    }
+    std::streamoff size = out.tellp();
+    out.close();
+    if (!file || !out || moved.size() != keep.size() || !syncFile(fresh)) {
+        file.clear();
+        std::remove(fresh.c_str());
+        return false;
+    }
+
+    file.close();
+    std::error_code error;
+    std::filesystem::rename(fresh, path, error);
+    file.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    if (error) {
+        std::remove(fresh.c_str());
+        return false;
+    }
+    states.swap(movedStates);
+    end = size;
+    durable = size;
+    return true;
+}
+
+void HistoryJournal::close() {
+    if (file.is_open()) {
+        sync();
+        file.close();
+    }
+    file.clear();
+    path.clear();
+    end = 0;
+    durable = 0;
+    written.clear();
+}
+
+HistoryJournal::Written HistoryJournal::describe(const Shape& shape, std::streamoff frame, uint32_t record) {
+    Written place = { frame, record, shape.kind, shape.length, shape.width, shape.positionX, shape.positionY, shape.colour->id, 0 };
+    if (shape.kind == ShapeKind::Textbox) {
+        place.text = std::hash<std::string_view>()(static_cast<const Textbox&>(shape).getTextView());
+    }
+    return place;
+}
+
+bool HistoryJournal::matches(const Written& place, const Shape& shape) {
+    Written now = describe(shape, place.frame, place.record);
+    return now.kind == place.kind && now.length == place.length && now.width == place.width &&
+        now.positionX == place.positionX && now.positionY == place.positionY &&
+        now.colour == place.colour && now.text == place.text;
+}
+
+bool HistoryJournal::isOpen() const {
+    return file.is_open();
+}
+
+const std::string& HistoryJournal::getPath() const {
+    return path;
+}
+
+// Frames go where the last complete one ended, so a failed append is simply overwritten
+bool HistoryJournal::append(uint32_t type, const std::string& payload) {
+    if (!file.is_open()) {
+        return false;
+    }
+    unsigned char head[frameHeaderBytes];
+    storeFrameHeader(head, type, reinterpret_cast<const unsigned char*>(payload.data()), payload.size());
+    file.seekp(end);
+    file.write(reinterpret_cast<const char*>(head), frameHeaderBytes);
+    file.write(payload.data(), payload.size());
+    if (!file) {
+        file.clear();
+        return false;
+    }
+    end += static_cast<std::streamoff>(frameHeaderBytes + payload.size());
+    return true;
+}
+
+bool HistoryJournal::sync() {
+    if (!file.is_open()) {
+        return false;
+    }
+    if (durable == end) {
+        return true;
+    }
+    file.flush();
+    if (!file) {
+        file.clear();
+        return false;
+    }
+    if (!syncFile(path)) {
+        return false;
+    }
+    durable = end;
+    return true;
+}
+
+bool HistoryJournal::isDurable(std::streamoff offset) const {
+    return offset >= 0 && offset < durable;
+}
+
+// Shapes are matched to the previous state by id and content, in either snapshot mode: an
+// unchanged shape's entry points at the record already in the file
+std::streamoff HistoryJournal::appendState(const Memento& memento) {
+    const std::vector<Shape*>& shapes = memento.shapesSnapshot;
+    std::streamoff at = end;
+    std::vector<unsigned char> head(8 + stateEntryBytes * shapes.size());
+    storeLE32(&head[0], static_cast<uint32_t>(memento.mode));
+    storeLE32(&head[4], static_cast<uint32_t>(shapes.size()));
+
+    std::unordered_map<unsigned, Written> next;
+    next.reserve(shapes.size());
+    std::vector<Shape*> changed;
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        Shape* shape = shapes[i];
+        std::unordered_map<unsigned, Written>::const_iterator previous = written.find(shape->id);
+        Written place;
+        if (previous != written.end() && matches(previous->second, *shape)) {
+            place = previous->second;
+        } else {
+            place = describe(*shape, at, static_cast<uint32_t>(changed.size()));
+            changed.push_back(shape);
+        }
+        unsigned char* entry = &head[8 + stateEntryBytes * i];
+        storeLE32(entry, shape->id); // ids link the state to the edit journal
+        storeLE64(entry + 4, static_cast<uint64_t>(place.frame));
+        storeLE32(entry + 12, place.record);
+        next[shape->id] = place;
+    }
+
+    std::ostringstream payload;
+    payload.write(reinterpret_cast<const char*>(head.data()), head.size());
+    bool appended = CanvasFile::write(ShapeView(changed.data(), changed.data() + changed.size()), payload) &&
+        append(StateFrame, payload.str());
+    if (appended) {
+        written.swap(next);
+    }
+    return appended ? at : -1;
+}
+
+bool HistoryJournal::appendPop() {
+    return append(PopFrame, std::string());
+}
 
+bool HistoryJournal::appendDrop() {
+    return append(DropFrame, std::string());
+}
 
-/*void PDFExporter::saveToFile() {
-    std::cout << "File saved";
+bool HistoryJournal::readFrame(std::streamoff offset, uint32_t& type, std::vector<unsigned char>& payload) {
+    if (!file.is_open() || offset < 0 || offset >= end) {
+        return false;
+    }
+    unsigned char head[frameHeaderBytes];
+    file.seekg(offset);
+    file.read(reinterpret_cast<char*>(head), frameHeaderBytes);
+    if (!file || checksum(head, 12) != loadLE32(head + 12)) {
+        file.clear();
+        return false;
+    }
+    type = loadLE32(head);
+    payload.resize(loadLE32(head + 4));
+    file.read(reinterpret_cast<char*>(payload.data()), payload.size());
+    if (!file || checksum(payload.data(), payload.size()) != loadLE32(head + 8)) {
+        file.clear();
+        return false;
+    }
+    return true;
+}
 
+Memento* HistoryJournal::loadState(std::streamoff offset, const Canvas* live) {
+    uint32_t type;
+    std::vector<unsigned char> payload;
+    if (!readFrame(offset, type, payload) || type != StateFrame) {
+        return NULL;
+    }
+    long count = stateEntryCount(payload);
+    if (count < 0) {
+        return NULL;
+    }
+    SnapshotMode mode = loadLE32(&payload[0]) == static_cast<uint32_t>(SnapshotMode::Shared) ? SnapshotMode::Shared : SnapshotMode::DeepCopy;
 
-} */
+    // Each frame the entries point into is read and decoded once
+    std::map<std::streamoff, std::unique_ptr<CanvasFile>> frames;
+    std::vector<unsigned char> referenced;
+    std::vector<Shape*> shapes;
+    shapes.reserve(count);
+    size_t bytes = sizeof(Memento) + count * sizeof(Shape*);
+    for (long i = 0; i < count; ++i) {
+        const unsigned char* entry = &payload[8 + stateEntryBytes * i];
+        unsigned id = loadLE32(entry);
+        std::streamoff frame = static_cast<std::streamoff>(loadLE64(entry + 4));
+        uint32_t record = loadLE32(entry + 12);
+
+        Shape* shape = NULL;
+        std::unordered_map<unsigned, Written>::const_iterator place = written.find(id);
+        const Shape* current = live != NULL && place != written.end() ? live->findShape(id) : NULL;
+        Shape* twin = current != NULL ? current->frozen.load(std::memory_order_acquire) : NULL;
+        if (twin != NULL && place->second.frame == frame && place->second.record == record && matches(place->second, *twin)) {
+            shape = twin;
+            shape->retain();
+        } else {
+            std::unique_ptr<CanvasFile>& records = frames[frame];
+            if (records == NULL) {
+                records.reset(new CanvasFile());
+                bool opened = frame == offset ? openRecords(payload, *records) :
+                    readFrame(frame, type, referenced) && (type == StateFrame || type == DataFrame) && openRecords(referenced, *records);
+                if (!opened) {
+                    records->close();
+                }
+            }
+            if (records->isOpen() && record < records->size()) {
+                shape = records->materialize(record);
+            }
+            if (shape != NULL) {
+                shape->id = id;
+                bytes += shapeByteSize(*shape);
+            }
+        }
+        if (shape == NULL) {
+            for (size_t j = 0; j < shapes.size(); ++j) {
+                shapes[j]->release();
+            }
+            return NULL;
+        }
+        shapes.push_back(shape);
+    }
+    return new Memento(shapes, mode, bytes);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Document engine
+
+// Which scheduler and worker the current thread is, so tasks it submits stay local
+struct WorkerIdentity {
+    const TaskScheduler* scheduler;
+    size_t index;
+};
+static thread_local WorkerIdentity currentWorker = { NULL, 0 };
+
+TaskScheduler::TaskScheduler(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers[i]->thread = std::thread(&TaskScheduler::run, this, i);
+    }
+}
+
+TaskScheduler::~TaskScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->thread.join();
+    }
+}
+
+void TaskScheduler::submit(std::function<void()> task) {
+    size_t index = currentWorker.scheduler == this ? currentWorker.index : nextWorker++ % workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[index]->mutex);
+        workers[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        ++queued;
+        ++outstanding;
+    }
+    wake.notify_one();
+}
+
+// Newest from our own deque, otherwise the oldest from someone else's
+bool TaskScheduler::take(size_t index, std::function<void()>& task) {
+    {
+        Worker& own = *workers[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+        Worker& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            steals.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::run(size_t index) {
+    currentWorker.scheduler = this;
+    currentWorker.index = index;
+    std::function<void()> task;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]() { return queued > 0 || stopping; });
+            if (queued == 0) {
+                return; // stopping with nothing left
+            }
+            --queued; // claims one task, which is in some deque already
+        }
+        while (!take(index, task)) {
+            std::this_thread::yield(); // another worker took the one we could see, ours is still coming
+        }
+        task();
+        task = nullptr;
+        completed.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        if (--outstanding == 0) {
+            idle.notify_all();
+        }
+    }
+}
+
+void TaskScheduler::waitIdle() {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    idle.wait(lock, [this]() { return outstanding == 0; });
+}
+
+size_t TaskScheduler::getWorkerCount() const {
+    return workers.size();
+}
+
+unsigned long TaskScheduler::getStealCount() const {
+    return steals.load(std::memory_order_relaxed);
+}
+
+unsigned long TaskScheduler::getCompletedCount() const {
+    return completed.load(std::memory_order_relaxed);
+}
+
+CanvasEngine::CanvasEngine(size_t threads) : scheduler(threads) {}
+
+CanvasEngine::~CanvasEngine() {
+    scheduler.waitIdle();
+}
+
+DocumentId CanvasEngine::open() {
+    std::shared_ptr<Document> document(new Document());
+    document->canvas.setJournal(&document->history);
+    std::lock_guard<std::mutex> lock(mutex);
+    DocumentId id = nextId++;
+    documents[id] = document;
+    return id;
+}
+
+bool CanvasEngine::close(DocumentId id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return documents.erase(id) > 0;
+}
+
+size_t CanvasEngine::getDocumentCount() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return documents.size();
+}
+
+std::shared_ptr<CanvasEngine::Document> CanvasEngine::find(DocumentId id) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unordered_map<DocumentId, std::shared_ptr<Document>>::const_iterator it = documents.find(id);
+    return it == documents.end() ? std::shared_ptr<Document>() : it->second;
+}
+
+// Only one drain task per document is ever queued or running, which is what keeps its
+// operations in order. The task holds the document, so closing it mid-queue is safe
+bool CanvasEngine::post(DocumentId id, Operation operation) {
+    std::shared_ptr<Document> document = find(id);
+    if (document == NULL) {
+        return false;
+    }
+    bool start;
+    {
+        std::lock_guard<std::mutex> lock(document->mutex);
+        document->pending.push_back(std::move(operation));
+        start = !document->scheduled;
+        document->scheduled = true;
+    }
+    if (start) {
+        scheduler.submit([this, document]() { drain(document); });
+    }
+    return true;
+}
+
+void CanvasEngine::drain(const std::shared_ptr<Document>& document) {
+    for (size_t done = 0; done < batchLimit; ++done) {
+        Operation operation;
+        {
+            std::lock_guard<std::mutex> lock(document->mutex);
+            if (document->pending.empty()) {
+                document->scheduled = false;
+                return;
+            }
+            operation = std::move(document->pending.front());
+            document->pending.pop_front();
+        }
+        operation(document->canvas, document->history);
+    }
+    std::shared_ptr<Document> again = document;
+    scheduler.submit([this, again]() { drain(again); });
+}
+
+std::future<std::shared_ptr<const Canvas>> CanvasEngine::snapshot(DocumentId id) {
+    std::shared_ptr<std::promise<std::shared_ptr<const Canvas>>> result(new std::promise<std::shared_ptr<const Canvas>>());
+    std::future<std::shared_ptr<const Canvas>> future = result->get_future();
+    if (!post(id, [result](Canvas& canvas, CareTaker&) { result->set_value(canvas.read()); })) {
+        return std::future<std::shared_ptr<const Canvas>>();
+    }
+    return future;
+}
+
+std::future<bool> CanvasEngine::exportDocument(DocumentId id, ExportCanvas* exporter) {
+    std::future<std::shared_ptr<const Canvas>> taken;
+    if (exporter == NULL || !(taken = snapshot(id)).valid()) {
+        return std::future<bool>();
+    }
+    // Only the snapshot is taken on the document's worker. The export itself runs on its
+    // own thread, as exportAsync() does, so it never holds a worker other documents share
+    return std::async(std::launch::async, [exporter, taken = std::move(taken)]() mutable {
+        std::shared_ptr<const Canvas> frozen;
+        try {
+            frozen = taken.get();
+        } catch (const std::future_error&) {
+            return false; // closed before the snapshot was taken
+        }
+        ExportJob job;
+        return exporter->runOn(frozen.get(), NULL, &job);
+    });
+}
+
+void CanvasEngine::waitIdle() {
+    scheduler.waitIdle();
+}
+
+const TaskScheduler& CanvasEngine::getScheduler() const {
+    return scheduler;
+}
+
+double LoopbackResult::getOperationsPerSecond() const {
+    return seconds > 0 ? operations / seconds : 0;
+}
+
+LoopbackDriver::LoopbackDriver(CanvasEngine& engine) : engine(engine) {}
+
+LoopbackResult LoopbackDriver::run(size_t clients, size_t documentsPerClient, size_t operationsPerDocument) {
+    std::atomic<size_t> executed(0);
+    std::vector<std::vector<DocumentId>> opened(clients);
+    for (size_t c = 0; c < clients; ++c) {
+        for (size_t d = 0; d < documentsPerClient; ++d) {
+            opened[c].push_back(engine.open());
+        }
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < clients; ++c) {
+        const std::vector<DocumentId>& mine = opened[c];
+        threads.push_back(std::thread([this, &mine, &executed, operationsPerDocument]() {
+            for (size_t op = 0; op < operationsPerDocument; ++op) {
+                for (size_t d = 0; d < mine.size(); ++d) {
+                    int step = static_cast<int>(op);
+                    engine.post(mine[d], [&executed, step](Canvas& canvas, CareTaker& history) {
+                        switch (step % 8) {
+                        case 0:
+                            canvas.addShape(new Rectangle(20, 10, step % 16 ? "red" : "blue", step, step));
+                            break;
+                        case 6:
+                            history.undoEdit(canvas);
+                            break;
+                        case 7:
+                            canvas.read()->getBoundingBox();
+                            break;
+                        default:
+                            if (canvas.size() > 0) {
+                                const Shape* target = canvas.view()[step % canvas.size()];
+                                canvas.findShape(target->getId())->setPosition(step, -step);
+                            }
+                            break;
+                        }
+                        executed.fetch_add(1, std::memory_order_relaxed);
+                    });
+                }
+            }
+        }));
+    }
+    for (size_t c = 0; c < threads.size(); ++c) {
+        threads[c].join();
+    }
+    engine.waitIdle();
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    LoopbackResult result;
+    result.documents = clients * documentsPerClient;
+    result.operations = executed.load();
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    for (size_t c = 0; c < clients; ++c) {
+        for (size_t d = 0; d < opened[c].size(); ++d) {
+            engine.close(opened[c][d]);
+        }
+    }
+    return result;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Logging
+// Bounded ring of records with a sequence number per slot (Vyukov's queue). A producer claims a
+// ticket with one CAS, formats straight into the slot and publishes it; the logging thread is the
+// only consumer. The queue is never destroyed: at exit it is drained and later writes go straight
+// to the sink, so destructors of other statics may still log
+
+std::atomic<int> Log::level(static_cast<int>(LogLevel::Warning));
+
+StreamLogSink::StreamLogSink(std::ostream& out) : out(out) {}
+
+void StreamLogSink::write(const LogRecord& record) {
+    out << '[' << Log::getLevelName(record.level) << "] " << record.component << ": " << record.message << '\n';
+}
+
+namespace {
+class LogQueue {
+private:
+    static const size_t capacity = 4096; // power of two
+
+    struct Slot {
+        std::atomic<unsigned long> sequence;
+        LogRecord record;
+    };
+
+    Slot* slots;
+    std::atomic<unsigned long> tail; // next ticket to hand out
+    unsigned long head; // next ticket to deliver, logging thread only
+    std::atomic<unsigned long> delivered;
+    std::atomic<unsigned long> dropped;
+    std::atomic<bool> sleeping;
+    std::atomic<bool> stopped;
+    bool stopping;
+
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+
+    std::mutex sinkMutex;
+    LogSink* sink;
+    StreamLogSink standard;
+    std::thread consumer;
+
+    void deliver(const LogRecord& record) {
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        sink->write(record);
+    }
+
+    bool drain() {
+        bool any = false;
+        for (;;) {
+            Slot& slot = slots[head & (capacity - 1)];
+            if (slot.sequence.load(std::memory_order_seq_cst) != head + 1) {
+                break;
+            }
+            deliver(slot.record);
+            slot.sequence.store(head + capacity, std::memory_order_release);
+            ++head;
+            any = true;
+        }
+        if (any) {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            delivered.store(head, std::memory_order_release);
+            drained.notify_all();
+        }
+        return any;
+    }
+
+    void run() {
+        for (;;) {
+            if (drain()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            if (stopping) {
+                break;
+            }
+            // Producers only take the mutex to wake us when they see this flag, so it
+            // has to be set before the final look at the ring
+            sleeping.store(true, std::memory_order_seq_cst);
+            if (slots[head & (capacity - 1)].sequence.load(std::memory_order_seq_cst) != head + 1) {
+                wake.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+        drain();
+    }
+
+    static void shutDown() {
+        instance().stop();
+    }
+
+public:
+    LogQueue() : slots(new Slot[capacity]), tail(0), head(0), delivered(0), dropped(0), sleeping(false),
+                 stopped(false), stopping(false), sink(&standard), standard(std::cout) {
+        for (size_t i = 0; i < capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        consumer = std::thread(&LogQueue::run, this);
+        std::atexit(&LogQueue::shutDown);
+    }
+
+    static LogQueue& instance() {
+        static LogQueue* queue = new LogQueue();
+        return *queue;
+    }
+
+    void push(LogLevel at, const char* component, const char* format, va_list args) {
+        if (stopped.load(std::memory_order_acquire)) {
+            LogRecord record;
+            record.level = at;
+            record.component = component;
+            record.sequence = tail.fetch_add(1, std::memory_order_relaxed);
+            record.time = std::chrono::steady_clock::now();
+            std::vsnprintf(record.message, LogRecord::maxMessage, format, args);
+            deliver(record);
+            return;
+        }
+
+        unsigned long ticket = tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[ticket & (capacity - 1)];
+            long difference = static_cast<long>(slot->sequence.load(std::memory_order_acquire) - ticket);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(ticket, ticket + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed); // full, the logging thread is behind
+                return;
+            } else {
+                ticket = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        LogRecord& record = slot->record;
+        record.level = at;
+        record.component = component;
+        record.sequence = ticket;
+        record.time = std::chrono::steady_clock::now();
+        std::vsnprintf(record.message, LogRecord::maxMessage, format, args);
+        slot->sequence.store(ticket + 1, std::memory_order_seq_cst);
+
+        if (sleeping.load(std::memory_order_seq_cst)) {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            wake.notify_one();
+        }
+    }
+
+    void flush() {
+        if (stopped.load(std::memory_order_acquire)) {
+            return;
+        }
+        unsigned long target = tail.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wake.notify_one();
+        while (delivered.load(std::memory_order_acquire) < target) {
+            drained.wait(lock);
+        }
+    }
+
+    void setSink(LogSink* replacement) {
+        flush();
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        sink = replacement != NULL ? replacement : &standard;
+    }
+
+    unsigned long getDropped() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            stopping = true;
+            wake.notify_one();
+        }
+        consumer.join();
+        stopped.store(true, std::memory_order_release);
+        std::cout.flush();
+    }
+};
+}
+
+void Log::setLevel(LogLevel at) {
+    level.store(static_cast<int>(at), std::memory_order_relaxed);
+}
+
+LogLevel Log::getLevel() {
+    return static_cast<LogLevel>(level.load(std::memory_order_relaxed));
+}
+
+const char* Log::getLevelName(LogLevel at) {
+    switch (at) {
+    case LogLevel::Trace: return "trace";
+    case LogLevel::Debug: return "debug";
+    case LogLevel::Info: return "info";
+    case LogLevel::Warning: return "warning";
+    case LogLevel::Error: return "error";
+    default: return "off";
+    }
+}
+
+void Log::setSink(LogSink* sink) {
+    LogQueue::instance().setSink(sink);
+}
+
+void Log::write(LogLevel at, const char* component, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    LogQueue::instance().push(at, component, format, args);
+    va_end(args);
+}
+
+void Log::flush() {
+    LogQueue::instance().flush();
+}
+
+unsigned long Log::getDroppedCount() {
+    return LogQueue::instance().getDropped();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Metrics
+// The registry is never destroyed, so threads that exit after main() returns can still fold
+// their counts into it
+
+const Counter Metrics::shapesLive(0);
+const Counter Metrics::mementosLive(1);
+const Counter Metrics::historyBytes(2);
+const Counter Metrics::clonesPerformed(3);
+
+Histogram Metrics::captureLatency;
+Histogram Metrics::undoLatency;
+Histogram Metrics::getLastMementoLatency;
+Histogram Metrics::exportPrepareLatency;
+Histogram Metrics::exportRenderLatency;
+Histogram Metrics::exportSaveLatency;
+
+namespace {
+struct MetricsRegistry {
+    std::mutex lock;
+    std::vector<MetricsBlock*> active;
+    std::vector<MetricsBlock*> spare; // left by exited threads, already folded and zeroed
+    std::atomic<long long> retired[MetricsBlock::maxCounters];
+    std::vector<std::string> counterNames; // by slot
+    std::vector<std::pair<std::string, Histogram*> > histograms;
+
+    MetricsRegistry() {
+        for (size_t i = 0; i < MetricsBlock::maxCounters; ++i) {
+            retired[i].store(0, std::memory_order_relaxed);
+        }
+        counterNames.push_back("shapes.live");
+        counterNames.push_back("mementos.live");
+        counterNames.push_back("history.bytes");
+        counterNames.push_back("shapes.cloned");
+        counterNames.push_back("metrics.overflow"); // counters registered past the limit share it
+        histograms.push_back(std::make_pair(std::string("canvas.capture_ns"), &Metrics::captureLatency));
+        histograms.push_back(std::make_pair(std::string("canvas.undo_ns"), &Metrics::undoLatency));
+        histograms.push_back(std::make_pair(std::string("caretaker.get_last_memento_ns"), &Metrics::getLastMementoLatency));
+        histograms.push_back(std::make_pair(std::string("export.prepare_ns"), &Metrics::exportPrepareLatency));
+        histograms.push_back(std::make_pair(std::string("export.render_ns"), &Metrics::exportRenderLatency));
+        histograms.push_back(std::make_pair(std::string("export.save_ns"), &Metrics::exportSaveLatency));
+    }
+
+    static MetricsRegistry& global() {
+        static MetricsRegistry* registry = new MetricsRegistry();
+        return *registry;
+    }
+
+    // Caller holds the lock
+    long long sum(size_t slot) const {
+        long long total = retired[slot].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < active.size(); ++i) {
+            total += active[i]->values[slot].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+static const size_t overflowSlot = 4;
+
+// Trivially destructible, so it can still be read after the owner itself is gone
+static thread_local bool metricsRetired = false;
+}
+
+// Folds the thread's block into the totals when the thread exits
+struct MetricsBlockOwner {
+    MetricsBlock* block;
+
+    explicit MetricsBlockOwner(MetricsBlock* block) : block(block) {}
+    ~MetricsBlockOwner();
+};
+
+MetricsBlockOwner::~MetricsBlockOwner() {
+    MetricsRegistry& registry = MetricsRegistry::global();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (size_t i = 0; i < MetricsBlock::maxCounters; ++i) {
+        long long value = block->values[i].load(std::memory_order_relaxed);
+        registry.retired[i].fetch_add(value, std::memory_order_relaxed);
+        block->values[i].store(0, std::memory_order_relaxed);
+    }
+    registry.active.erase(std::find(registry.active.begin(), registry.active.end(), block));
+    registry.spare.push_back(block);
+    Metrics::local = NULL;
+    metricsRetired = true;
+}
+
+// First count on a thread: attach a block. After the thread has retired its block
+// (counts from other thread_local destructors) go straight to the totals
+void Metrics::addSlow(size_t slot, long long amount) {
+    MetricsRegistry& registry = MetricsRegistry::global();
+    if (metricsRetired) {
+        registry.retired[slot].fetch_add(amount, std::memory_order_relaxed);
+        return;
+    }
+    MetricsBlock* block;
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        if (!registry.spare.empty()) {
+            block = registry.spare.back();
+            registry.spare.pop_back();
+        } else {
+            block = new MetricsBlock();
+        }
+        registry.active.push_back(block);
+    }
+    thread_local MetricsBlockOwner owner(block);
+    local = block;
+    Counter(slot).add(amount);
+}
+
+long long Counter::get() const {
+    MetricsRegistry& registry = MetricsRegistry::global();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    return registry.sum(slot);
+}
+
+Counter Metrics::counter(const std::string& name) {
+    MetricsRegistry& registry = MetricsRegistry::global();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (size_t i = 0; i < registry.counterNames.size(); ++i) {
+        if (registry.counterNames[i] == name) {
+            return Counter(i);
+        }
+    }
+    if (registry.counterNames.size() == MetricsBlock::maxCounters) {
+        return Counter(overflowSlot);
+    }
+    registry.counterNames.push_back(name);
+    return Counter(registry.counterNames.size() - 1);
+}
+
+Histogram& Metrics::histogram(const std::string& name) {
+    MetricsRegistry& registry = MetricsRegistry::global();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    for (size_t i = 0; i < registry.histograms.size(); ++i) {
+        if (registry.histograms[i].first == name) {
+            return *registry.histograms[i].second;
+        }
+    }
+    Histogram* created = new Histogram(); // value-initialised, every bucket starts at zero
+    registry.histograms.push_back(std::make_pair(name, created));
+    return *created;
+}
+
+MetricsSnapshot Metrics::snapshot() {
+    MetricsRegistry& registry = MetricsRegistry::global();
+    MetricsSnapshot taken;
+    std::vector<std::pair<std::string, Histogram*> > histograms;
+    {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (size_t i = 0; i < registry.counterNames.size(); ++i) {
+            taken.counters.push_back(std::make_pair(registry.counterNames[i], registry.sum(i)));
+        }
+        histograms = registry.histograms;
+    }
+    for (size_t i = 0; i < histograms.size(); ++i) {
+        const Histogram& histogram = *histograms[i].second;
+        HistogramSummary summary;
+        summary.name = histograms[i].first;
+        summary.count = histogram.getCount();
+        summary.mean = summary.count == 0 ? 0 : double(histogram.getTotal()) / double(summary.count);
+        summary.p50 = histogram.percentile(0.5);
+        summary.p90 = histogram.percentile(0.9);
+        summary.p99 = histogram.percentile(0.99);
+        summary.p999 = histogram.percentile(0.999);
+        summary.max = histogram.getMax();
+        taken.histograms.push_back(summary);
+    }
+    return taken;
+}
+
+void Metrics::dump(std::ostream& out) {
+    MetricsSnapshot taken = snapshot();
+    for (size_t i = 0; i < taken.counters.size(); ++i) {
+        out << taken.counters[i].first << ' ' << taken.counters[i].second << '\n';
+    }
+    for (size_t i = 0; i < taken.histograms.size(); ++i) {
+        const HistogramSummary& h = taken.histograms[i];
+        out << h.name << " count=" << h.count << " mean=" << static_cast<unsigned long long>(h.mean)
+            << " p50=" << h.p50 << " p90=" << h.p90 << " p99=" << h.p99 << " p99.9=" << h.p999
+            << " max=" << h.max << '\n';
+    }
+}
+
+long long MetricsSnapshot::getCounter(const std::string& name) const {
+    for (size_t i = 0; i < counters.size(); ++i) {
+        if (counters[i].first == name) {
+            return counters[i].second;
+        }
+    }
+    return 0;
+}
+
+const HistogramSummary* MetricsSnapshot::getHistogram(const std::string& name) const {
+    for (size_t i = 0; i < histograms.size(); ++i) {
+        if (histograms[i].name == name) {
+            return &histograms[i];
+        }
+    }
+    return NULL;
+}
+
+size_t Histogram::bucketOf(unsigned long long value) {
+    const unsigned long long subBuckets = 1ull << subBucketBits;
+    if (value < 2 * subBuckets) {
+        return static_cast<size_t>(value);
+    }
+#if defined(__GNUC__)
+    int top = 63 - __builtin_clzll(value);
+#else
+    int top = 0;
+    while ((value >> top) > 1) {
+        ++top;
+    }
+#endif
+    int shift = top - subBucketBits;
+    return (static_cast<size_t>(shift + 1) << subBucketBits) + static_cast<size_t>((value >> shift) - subBuckets);
+}
+
+unsigned long long Histogram::bucketValue(size_t bucket) {
+    const size_t subBuckets = size_t(1) << subBucketBits;
+    if (bucket < 2 * subBuckets) {
+        return bucket;
+    }
+    int shift = static_cast<int>(bucket >> subBucketBits) - 1;
+    unsigned long long low = static_cast<unsigned long long>((bucket & (subBuckets - 1)) + subBuckets) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+void Histogram::record(unsigned long long value) {
+    buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(value, std::memory_order_relaxed);
+    unsigned long long seen = maximum.load(std::memory_order_relaxed);
+    while (value > seen && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+unsigned long long Histogram::getCount() const {
+    unsigned long long recorded = 0;
+    for (size_t i = 0; i < bucketCount; ++i) {
+        recorded += buckets[i].load(std::memory_order_relaxed);
+    }
+    return recorded;
+}
+
+unsigned long long Histogram::getTotal() const {
+    return total.load(std::memory_order_relaxed);
+}
+
+unsigned long long Histogram::getMax() const {
+    return maximum.load(std::memory_order_relaxed);
+}
+
+unsigned long long Histogram::percentile(double fraction) const {
+    unsigned long long recorded = getCount();
+    if (recorded == 0) {
+        return 0;
+    }
+    unsigned long long rank = static_cast<unsigned long long>(fraction * double(recorded) + 0.999999);
+    rank = std::max(1ull, std::min(rank, recorded));
+    unsigned long long seen = 0;
+    for (size_t i = 0; i < bucketCount; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return std::min(bucketValue(i), getMax());
+        }
+    }
+    return getMax();
+}
+
+void Histogram::reset() {
+    for (size_t i = 0; i < bucketCount; ++i) {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+    total.store(0, std::memory_order_relaxed);
+    maximum.store(0, std::memory_order_relaxed);
+}
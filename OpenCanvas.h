@@ -5,13 +5,410 @@
 #include <vector>
 #include <map>
 #include <list>
+#include <deque>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <algorithm>
+#include <queue>
+#include <thread>
+#include <fstream>
+#include <cstdarg>
+#include <cstdio>
+#include <future>
+#include <functional>
+#include <sstream>
+#include <memory>
+#include <condition_variable>
+#include <chrono>
+#include <string_view>
+#include <bitset>
 
 
 class Shape;
 class Memento;
 class Canvas;
+class SharedText;
 
+// Kinds of single edits the undo journal records
+enum class EditKind { Add, Remove, Move, Resize, Recolour, SetText };
+
+// =========================
+// Logging
+// =========================
+
+// Diagnostics go through OPENCANVAS_LOG(level, component, format, ...), printf style.
+// With OPENCANVAS_LOGGING set to 0 (the default when NDEBUG is defined) the macro is
+// empty and its arguments are never evaluated. Otherwise a message below Log::getLevel()
+// costs one atomic load; the rest are formatted into a fixed-size record and pushed on
+// a lock-free ring buffer that a background thread drains into the sink. When the ring
+// is full the message is dropped and counted, so callers never wait on output
+#ifndef OPENCANVAS_LOGGING
+#ifdef NDEBUG
+#define OPENCANVAS_LOGGING 0
+#else
+#define OPENCANVAS_LOGGING 1
+#endif
+#endif
+
+#if OPENCANVAS_LOGGING
+#define OPENCANVAS_LOG(level, component, ...) \
+    do { if (Log::isEnabled(level)) Log::write(level, component, __VA_ARGS__); } while (0)
+#else
+#define OPENCANVAS_LOG(level, component, ...) do {} while (0)
+#endif
+
+#if defined(__GNUC__)
+#define OPENCANVAS_PRINTF_FORMAT(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#define OPENCANVAS_PRINTF_FORMAT(formatIndex, firstArg)
+#endif
+
+enum class LogLevel : int { Trace, Debug, Info, Warning, Error, Off };
+
+struct LogRecord {
+    static const size_t maxMessage = 200;
+
+    LogLevel level;
+    const char* component; // a string literal
+    unsigned long sequence; // order the messages were written in
+    std::chrono::steady_clock::time_point time;
+    char message[maxMessage]; // truncated to fit, always terminated
+};
+
+// Receives records on the logging thread, one at a time
+class LogSink {
+public:
+    virtual ~LogSink() = default;
+    virtual void write(const LogRecord& record) = 0;
+};
+
+// "[level] component: message" lines on a stream, the default sink uses std::cout
+class StreamLogSink : public LogSink {
+private:
+    std::ostream& out;
+
+public:
+    explicit StreamLogSink(std::ostream& out);
+    void write(const LogRecord& record) override;
+};
+
+class Log {
+private:
+    static std::atomic<int> level;
+
+public:
+    static bool isEnabled(LogLevel at) {
+        return static_cast<int>(at) >= level.load(std::memory_order_relaxed);
+    }
+    static void setLevel(LogLevel at); // Warning by default
+    static LogLevel getLevel();
+    static const char* getLevelName(LogLevel at);
+
+    // Not owned. NULL goes back to the std::cout sink. Waits for queued records first
+    static void setSink(LogSink* sink);
+
+    static void write(LogLevel at, const char* component, const char* format, ...) OPENCANVAS_PRINTF_FORMAT(3, 4);
+    static void flush(); // returns once everything written so far has reached the sink
+    static unsigned long getDroppedCount();
+};
+
+// =========================
+// Metrics
+// =========================
+
+// Counters are handles onto a slot in a per-thread block. Only the owning thread
+// writes its block, so an event is a load and a store with no locked instruction;
+// readers add up every block. A thread's block is folded into the shared totals
+// when the thread exits. Counters may go down, so they also serve as gauges
+struct MetricsBlock {
+    static const size_t maxCounters = 64;
+    std::atomic<long long> values[maxCounters];
+};
+
+class Counter {
+private:
+    size_t slot;
+
+public:
+    constexpr explicit Counter(size_t slot) : slot(slot) {}
+    size_t getSlot() const { return slot; }
+
+    inline void add(long long amount) const;
+    void increment() const { add(1); }
+    void decrement() const { add(-1); }
+    long long get() const; // sum over every thread, exact once writers are quiet
+};
+
+// Log-linear buckets: exact below 64, then 32 buckets per power of two, so a
+// recorded value is off by at most 1/32 (HdrHistogram with 1.5 significant digits).
+// Values are nanoseconds by convention
+class Histogram {
+public:
+    static const int subBucketBits = 5;
+    static const size_t bucketCount = (65 - subBucketBits) << subBucketBits;
+
+private:
+    std::atomic<unsigned long long> buckets[bucketCount]; // their sum is the count
+    std::atomic<unsigned long long> total;
+    std::atomic<unsigned long long> maximum;
+
+public:
+    // Trivially constructible, so a static Histogram needs no dynamic initialisation
+    Histogram() = default;
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    static size_t bucketOf(unsigned long long value);
+    static unsigned long long bucketValue(size_t bucket); // middle of the bucket's range
+
+    void record(unsigned long long value);
+    unsigned long long getCount() const;
+    unsigned long long getTotal() const;
+    unsigned long long getMax() const;
+    unsigned long long percentile(double fraction) const; // fraction in [0, 1]
+    void reset(); // not atomic against concurrent record() calls
+};
+
+// Records the time from construction to destruction
+class ScopedLatency {
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedLatency(Histogram& histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() {
+        histogram.record(static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count()));
+    }
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+};
+
+struct HistogramSummary {
+    std::string name;
+    unsigned long long count;
+    double mean;
+    unsigned long long p50;
+    unsigned long long p90;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long max;
+};
+
+struct MetricsSnapshot {
+    std::vector<std::pair<std::string, long long> > counters;
+    std::vector<HistogramSummary> histograms;
+
+    long long getCounter(const std::string& name) const; // 0 when there is none
+    const HistogramSummary* getHistogram(const std::string& name) const;
+};
+
+class Metrics {
+private:
+    friend class Counter;
+    friend struct MetricsBlockOwner;
+    static inline thread_local MetricsBlock* local = NULL;
+    static void addSlow(size_t slot, long long amount);
+
+public:
+    // Built in, always on
+    static const Counter shapesLive;
+    static const Counter mementosLive;
+    static const Counter historyBytes; // over every CareTaker
+    static const Counter clonesPerformed;
+
+    static Histogram captureLatency; // Canvas::captureCurrent
+    static Histogram undoLatency; // Canvas::undoAction
+    static Histogram getLastMementoLatency; // CareTaker::getLastMemento
+    static Histogram exportPrepareLatency; // ExportCanvas steps
+    static Histogram exportRenderLatency;
+    static Histogram exportSaveLatency;
+
+    // Registered on first use, the same name always gives the same instrument
+    static Counter counter(const std::string& name);
+    static Histogram& histogram(const std::string& name);
+
+    static MetricsSnapshot snapshot();
+    static void dump(std::ostream& out); // one "name value" line per counter, summaries for histograms
+};
+
+inline void Counter::add(long long amount) const {
+    MetricsBlock* block = Metrics::local;
+    if (block != NULL) {
+        std::atomic<long long>& value = block->values[slot];
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    } else {
+        Metrics::addSlow(slot, amount);
+    }
+}
+
+// A size that mirrors its changes into a counter, so the counter holds the total over
+// every live owner
+class MeteredSize {
+private:
+    size_t value = 0;
+    Counter counter;
+
+public:
+    explicit MeteredSize(Counter counter) : counter(counter) {}
+    MeteredSize(const MeteredSize& other) : value(other.value), counter(other.counter) { counter.add(static_cast<long long>(value)); }
+    ~MeteredSize() { counter.add(-static_cast<long long>(value)); }
+    MeteredSize& operator=(const MeteredSize&) = delete;
+
+    MeteredSize& operator+=(size_t amount) { value += amount; counter.add(static_cast<long long>(amount)); return *this; }
+    MeteredSize& operator-=(size_t amount) { value -= amount; counter.add(-static_cast<long long>(amount)); return *this; }
+    operator size_t() const { return value; }
+};
+
+// =========================
+// Colour palette
+// =========================
+
+// One interned colour. Entries live as long as the palette, so shapes can keep a pointer
+struct ColourEntry {
+    std::string name;
+    unsigned id;
+    uint32_t rgba; // packed 0xRRGGBBAA, parsed from the name
+};
+
+// Process-wide interning table. Boards reuse a handful of colours, so shapes hold a
+// pointer into this table instead of their own string
+class ColourPalette {
+private:
+    mutable std::mutex mutex;
+    std::deque<ColourEntry> entries; // deque keeps entry addresses stable as it grows
+    std::unordered_map<std::string, const ColourEntry*> byName;
+
+public:
+    static ColourPalette& global();
+    static uint32_t parseRgba(const std::string& name);
+
+    const ColourEntry* intern(const std::string& name);
+    const ColourEntry* find(unsigned id) const;
+    size_t size() const;
+};
+
+// =========================
+// Shape allocation
+// =========================
+
+// Where shapes get their memory. Every shape remembers the allocator it came from,
+// so release() hands the block back to the right one and clone() allocates next to it
+class ShapeAllocator {
+public:
+    virtual ~ShapeAllocator() = default;
+    virtual void* allocate(size_t bytes) = 0;
+    virtual void deallocate(void* block, size_t bytes) = 0;
+    // count blocks of the same size at once, the default just calls allocate()
+    virtual void allocateMany(size_t bytes, size_t count, void** blocks);
+
+    // The process-wide ShapePool, used when no allocator is given
+    static ShapeAllocator* getDefault();
+};
+
+// Fixed-size block pools, one free list per 16-byte size class, carved from chunks
+// that are only returned when the pool dies. Requests above maxBlockBytes go to the
+// heap. The global pool also keeps a small per-thread cache of blocks so threads
+// creating and dropping shapes do not meet on a lock
+class ShapePool : public ShapeAllocator {
+public:
+    static const size_t granularity = 16;
+    static const size_t maxBlockBytes = 256;
+    static const size_t classCount = maxBlockBytes / granularity;
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    struct SizeClass {
+        std::mutex mutex;
+        FreeBlock* freeList = NULL;
+        std::vector<char*> chunks;
+    };
+
+    mutable SizeClass classes[classCount];
+    size_t blocksPerChunk;
+    bool threadCached = false; // only the global pool, which is never destroyed
+
+    friend struct ShapePoolCache;
+    friend struct ShapeArenaCache;
+    friend class ShapeArena;
+    FreeBlock* refill(size_t cls, size_t count);
+    void giveBack(size_t cls, FreeBlock* head, FreeBlock* tail);
+
+public:
+    explicit ShapePool(size_t blocksPerChunk = 256);
+    ~ShapePool();
+    ShapePool(const ShapePool&) = delete;
+    ShapePool& operator=(const ShapePool&) = delete;
+
+    static ShapePool& global();
+
+    void* allocate(size_t bytes) override;
+    void deallocate(void* block, size_t bytes) override;
+    void allocateMany(size_t bytes, size_t count, void** blocks) override; // one lock, ascending addresses
+
+    size_t getChunkCount() const;
+};
+
+// Per-canvas arena. Freed blocks are recycled inside the arena, and all of its chunks
+// go back to the heap in one step once the owner has let go and the last shape it
+// handed out (on the canvas, in a memento or in the journal) has been released.
+// Like the global pool, each thread keeps a small cache of blocks for the last few
+// arenas it used, so threads sharing an arena do not meet on its lock. Cached blocks
+// hold the arena like live ones; a thread hands back its blocks of an arena whose owner
+// let go the next time it allocates or frees through an arena, or when it exits
+class ShapeArena : public ShapeAllocator {
+private:
+    ShapePool pool;
+    std::atomic<size_t> refs; // the owner plus one per live or thread-cached block
+    std::atomic<size_t> cached{0}; // blocks in thread caches
+    std::atomic<bool> retired{false}; // the owner has let go
+
+    friend struct ShapeArenaCache;
+    ~ShapeArena() = default;
+    void unref(size_t count = 1);
+
+public:
+    explicit ShapeArena(size_t blocksPerChunk = 256);
+    ShapeArena(const ShapeArena&) = delete;
+    ShapeArena& operator=(const ShapeArena&) = delete;
+
+    void* allocate(size_t bytes) override;
+    void deallocate(void* block, size_t bytes) override;
+    void allocateMany(size_t bytes, size_t count, void** blocks) override;
+
+    // Called by the owner instead of delete
+    void release();
+
+    size_t getLiveBlocks() const;
+    size_t getChunkCount() const;
+};
+
+// Concrete type of a shape, stored in every Shape so callers need no dynamic_cast
+enum class ShapeKind : unsigned char { Rectangle, Square, Textbox };
+
+// Axis-aligned box covering [minX, maxX) x [minY, maxY). A shape spans its length
+// along x and its width along y from its position, negative sizes extend backwards
+struct Bounds {
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+
+    static Bounds of(int x, int y, int length, int width);
+    bool isEmpty() const;
+    bool contains(int x, int y) const;
+    bool intersects(const Bounds& other) const;
+    bool encloses(const Bounds& other) const; // other lies inside, edges included
+    void expand(const Bounds& other);
+    long long distanceSquared(int x, int y) const; // 0 when the point is inside
+};
 
 // =========================
 // Factory Method + Prototype
@@ -20,61 +417,244 @@ class Shape {
 
 
 public:
-    Shape();
-    Shape(int length, int width, std::string colour, int posX, int posY);
-    virtual ~Shape() = default;
+    Shape(ShapeKind kind = ShapeKind::Rectangle);
+    Shape(int length, int width, std::string colour, int posX, int posY, ShapeKind kind = ShapeKind::Rectangle);
+    Shape(int length, int width, const ColourEntry* colour, int posX, int posY, ShapeKind kind); // no palette lookup
+    Shape(const Shape& other);
+    Shape& operator=(const Shape& other);
+    virtual ~Shape();
+
+    // All shapes come from a ShapeAllocator, plain new uses the default pool
+    static void* operator new(size_t size);
+    static void* operator new(size_t size, ShapeAllocator* allocator);
+    static void operator delete(void* block);
+    static void operator delete(void* block, ShapeAllocator* allocator);
+
+    // Allocator that clones of this shape come from
+    ShapeAllocator* getAllocator() const;
 
     // Prototype
     virtual Shape* clone() const = 0;
 
+    // Structural sharing for snapshots. snapshot() hands out an immutable twin
+    // of this shape that stays shared until one of the setters changes the shape,
+    // so capturing an unchanged shape again costs a refcount bump, not a clone.
+    // Readers may race to link the twin; the setters still need the canvas's write lock
+    Shape* snapshot(bool* created = NULL) const;
+    Shape* thaw() const;
+    void retain() const;
+    void release() const;
+
     // Getters and Setters
     int getLength() const;
     int getWidth() const;
-    std::string getColour() const;
+    const std::string& getColour() const;
+    unsigned getColourId() const;
+    uint32_t getColourRgba() const;
     int getPositionX() const;
     int getPositionY() const;
+    ShapeKind getKind() const { return kind; } // inline, every tag dispatch starts here
+    Bounds getBounds() const;
 
     void setLength(int length);
     void setWidth(int width);
     void setColour(const std::string& colour);
+    void setColourId(unsigned colourId);
     void setPositionX(int x);
     void setPositionY(int y);
+    void setPosition(int x, int y);
+    void setSize(int length, int width);
+
+    // Estimated heap footprint, used for history budgets
+    virtual size_t getByteSize() const;
+
+    // Stable identity inside a canvas, kept by clones so journal records survive restores
+    unsigned getId() const;
+
+protected:
+    void touch();
+    void edited(EditKind kind, int oldA, int oldB, const SharedText* oldText);
+    bool isOnCanvas() const;
 
     private:
+    void assignColour(const ColourEntry* entry);
+    // Storage for count shapes of size bytes in one allocator call, built with ::new
+    static void allocateMany(size_t size, size_t count, ShapeAllocator* allocator, void** blocks);
+
+    friend class Canvas;
+    friend class ShapeFactory;
+    friend class CanvasFile;
+    friend class HistoryJournal;
+    friend class Memento;
+
     int length;
     int width;
-    std::string colour;
+    const ColourEntry* colour; // interned in ColourPalette::global()
     int positionX;
     int positionY;
+    ShapeKind kind;
+
+    mutable std::atomic<int> refs;
+    mutable std::atomic<Shape*> frozen; // shared twin handed to snapshots, NULL once the shape diverges
+
+    unsigned id;
+    Canvas* owner; // canvas told about every edit, NULL when the shape is not on a canvas
+    ShapeAllocator* allocator; // NULL means the default pool
 };
 
 // =========================
 // Concrete Products
 // =========================
-class Rectangle : public Shape {
+// The three products are the closed set ShapeKind names. They are final, so a call
+// through the concrete type (see visitShape()) needs no virtual dispatch
+class Rectangle final : public Shape {
 public:
+    static const ShapeKind staticKind = ShapeKind::Rectangle;
+
     Rectangle();
     Rectangle(int length, int width, std::string colour, int posX, int posY);
+    Rectangle(int length, int width, const ColourEntry* colour, int posX, int posY);
     Shape* clone() const override;
 };
 
-class Square : public Shape {
+class Square final : public Shape {
 public:
+    static const ShapeKind staticKind = ShapeKind::Square;
+
     Square();
     Square(int size, std::string colour, int posX, int posY);
+    Square(int size, const ColourEntry* colour, int posX, int posY);
     Shape* clone() const override;
 };
 
-class Textbox : public Shape {
+// Immutable text with cheap copies. Up to inlineCapacity bytes live in the object itself;
+// longer text is in a refcounted buffer that every copy shares, so cloning a textbox or
+// saving it in a memento never copies the characters. Changing text means assigning a
+// new SharedText, the old buffer stays with whoever still holds it
+class SharedText {
+private:
+    struct Buffer {
+        std::atomic<size_t> refs;
+        char data[1]; // length + 1 bytes, NUL terminated
+    };
+    static const size_t inlineCapacity = 15;
+
+    size_t length = 0;
+    union {
+        char local[inlineCapacity + 1];
+        Buffer* shared;
+    };
+
+    bool isInline() const { return length <= inlineCapacity; }
+    void assign(std::string_view text);
+    void drop();
+
+public:
+    SharedText() { local[0] = '\0'; }
+    SharedText(std::string_view text) { assign(text); }
+    SharedText(const std::string& text) { assign(text); }
+    SharedText(const char* text) { assign(text); }
+    SharedText(const SharedText& other);
+    SharedText(SharedText&& other) noexcept;
+    SharedText& operator=(const SharedText& other);
+    SharedText& operator=(SharedText&& other) noexcept;
+    ~SharedText() { drop(); }
+
+    const char* data() const { return isInline() ? local : shared->data; } // NUL terminated
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    std::string_view view() const { return std::string_view(data(), length); }
+    std::string str() const { return std::string(data(), length); }
+
+    bool isShared() const; // the buffer has other holders
+    size_t getHeapBytes() const; // this holder's share of the buffer, 0 when inline
+};
+
+inline std::ostream& operator<<(std::ostream& out, const SharedText& text) {
+    return out << text.view();
+}
+
+class Textbox final : public Shape {
 private:
-    std::string text;
+    SharedText text;
 public:
+    static const ShapeKind staticKind = ShapeKind::Textbox;
+
     Textbox();
     Textbox(int length, int width, std::string colour, int posX, int posY, std::string text);
+    Textbox(int length, int width, const ColourEntry* colour, int posX, int posY, const SharedText& text); // shares text's buffer
     Shape* clone() const override;
 
-    std::string getText() const;
+    std::string getText() const; // a copy
+    std::string_view getTextView() const; // no copy, valid until the text is changed
+    const SharedText& getSharedText() const;
     void setText(const std::string& t);
+    void setSharedText(const SharedText& t); // shares t's buffer
+    size_t getByteSize() const override;
+};
+
+// =========================
+// Tag dispatch
+// =========================
+
+// Calls visit with the shape as its concrete type, picked by a switch on getKind().
+// The visitor is a template (a generic lambda) instantiated for each product, so hot
+// loops get direct, inlinable calls instead of going through the vtable
+template <typename Visitor>
+decltype(auto) visitShape(const Shape& shape, Visitor&& visit) {
+    switch (shape.getKind()) {
+    case ShapeKind::Square:
+        return visit(static_cast<const Square&>(shape));
+    case ShapeKind::Textbox:
+        return visit(static_cast<const Textbox&>(shape));
+    default:
+        return visit(static_cast<const Rectangle&>(shape));
+    }
+}
+
+template <typename Visitor>
+decltype(auto) visitShape(Shape& shape, Visitor&& visit) {
+    switch (shape.getKind()) {
+    case ShapeKind::Square:
+        return visit(static_cast<Square&>(shape));
+    case ShapeKind::Textbox:
+        return visit(static_cast<Textbox&>(shape));
+    default:
+        return visit(static_cast<Rectangle&>(shape));
+    }
+}
+
+// Checked downcast on the tag, NULL when the shape is another kind. Replaces dynamic_cast
+template <typename Product>
+Product* shapeCast(Shape* shape) {
+    return shape != NULL && shape->getKind() == Product::staticKind ? static_cast<Product*>(shape) : NULL;
+}
+
+template <typename Product>
+const Product* shapeCast(const Shape* shape) {
+    return shape != NULL && shape->getKind() == Product::staticKind ? static_cast<const Product*>(shape) : NULL;
+}
+
+// clone() and getByteSize() dispatched on the tag
+inline Shape* cloneShape(const Shape& shape) {
+    return visitShape(shape, [](const auto& product) -> Shape* { return product.clone(); });
+}
+
+inline size_t shapeByteSize(const Shape& shape) {
+    return visitShape(shape, [](const auto& product) { return product.getByteSize(); });
+}
+
+// Parameters for ShapeFactory::createShapes(), as parallel arrays of count entries.
+// A NULL array leaves that field at the default (0, black, no text); Square factories
+// ignore widths
+struct ShapeBatch {
+    size_t count = 0;
+    const int* lengths = NULL;
+    const int* widths = NULL;
+    const int* positionsX = NULL;
+    const int* positionsY = NULL;
+    const unsigned* colours = NULL; // palette ids, see ColourPalette::intern()
+    const SharedText* texts = NULL; // Textbox factories only, the shapes share the buffers
 };
 
 // =========================
@@ -83,7 +663,22 @@ public:
 class ShapeFactory {
 public:
     virtual ~ShapeFactory() = default;
+
+    // Shapes are created from this allocator (NULL means the default pool)
+    void setAllocator(ShapeAllocator* allocator);
+    ShapeAllocator* getAllocator() const;
+
+    // batch.count new shapes, off-canvas, allocated together so they sit side by side
+    std::vector<Shape*> createShapes(const ShapeBatch& batch) const;
 protected:
+    ShapeAllocator* allocator = NULL;
+    Shape* adopt(Shape* shape) const;
+
+    // For createShapes(): the product's size, and product i of the batch built in place
+    virtual size_t getShapeSize() const = 0;
+    virtual Shape* constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const = 0;
+
+
     virtual Shape* createShape() const = 0;
     virtual std::string toString() const = 0;
 };
@@ -95,40 +690,432 @@ class RectangleFactory : public ShapeFactory {
 public:
     Shape* createShape() const override;
     std::string toString() const override;
+protected:
+    size_t getShapeSize() const override;
+    Shape* constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const override;
 };
 
 class SquareFactory : public ShapeFactory {
 public:
     Shape* createShape() const override;
     std::string toString() const override;
+protected:
+    size_t getShapeSize() const override;
+    Shape* constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const override;
 };
 
 class TextboxFactory : public ShapeFactory {
 public:
     Shape* createShape() const override;
     std::string toString() const override;
+protected:
+    size_t getShapeSize() const override;
+    Shape* constructAt(void* block, const ShapeBatch& batch, size_t i, const ColourEntry* colour) const override;
+};
+
+// =========================
+// Shape views
+// =========================
+
+// Read-only window onto the shape list of a canvas or memento, valid until that changes.
+// Entries can be NULL when a NULL shape was added. Kept inline so loops over a view
+// compile down to a pointer walk
+class ShapeView {
+private:
+    const Shape* const* first;
+    const Shape* const* last;
+
+public:
+    typedef const Shape* const* const_iterator;
+
+    ShapeView(const Shape* const* first, const Shape* const* last) : first(first), last(last) {}
+
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+    size_t size() const { return static_cast<size_t>(last - first); }
+    bool empty() const { return first == last; }
+    const Shape* operator[](size_t i) const { return first[i]; }
+};
+
+// The shapes of one kind in a ShapeView, NULL entries skipped
+class ShapeKindView {
+private:
+    ShapeView shapes;
+    ShapeKind kind;
+
+public:
+    class const_iterator {
+    private:
+        const Shape* const* at;
+        const Shape* const* last;
+        ShapeKind kind;
+
+        void skip() {
+            while (at != last && (*at == NULL || (*at)->getKind() != kind)) ++at;
+        }
+
+    public:
+        const_iterator(const Shape* const* at, const Shape* const* last, ShapeKind kind) : at(at), last(last), kind(kind) { skip(); }
+
+        const Shape* operator*() const { return *at; }
+        const_iterator& operator++() { ++at; skip(); return *this; }
+        bool operator==(const const_iterator& other) const { return at == other.at; }
+        bool operator!=(const const_iterator& other) const { return at != other.at; }
+    };
+
+    ShapeKindView(const ShapeView& shapes, ShapeKind kind) : shapes(shapes), kind(kind) {}
+
+    const_iterator begin() const { return const_iterator(shapes.begin(), shapes.end(), kind); }
+    const_iterator end() const { return const_iterator(shapes.end(), shapes.end(), kind); }
+    size_t count() const;
 };
 
 // =========================
 // Memento Pattern
 // =========================
+
+// DeepCopy clones every shape on capture, Shared reuses the twins from
+// Shape::snapshot() so only shapes changed since the last capture are copied
+enum class SnapshotMode { DeepCopy, Shared };
+
 class Memento {
 private:
     std::vector<Shape*> shapesSnapshot;
+    SnapshotMode mode;
+    size_t bytes; // what this capture allocated, shared twins count for the memento that made them
+
+    friend class HistoryJournal;
+    friend class Canvas;
+    friend class CareTaker;
+    Memento(std::vector<Shape*>& adopted, SnapshotMode mode, size_t bytes); // takes over the references
+    size_t shareUnchanged(const Memento& previous); // bytes freed
+
+public:
+    static const size_t captureChunk = 4096; // shapes a capture thread takes at a time
+
+    // threads above 1 (0 for every core) splits the copying between that many threads
+    Memento(const std::vector<Shape*>& elements, SnapshotMode mode = SnapshotMode::DeepCopy, unsigned threads = 1);
+    ~Memento();
+    Memento(const Memento&) = delete;
+    Memento& operator=(const Memento&) = delete;
+
+    ShapeView getSavedState() const; // no copy, valid while the memento is unchanged. The twins are immutable
+    SnapshotMode getMode() const;
+    size_t getByteSize() const;
+};
+
+// One undoable edit. Geometry edits keep the old and new values, Add and Remove keep
+// the shape itself (retained) and where it sat, so undo/redo never clone anything
+class ShapeDelta {
+public:
+    EditKind kind;
+    unsigned shapeId;
+    size_t index;
+    Shape* shape;
+    int before[2];
+    int after[2];
+    SharedText beforeText; // shares the textbox's buffer, never a copy of the body
+    SharedText afterText;
+
+    ShapeDelta(EditKind kind, unsigned shapeId);
+    ~ShapeDelta();
+    ShapeDelta(const ShapeDelta&) = delete;
+    ShapeDelta& operator=(const ShapeDelta&) = delete;
+
+    size_t getByteSize() const;
+};
+
+// Budget for CareTaker. Zero means unlimited / never
+struct HistoryLimits {
+    size_t maxEntries = 0;
+    size_t maxBytes = 0;
+    // Every N states added, fold each new state into the one before it: shapes equal to
+    // the earlier state's copy share it, so a run of states costs one full keyframe plus
+    // what changed. Every state and edit stays its own undo step
+    size_t compactInterval = 0;
+};
+
+// Append-only file behind a CareTaker's state history. Each frame is a 16-byte header
+// (type, payload length, payload CRC-32, header CRC-32) and a payload. A State frame
+// lists one memento's shapes and carries, in the CanvasFile format, the records of those
+// that changed since the previous state; the rest point at records in earlier frames.
+// Pop and Drop frames record the newest and oldest state leaving the history, and a Data
+// frame keeps records live states point at once their own frame was compacted away.
+// Appended frames are buffered until sync(), which CareTaker calls before paging a state
+// out and on close. A crash loses the frames since the last sync, that is states still in
+// memory at the time and any pops or drops after them; a torn frame at the end is cut off
+// when the file is opened again
+class HistoryJournal {
+private:
+    // Where the record of a shape was written (its frame and its index among that frame's
+    // records) and what it held, so an equal shape in the next state reuses it. No shape is
+    // kept alive for this, a paged-out state holds no memory
+    struct Written {
+        std::streamoff frame;
+        uint32_t record;
+        ShapeKind kind;
+        int length;
+        int width;
+        int positionX;
+        int positionY;
+        unsigned colour;
+        size_t text; // hash of a textbox's text
+    };
+    static Written describe(const Shape& shape, std::streamoff frame, uint32_t record);
+    static bool matches(const Written& place, const Shape& shape);
+
+    std::fstream file;
+    std::string path;
+    std::streamoff end = 0;
+    std::streamoff durable = 0; // frames before this offset have been synced
+    std::unordered_map<unsigned, Written> written; // the shapes of the newest state frame, by id
+
+    bool append(uint32_t type, const std::string& payload);
+    bool readFrame(std::streamoff offset, uint32_t& type, std::vector<unsigned char>& payload);
+    bool compact(std::vector<std::streamoff>& states);
 
 public:
-    Memento(const std::vector<Shape*>& elements);
-    std::vector<Shape*> getSavedState() const;
+    HistoryJournal() = default;
+    ~HistoryJournal();
+    HistoryJournal(const HistoryJournal&) = delete;
+    HistoryJournal& operator=(const HistoryJournal&) = delete;
+
+    // Opens or creates the file and replays its frames. states receives the offsets of
+    // the keyframes still in the history, oldest first. False for a file of another kind
+    bool open(const std::string& path, std::vector<std::streamoff>& states);
+    void close();
+    bool isOpen() const;
+    const std::string& getPath() const;
+
+    // Frames are buffered; sync() flushes them and waits for the disk. A crash loses at most
+    // the frames appended since the last sync, which open() then finds torn or missing
+    std::streamoff appendState(const Memento& memento); // offset of the keyframe, -1 on failure
+    bool appendPop();
+    bool appendDrop();
+    bool sync();
+    bool isDurable(std::streamoff offset) const; // the frame at offset has been synced
+
+    // NULL when a frame it needs fails its checksum. Shapes the newest state wrote that
+    // live still shares an equal twin of come back as that twin, so restoring them onto
+    // live does not copy anything
+    Memento* loadState(std::streamoff offset, const Canvas* live = NULL);
 };
 
 class CareTaker {
 private:
-    std::vector<Memento*> history;
+    struct SavedState {
+        Memento* memento; // NULL while paged out to the backing file
+        unsigned long seq;
+        size_t bytes; // in memory, 0 while paged out
+        std::streamoff offset; // keyframe in the backing file, -1 when there is none
+    };
+    struct SavedEdit {
+        ShapeDelta* delta;
+        unsigned long seq;
+        size_t bytes;
+    };
+
+    // Undo sides are deques so the oldest entry can be evicted cheaply, newest at the back
+    std::deque<SavedState> history;
+    std::vector<Memento*> redoHistory;
+
+    // Delta journal
+    std::deque<SavedEdit> undoJournal;
+    std::vector<SavedEdit> redoJournal;
+
+    HistoryLimits limits;
+    MeteredSize historyBytes{Metrics::historyBytes};
+    unsigned long nextSeq = 0;
+    size_t statesSinceCompact = 0; // newest states not folded yet
+
+    HistoryJournal* backing = NULL;
+    size_t residentStates = 0;
+
+    void pushState(Memento* m);
+    Memento* popState(const Canvas* live);
+    void pageOut();
+    bool pageOutOldest();
+    bool pageOutState(SavedState& state); // false if its frame could not be synced
+    void clearRedoStates();
+    void clearRedoEdits();
+    void enforceLimits();
 
 public:
     ~CareTaker();
     void addMemento(Memento* m);
     Memento* getLastMemento();
+
+    // Full-state undo/redo: the current canvas state goes on the opposite stack
+    bool undoState(Canvas& canvas);
+    bool redoState(Canvas& canvas);
+    size_t getRedoStateCount() const;
+
+    void setLimits(const HistoryLimits& l);
+    const HistoryLimits& getLimits() const;
+    void compactHistory(); // folds the states added since the last pass, see HistoryLimits
+    size_t getHistoryBytes() const;
+    size_t getEntryCount() const;
+
+    // Writes every state added from now on to an append-only journal and keeps only the
+    // newest residentStates mementos in memory; getLastMemento() reads older ones back.
+    // States already in the file (from an earlier run) come first in the history. Only
+    // states are journaled, the edit journal stays in memory. Each state frame holds just the
+    // shapes changed since the previous one; the file is synced before a state is paged out
+    // and when it is closed. A state that cannot be read back stays in the history
+    bool setBackingFile(const std::string& path, size_t residentStates = 4);
+    void closeBackingFile(); // pages every state back in
+    size_t getResidentStateCount() const;
+
+    // Called by a canvas that has this caretaker as its journal
+    void recordEdit(ShapeDelta* delta);
+    // Apply the inverse of the last edit / re-apply the last undone edit
+    bool undoEdit(Canvas& canvas);
+    bool redoEdit(Canvas& canvas);
+    size_t getEditCount() const;
+    size_t getRedoCount() const;
+};
+
+// =========================
+// ShapeStore (structure of arrays)
+// =========================
+
+// Mirror of a canvas laid out column by column, so passes over geometry stream
+// through contiguous ints instead of chasing Shape pointers. Rows are addressed by
+// shape id, which stays valid while rows move around (removal swaps the last row in).
+// Colours are palette ids, texts live in a side table
+class ShapeStore {
+private:
+    std::vector<unsigned> ids;
+    std::vector<ShapeKind> kinds;
+    std::vector<int> lengths;
+    std::vector<int> widths;
+    std::vector<int> positionsX;
+    std::vector<int> positionsY;
+    std::vector<unsigned> colours; // palette ids
+
+    std::unordered_map<unsigned, SharedText> texts; // shared with the textboxes
+    std::vector<size_t> rowOfId; // npos for ids not in the store
+
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    void insert(const Shape& shape);
+    void update(const Shape& shape);
+    void erase(unsigned id);
+    void clear();
+    void reserve(size_t rows);
+
+    size_t size() const;
+    size_t rowOf(unsigned id) const;
+
+    // Column access by row
+    unsigned getId(size_t row) const;
+    ShapeKind getKind(size_t row) const;
+    int getLength(size_t row) const;
+    int getWidth(size_t row) const;
+    int getPositionX(size_t row) const;
+    int getPositionY(size_t row) const;
+    const std::string& getColour(size_t row) const;
+    unsigned getColourId(size_t row) const;
+    const SharedText* getText(unsigned id) const;
+    Bounds getBounds(size_t row) const;
+
+    // Bulk passes
+    Bounds boundingBox() const;
+    std::vector<unsigned> hitTest(int x, int y) const; // in row order, which removals shuffle
+};
+
+// =========================
+// SpatialIndex (quadtree)
+// =========================
+
+// Quadtree over shape bounds. Each shape sits in the smallest node that encloses it,
+// so large shapes stay high up and small ones sink to the leaves. The root doubles
+// towards shapes that fall outside it. Nodes are found by id for O(depth) updates
+class SpatialIndex {
+private:
+    struct Entry {
+        unsigned id;
+        Bounds bounds;
+    };
+    struct Node {
+        Bounds area;
+        std::vector<Entry> entries;
+        Node* children[4] = { NULL, NULL, NULL, NULL };
+        Node* parent = NULL;
+
+        explicit Node(const Bounds& area);
+        ~Node();
+        bool isLeaf() const;
+    };
+
+    Node* root;
+    std::unordered_map<unsigned, Node*> nodeOf;
+
+    static const size_t splitThreshold = 8;
+    static const int minNodeSize = 8;
+    static const int maxRootSize = 1 << 29;
+
+    void grow(const Bounds& bounds);
+    void place(Node* node, const Entry& entry);
+    void split(Node* node);
+    void prune(Node* node);
+    Node* childFor(Node* node, const Bounds& bounds) const;
+
+public:
+    SpatialIndex();
+    ~SpatialIndex();
+    SpatialIndex(const SpatialIndex&) = delete;
+    SpatialIndex& operator=(const SpatialIndex&) = delete;
+
+    void insert(unsigned id, const Bounds& bounds);
+    void update(unsigned id, const Bounds& bounds);
+    void erase(unsigned id); // also collapses the quadrants it leaves empty
+    void clear();
+    void reserve(size_t entries);
+    size_t size() const;
+    size_t nodeCount() const;
+
+    // Results are ids in ascending order, nearest() is ordered by distance (ties by id)
+    std::vector<unsigned> queryPoint(int x, int y) const;
+    std::vector<unsigned> queryRect(const Bounds& area) const;
+    std::vector<unsigned> nearest(int x, int y, size_t k) const;
+};
+
+// =========================
+// Dirty regions
+// =========================
+
+// Areas of a canvas that changed, one per edit, numbered by revision. Consumers keep
+// the revision they last saw and ask what changed since. Only the newest maxRegions
+// are kept; anyone further behind, or behind a full invalidation, must redraw all
+class DirtyLog {
+private:
+    static const size_t chunkRegions = 64;
+    struct Chunk {
+        Bounds regions[chunkRegions];
+    };
+
+    // Region i was recorded as revision first + i + 1 and sits in chunk i / chunkRegions.
+    // Chunks are filled in place and never moved, so a copy (a canvas snapshot) shares
+    // them: it reads only the slots below its own revision, which are never written again
+    std::deque<std::shared_ptr<Chunk>> chunks;
+    unsigned long first = 0;
+    unsigned long revision = 0;
+    unsigned long origin; // tells canvases apart, snapshots share their canvas's
+
+public:
+    static const size_t maxRegions = 1024; // at least this many recent regions are kept
+
+    DirtyLog();
+
+    void mark(const Bounds& area);
+    void markAll();
+    unsigned long getRevision() const;
+    unsigned long getOrigin() const;
+
+    // Appends the areas changed after revision since, false when that is unknown
+    bool collect(unsigned long since, std::vector<Bounds>& out) const;
 };
 
 // =========================
@@ -137,24 +1124,362 @@ public:
 class Canvas {
 private:
     std::vector<Shape*> shapes;
+    SnapshotMode snapshotMode = SnapshotMode::Shared;
+    unsigned snapshotThreads = 0;
+    ShapeStore* store = NULL; // optional column mirror
+    ShapeArena* arena = NULL; // optional, shared with every shape allocated from it
+    SpatialIndex* spatial = NULL; // optional quadtree for point, area and nearest queries
+    DirtyLog dirty;
+
+    std::unordered_map<unsigned, Shape*> byId;
+    unsigned nextId = 1;
+    CareTaker* journal = NULL;
+    bool replaying = false;
+
+    // Concurrent mode: writers serialise on writeMutex, readers take the published snapshot
+    bool concurrent = false;
+    bool frozenCopy = false; // made by snapshot(), its shapes are immutable shared twins
+    mutable std::recursive_mutex writeMutex;
+    std::atomic<unsigned long> epoch{0}; // bumped by every change
+    unsigned long snapshotEpoch = 0; // for snapshots, the epoch they show
+    mutable std::shared_ptr<const Canvas> published;
+
+    // Concurrent mode also keeps the shapes' twins in chunks of twinChunk shapes. Under the
+    // write lock a publish only re-twins the chunks edits touched and hands out the chunk
+    // list; readers and captures build from that list without holding the lock
+    static const size_t twinChunk = 64;
+    struct TwinChunk {
+        std::vector<Shape*> twins; // one reference each
+        ~TwinChunk();
+    };
+    struct TwinList {
+        std::vector<std::shared_ptr<const TwinChunk>> chunks;
+        unsigned long epoch;
+        unsigned nextId;
+        SnapshotMode snapshotMode;
+        DirtyLog dirty;
+        size_t count;
+    };
+    mutable std::vector<std::shared_ptr<const TwinChunk>> twinChunks;
+    mutable std::vector<char> twinStale; // per chunk, an edited shape
+    mutable size_t twinStaleFrom = 0; // chunks from here on shifted by an insert or removal
+    mutable std::unordered_map<unsigned, size_t> twinChunkOf; // published shape id -> chunk
+    mutable std::atomic<size_t> twinBytes{0}; // twins published since the last capture claimed them
+    mutable std::shared_ptr<const TwinList> publishedTwins;
+
+    friend class Shape;
+    void changed();
+    void markShifted(size_t index);
+    void markEdited(unsigned id);
+    void publishTwins() const;
+    std::shared_ptr<const TwinList> currentTwins(bool wait) const;
+    static Canvas* fromTwins(const TwinList& list);
+    void onShapeEdit(Shape& shape, EditKind kind, int oldA, int oldB, const SharedText* oldText);
+    void insertAt(size_t index, Shape* shape);
+    Shape* detachAt(size_t index);
+    void restoreFrom(Memento& saved, bool consume);
 
 public:
+    Canvas() = default;
+    Canvas(const Canvas&) = delete;
+    Canvas& operator=(const Canvas&) = delete;
     ~Canvas();
 
+    // Keeps a ShapeStore in sync with the canvas; bulk queries then run over its columns
+    void setShapeStoreEnabled(bool enabled);
+    const ShapeStore* getShapeStore() const;
+    Bounds getBoundingBox() const;
+    // Ids of the shapes covering the point in canvas order, bottom first, whichever of the
+    // scan, the store and the index answers. Ids rise along the canvas: addShape appends
+    // with a fresh id and undo, redo and restores put shapes back where they were
+    std::vector<unsigned> hitTest(int x, int y) const;
+
+    // Keeps a SpatialIndex in sync on add, remove, move and resize; hitTest() and the
+    // queries below use it when enabled and scan the shapes otherwise
+    void setSpatialIndexEnabled(bool enabled);
+    const SpatialIndex* getSpatialIndex() const;
+    std::vector<unsigned> queryRect(const Bounds& area) const;
+    std::vector<unsigned> nearest(int x, int y, size_t k) const;
+
+    // What changed, for exporters that redraw incrementally
+    const DirtyLog& getDirtyLog() const;
+
+    // Gives the canvas its own ShapeArena. Hand getAllocator() to factories so new
+    // shapes come from it; turning it off only stops new allocations from it
+    void setArenaEnabled(bool enabled);
+    ShapeAllocator* getAllocator() const;
+
+    // Edits are recorded as deltas in the journal (NULL turns recording off)
+    void setJournal(CareTaker* caretaker);
+    CareTaker* getJournal() const;
+    void removeShape(size_t index);
+    Shape* findShape(unsigned id);
+    const Shape* findShape(unsigned id) const;
+    void applyDelta(const ShapeDelta& delta, bool forward);
+
+    void setSnapshotMode(SnapshotMode mode);
+    SnapshotMode getSnapshotMode() const;
+    // Threads captureCurrent() clones with, 0 uses every core. Only canvases of at least
+    // two Memento::captureChunk shapes are split
+    void setSnapshotThreads(unsigned threads);
+    unsigned getSnapshotThreads() const;
+
     void addShape(Shape* shape);
-    std::vector<Shape*> getShapes() const;
+    // Appends many shapes in one step: one reservation, one lock, one dirty region.
+    // Each shape is still journaled as its own Add
+    void addShapes(Shape* const* first, Shape* const* last);
+    void addShapes(const std::vector<Shape*>& added);
+    // Copies, use view() to iterate without one. A const canvas (a snapshot) only hands out const shapes
+    std::vector<Shape*> getShapes();
+    std::vector<const Shape*> getShapes() const;
+
+    // Iteration without copying the shape list
+    size_t size() const;
+    ShapeView view() const;
+    ShapeKindView viewOf(ShapeKind kind) const;
+    template <typename Visitor>
+    void forEach(Visitor visit) const; // visit(const Shape&) for every non-NULL shape
+
+    // Read-only copy holding the immutable snapshot twins of the shapes, so it costs a
+    // refcount bump per unchanged shape. Its shapes must not be edited. Take it on the
+    // editing thread (any thread in concurrent mode); the copy can then be read and
+    // deleted on any thread
+    const Canvas* snapshot() const;
+
+    // Concurrent mode, for canvases shared between threads. Turn it on before sharing.
+    // The canvas's own edits (addShape, removeShape, applyDelta, undoAction) lock out
+    // each other; hold lockWrites() around anything else that edits, such as setters on
+    // shapes from getShapes(). Other threads read through read(), which returns the
+    // snapshot for the current epoch without waiting: when it is stale and a writer holds
+    // the lock, the previous one is returned instead. Readers hold the lock only to
+    // re-twin the shapes edited since the last publish; the snapshot itself is built
+    // outside it. captureCurrent() works from any thread the same way: it sees the
+    // caller's own edits under lockWrites(), and the last publish while another thread
+    // writes. snapshot() waits for the lock, but also copies outside it
+    void setConcurrent(bool enabled);
+    bool isConcurrent() const;
+    std::unique_lock<std::recursive_mutex> lockWrites() const; // unlocked outside concurrent mode
+    std::shared_ptr<const Canvas> read() const; // a fresh snapshot() outside concurrent mode
 
     // Memento
     Memento* captureCurrent() const;
-    void undoAction(Memento* prev);
+    void undoAction(Memento* prev); // prev stays with the caller, unchanged
+    // Consumes prev: its shapes move onto the canvas instead of being copied, and shapes
+    // that did not change since the capture stay as they are. With no copy needed, as
+    // after a deep capture, the restore allocates nothing (beyond an enabled store or index)
+    void undoAction(std::unique_ptr<Memento> prev);
+};
+
+template <typename Visitor>
+void Canvas::forEach(Visitor visit) const {
+    for (size_t i = 0; i < shapes.size(); ++i) {
+        if (shapes[i] != NULL) {
+            visit(static_cast<const Shape&>(*shapes[i]));
+        }
+    }
+}
+
+// =========================
+// Raster rendering
+// =========================
+
+// RGBA image, one packed 0xRRGGBBAA pixel per uint32_t, rows top to bottom
+class Framebuffer {
+private:
+    int width;
+    int height;
+    std::vector<uint32_t> pixels;
+
+public:
+    Framebuffer(int width = 0, int height = 0, uint32_t background = 0);
+    void resize(int width, int height, uint32_t background);
+
+    int getWidth() const;
+    int getHeight() const;
+    uint32_t getPixel(int x, int y) const;
+    const uint32_t* row(int y) const;
+
+    // Paints [x0, x1) of row y, blending source-over when the colour is not opaque.
+    // Both loops are plain enough for the compiler to vectorise
+    void fillSpan(int y, int x0, int x1, uint32_t rgba);
+    void clear(const Bounds& area, uint32_t rgba); // stores the colour, no blending
+};
+
+struct RasterOptions {
+    bool fitToShapes = true; // size and origin follow the canvas bounding box
+    int width = 0;
+    int height = 0;
+    int originX = 0; // canvas point drawn at pixel (0, 0)
+    int originY = 0;
+    uint32_t background = 0xFFFFFFFF;
+    unsigned threads = 0; // 0 uses every core
+    int tileSize = 256;
+};
+
+// Everything an exporter needs from a canvas, gathered in one pass over the shapes:
+// bounds, colours and the layout of textbox text. Items point back at the shapes,
+// so a scene is valid as long as the canvas it was built from is unchanged
+struct SceneItem {
+    Bounds bounds;
+    uint32_t rgba;
+    const Shape* shape;
+    int textSize; // 0 for shapes without text
+    uint32_t ink; // text colour, picked to stand out against the fill
+};
+
+class ExportScene {
+private:
+    std::vector<SceneItem> items;
+    Bounds bounds = { 0, 0, 0, 0 };
+
+public:
+    static SceneItem describe(const Shape& shape); // the item build() makes for one shape
+
+    void build(const Canvas& canvas);
+    const std::vector<SceneItem>& getItems() const;
+    const Bounds& getBounds() const;
+};
+
+// Fills each shape's bounds with its colour in canvas order. The framebuffer is cut
+// into square tiles, shapes are binned per tile, and the calling thread and up to
+// RasterOptions::threads - 1 render workers take tiles off a shared counter, so no two
+// threads ever write the same pixel. The render workers are started once per process
+class Rasterizer {
+public:
+    static void render(const Canvas& canvas, Framebuffer& target, const RasterOptions& options);
+
+    // Renders one row of tiles at a time and calls onBand with the number of finished
+    // rows after each, so the caller can consume them while the next band renders.
+    // Rendering stops early when onBand returns false
+    static void render(const Canvas& canvas, Framebuffer& target, const RasterOptions& options,
+                       const std::function<bool(int rowsDone)>& onBand);
+    // With a tile mask (one byte per tile, row-major) only the marked tiles are
+    // cleared to the background and drawn again, the rest of the target is kept
+    static void render(const ExportScene& scene, Framebuffer& target, const RasterOptions& options,
+                       const std::function<bool(int rowsDone)>& onBand,
+                       const std::vector<unsigned char>* tileMask = NULL);
+};
+
+class DeflateWriter;
+
+// Compressed rows of one band. Every band ends on a byte boundary, so a band kept
+// from an earlier encode can be spliced into a new one unchanged
+struct PngSegment {
+    std::vector<unsigned char> bytes;
+    uint32_t adler = 1; // of the band's uncompressed scanlines
+    size_t rawBytes = 0;
+    int rows = 0;
+};
+
+// Minimal PNG writer: 8-bit RGBA, no filtering, deflate with the fixed Huffman
+// codes and pixel-repeat matches, which is enough to shrink flat fills to almost nothing.
+// Rows can be fed in bands as they are rendered, compressed data is flushed to the
+// stream in IDAT chunks as it builds up
+class PngEncoder {
+private:
+    std::ostream* out = NULL;
+    DeflateWriter* deflate = NULL;
+    int width = 0;
+    int height = 0;
+    int rowsWritten = 0;
+    uint32_t adler = 1;
+
+    void flushChunks(bool all);
+
+public:
+    PngEncoder() = default;
+    ~PngEncoder();
+    PngEncoder(const PngEncoder&) = delete;
+    PngEncoder& operator=(const PngEncoder&) = delete;
+
+    bool begin(std::ostream& stream, int width, int height);
+    // Rows must come in order. keep, when given, receives the band for later reuse
+    void addRows(const Framebuffer& image, int y0, int y1, PngSegment* keep = NULL);
+    void addSegment(const PngSegment& band);
+    bool finish();
+    bool isOpen() const;
+
+    static std::vector<unsigned char> encode(const Framebuffer& image);
+    static bool writeFile(const Framebuffer& image, const std::string& path);
+};
+
+// Writes a one-page PDF 1.4 straight to disk. Drawing operators go into the page's
+// content stream as they come, and the stream length and the other objects follow
+// it, so memory use does not depend on how much is drawn. Page coordinates are
+// canvas coordinates relative to the page box, with y growing downwards.
+// Translucent colours draw through a graphics state per alpha value, fully
+// transparent ones draw nothing
+class PdfStreamWriter {
+private:
+    std::ofstream out;
+    Bounds page;
+    std::streamoff offsets[7]; // byte offset of each object, numbered from 1
+    std::streamoff streamStart;
+    bool open = false;
+    std::string path;
+    std::bitset<256> alphas; // the graphics states the page resources have to define
+
+    void beginObject(int number);
+    void print(const char* format, ...);
+
+public:
+    PdfStreamWriter() = default;
+    PdfStreamWriter(const PdfStreamWriter&) = delete;
+    PdfStreamWriter& operator=(const PdfStreamWriter&) = delete;
+
+    bool begin(const std::string& path, const Bounds& pageBox);
+    void fillRect(const Bounds& area, uint32_t rgba);
+    void text(int x, int y, int size, std::string_view value, uint32_t rgba);
+    bool finish();
+    void abandon(); // closes and deletes a partly written file
+    bool isOpen() const;
 };
 
 // =========================
 // Template Method
 // =========================
+// Handle to an export running on its own thread. Deleting the job waits for it
+class ExportJob {
+private:
+    std::atomic<int> progress; // per mille
+    std::atomic<bool> cancelRequested;
+    std::atomic<bool> failed;
+    std::future<bool> task; // last, so it is joined before the flags go away
+
+    friend class ExportCanvas;
+    friend class ExportBatch;
+
+public:
+    ExportJob();
+    ExportJob(const ExportJob&) = delete;
+    ExportJob& operator=(const ExportJob&) = delete;
+
+    void cancel();
+    bool isCancelled() const;
+    double getProgress() const; // 0 to 1
+    bool isDone() const;
+    void wait() const;
+    bool get(); // true when the export finished, was not cancelled and wrote its file
+};
+
 class ExportCanvas {
+private:
+    friend class ExportBatch;
+    friend class CanvasEngine;
+    bool runOn(const Canvas* target, const ExportScene* shared, ExportJob* running);
+
 protected:
-    Canvas* canvas;
+    const Canvas* canvas;
+    ExportJob* job = NULL; // set while an async export runs
+    const ExportScene* scene = NULL; // set for the steps, shared when run from an ExportBatch, NULL if unused
+
+    // Whether exportCanvas() builds a scene for the steps when no batch shares one
+    virtual bool usesScene() const;
+
+    // For the steps: progress and cancellation of the running job, no-ops otherwise
+    void reportProgress(double done);
+    void reportFailure();
+    bool isCancelled() const;
 
 public:
     ExportCanvas(Canvas* c);
@@ -162,25 +1487,269 @@ public:
 
     void exportCanvas(); // Template method
 
+    // Runs the template method on another thread against Canvas::read(), taken
+    // here, so the canvas can be edited meanwhile. The exporter belongs to the job
+    // until it is done; the caller deletes the job
+    ExportJob* exportAsync();
+
     virtual void prepareCanvas() = 0;
     virtual void renderElements() = 0;
     virtual void saveToFile() = 0;
 };
 
 class PNGExporter : public ExportCanvas {
+private:
+    RasterOptions options;
+    std::string path = "canvas.png";
+    Framebuffer framebuffer;
+    std::ofstream file;
+    PngEncoder encoder; // fed band by band while the next band renders
+
+    // Previous output, reused when the next export is of the same canvas and frame.
+    // Only tiles touched by dirty regions are drawn again, and only their bands re-encoded
+    std::vector<PngSegment> bands;
+    std::vector<unsigned char> tileMask;
+    bool cached = false;
+    bool incremental = false;
+    unsigned long cachedOrigin = 0;
+    unsigned long cachedRevision = 0;
+    RasterOptions cachedOptions;
+    size_t redrawnTiles = 0;
+
 public:
     PNGExporter(Canvas* c);
+    void setOptions(const RasterOptions& o);
+    const RasterOptions& getOptions() const;
+    void setOutputPath(const std::string& p);
+    const std::string& getOutputPath() const;
+    const Framebuffer& getFramebuffer() const;
+    bool wasIncremental() const; // whether the last export reused the previous output
+    size_t getRedrawnTiles() const;
+
     void prepareCanvas() override;
     void renderElements() override;
     void saveToFile() override;
 };
 
+// Streams the shapes straight from the canvas, so unlike PNGExporter it needs no
+// ExportScene of its own; a scene shared by an ExportBatch is used when there is one
 class PDFExporter : public ExportCanvas {
+private:
+    std::string path = "canvas.pdf";
+    PdfStreamWriter writer;
+
+    void draw(const SceneItem& item);
+
+protected:
+    bool usesScene() const override;
+
 public:
     PDFExporter(Canvas* c);
+    void setOutputPath(const std::string& p);
+    const std::string& getOutputPath() const;
+
     void prepareCanvas() override;
     void renderElements() override;
     void saveToFile() override;
 };
 
+// Exports one canvas through several exporters at once. The canvas is snapshotted and
+// walked into an ExportScene a single time, then every exporter runs its template
+// method on its own thread against that scene. Exporters are not owned
+class ExportBatch {
+private:
+    Canvas* canvas;
+    std::vector<ExportCanvas*> exporters;
+
+public:
+    ExportBatch(Canvas* c);
+
+    void add(ExportCanvas* exporter);
+    size_t size() const;
+
+    // Blocks until every exporter is done, true when all of them succeeded
+    bool run();
+};
+
+// =========================
+// Binary board files
+// =========================
+
+// Versioned on-disk form of a canvas, little-endian throughout:
+//   header        magic "OCNB", version, record count and the offset of each section
+//   records       one fixed 32-byte record per shape: kind, colour index, geometry, text span
+//   text blob     Textbox strings back to back
+//   colour table  the colour names the records refer to, each prefixed with its length
+// write() produces it in one pass over the canvas. open() maps the file and only checks
+// the header and colour table, records are read in place and shapes built when asked for
+class CanvasFile {
+public:
+    static const uint32_t currentVersion = 1;
+    static const size_t headerBytes = 48;
+    static const size_t recordBytes = 32;
+
+private:
+    const unsigned char* data = NULL;
+    size_t length = 0;
+    bool mapped = false; // data is a memory map, otherwise it points into buffer
+    std::vector<unsigned char> buffer;
+    uint32_t version = 0;
+    size_t count = 0;
+    const unsigned char* records = NULL;
+    const unsigned char* texts = NULL;
+    size_t textBytes = 0;
+    std::vector<const ColourEntry*> colours; // file colour index to palette entry
+
+    bool parse();
+
+public:
+    CanvasFile() = default;
+    ~CanvasFile();
+    CanvasFile(const CanvasFile&) = delete;
+    CanvasFile& operator=(const CanvasFile&) = delete;
+
+    // Writes the non-NULL shapes of the canvas, false (and no file) on failure
+    static bool write(const Canvas& canvas, const std::string& path);
+    // Same format from the current position of a seekable stream, false if a text span overflows
+    static bool write(const ShapeView& shapes, std::ostream& out);
+
+    bool open(const std::string& path); // false for missing, truncated or newer files
+    bool open(std::vector<unsigned char>& bytes); // takes over an encoded buffer
+    void close();
+    bool isOpen() const;
+    uint32_t getVersion() const;
+    size_t size() const;
+
+    // Read straight from record i, nothing is built
+    ShapeKind getKind(size_t i) const;
+    Bounds getBounds(size_t i) const;
+    const ColourEntry* getColour(size_t i) const; // NULL for a bad colour index
+
+    // A new off-canvas shape for record i, owned by the caller. NULL when the record is corrupt
+    Shape* materialize(size_t i, ShapeAllocator* allocator = NULL) const;
+
+    // Adds every record to the canvas, from its allocator. Returns how many were added
+    size_t loadInto(Canvas& canvas) const;
+};
+
+// =========================
+// Document engine
+// =========================
+
+// Work-stealing thread pool. Each worker owns a deque: tasks submitted from a worker go
+// to the back of its own deque and it takes from the back, idle workers steal from the
+// front of the others. Tasks submitted from outside are dealt round-robin. Tasks must
+// not throw
+class TaskScheduler {
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t queued = 0; // guarded by sleepMutex, like outstanding and stopping
+    size_t outstanding = 0; // queued or running
+    bool stopping = false;
+    std::atomic<size_t> nextWorker{0};
+    std::atomic<unsigned long> steals{0};
+    std::atomic<unsigned long> completed{0};
+
+    void run(size_t index);
+    bool take(size_t index, std::function<void()>& task);
+
+public:
+    explicit TaskScheduler(size_t threads = 0); // 0 means one per hardware thread
+    ~TaskScheduler(); // finishes every queued task, then joins
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    void submit(std::function<void()> task);
+    void waitIdle(); // until nothing is queued or running
+
+    size_t getWorkerCount() const;
+    unsigned long getStealCount() const;
+    unsigned long getCompletedCount() const;
+};
+
+typedef unsigned long DocumentId;
+
+// Hosts many documents, each a Canvas with a CareTaker as its journal, on one shared
+// TaskScheduler. Work posted to a document runs in the order it was posted and never
+// on two threads at once; different documents run in parallel. A document with a long
+// queue gives its worker back every batchLimit operations so others are not starved
+class CanvasEngine {
+public:
+    typedef std::function<void(Canvas&, CareTaker&)> Operation;
+    static const size_t batchLimit = 64;
+
+private:
+    struct Document {
+        CareTaker history;
+        Canvas canvas;
+        std::mutex mutex;
+        std::deque<Operation> pending;
+        bool scheduled = false; // a drain task is queued or running
+    };
+
+    TaskScheduler scheduler;
+    mutable std::mutex mutex;
+    std::unordered_map<DocumentId, std::shared_ptr<Document>> documents;
+    DocumentId nextId = 1;
+
+    std::shared_ptr<Document> find(DocumentId id) const;
+    void drain(const std::shared_ptr<Document>& document);
+
+public:
+    explicit CanvasEngine(size_t threads = 0);
+    ~CanvasEngine(); // runs everything already posted
+    CanvasEngine(const CanvasEngine&) = delete;
+    CanvasEngine& operator=(const CanvasEngine&) = delete;
+
+    DocumentId open();
+    bool close(DocumentId id); // work already posted still runs
+    size_t getDocumentCount() const;
+
+    // False when the document is not open
+    bool post(DocumentId id, Operation operation);
+
+    // Snapshot taken after everything posted before it, invalid future for a closed document
+    std::future<std::shared_ptr<const Canvas>> snapshot(DocumentId id);
+
+    // Snapshots in order like snapshot(), then runs the exporter's template method against
+    // it on a thread of its own, so the document takes further edits meanwhile and a long
+    // export holds no scheduler worker. The exporter must stay alive and unused elsewhere
+    // until the future is ready
+    std::future<bool> exportDocument(DocumentId id, ExportCanvas* exporter);
+
+    void waitIdle();
+    const TaskScheduler& getScheduler() const;
+};
+
+// Throughput driver for a CanvasEngine that stands in for a server's connection threads
+// on one machine, without sockets. Each client opens its own documents and posts a mix
+// of adds, moves, undos and snapshots to them round-robin
+struct LoopbackResult {
+    size_t documents = 0;
+    size_t operations = 0;
+    double seconds = 0;
+
+    double getOperationsPerSecond() const;
+};
+
+class LoopbackDriver {
+private:
+    CanvasEngine& engine;
+
+public:
+    explicit LoopbackDriver(CanvasEngine& engine);
+
+    // Blocks until every posted operation has run; the documents are closed afterwards
+    LoopbackResult run(size_t clients, size_t documentsPerClient, size_t operationsPerDocument);
+};
+
 #endif // OPENCANVAS_H
\ No newline at end of file
@@ -1,5 +1,10 @@
 #include "OpenCanvas.h"
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <type_traits>
 
 
 //test factory to strings
@@ -373,6 +378,1332 @@ void testIntegration() {
     }
 }
 
+// Test structural sharing between snapshots
+void testSharedSnapshots() {
+    std::cout << "\n=== TESTING SHARED SNAPSHOTS ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(10, 20, "blue", 0, 0));
+    canvas.addShape(new Textbox(30, 10, "green", 5, 5, "Original"));
+
+    Memento* first = canvas.captureCurrent();
+    Memento* second = canvas.captureCurrent();
+    std::cout << "Unchanged shapes shared between snapshots: "
+              << (first->getSavedState()[0] == second->getSavedState()[0] ? "yes" : "no") << "\n";
+
+    // Changing a shape must only diverge that shape
+    dynamic_cast<Textbox*>(canvas.getShapes()[1])->setText("Changed");
+    Memento* third = canvas.captureCurrent();
+    std::cout << "Rectangle still shared: "
+              << (second->getSavedState()[0] == third->getSavedState()[0] ? "yes" : "no") << "\n";
+    std::cout << "Textbox copied after edit: "
+              << (second->getSavedState()[1] != third->getSavedState()[1] ? "yes" : "no") << "\n";
+
+    canvas.undoAction(second);
+    std::cout << "Textbox text after undo: "
+              << dynamic_cast<Textbox*>(canvas.getShapes()[1])->getText() << "\n";
+
+    // Deep mode still clones everything
+    canvas.setSnapshotMode(SnapshotMode::DeepCopy);
+    Memento* deep = canvas.captureCurrent();
+    std::cout << "Deep snapshot shares rectangle: "
+              << (deep->getSavedState()[0] == third->getSavedState()[0] ? "yes" : "no") << "\n";
+
+    // Twins are immutable, and the types only hand them out as const
+    static_assert(std::is_same<decltype(deep->getSavedState()[0]), const Shape*>::value, "saved shapes are const");
+    static_assert(std::is_same<decltype(canvas.read()->findShape(0)), const Shape*>::value, "snapshot shapes are const");
+    static_assert(std::is_same<decltype(canvas.read()->getShapes()), std::vector<const Shape*>>::value, "snapshot shapes are const");
+
+    delete first;
+    delete second;
+    delete third;
+    delete deep;
+}
+
+// Test the delta journal undo/redo
+void testDeltaJournal() {
+    std::cout << "\n=== TESTING DELTA JOURNAL ===\n";
+
+    Canvas canvas;
+    CareTaker caretaker;
+    canvas.setJournal(&caretaker);
+
+    canvas.addShape(new Rectangle(10, 20, "blue", 0, 0));
+    canvas.addShape(new Textbox(30, 10, "green", 5, 5, "Draft"));
+    Shape* rect = canvas.getShapes()[0];
+    rect->setPosition(40, 50);
+    rect->setColour("red");
+    rect->setLength(99);
+    dynamic_cast<Textbox*>(canvas.getShapes()[1])->setText("Final");
+    canvas.removeShape(1);
+    std::cout << "Edits journaled: " << caretaker.getEditCount() << "\n";
+
+    caretaker.undoEdit(canvas); // remove
+    std::cout << "After undoing remove: " << canvas.getShapes().size() << " shapes\n";
+    caretaker.undoEdit(canvas); // set text
+    std::cout << "Text after undo: " << dynamic_cast<Textbox*>(canvas.getShapes()[1])->getText() << "\n";
+    caretaker.undoEdit(canvas); // resize
+    caretaker.undoEdit(canvas); // recolour
+    caretaker.undoEdit(canvas); // move
+    std::cout << "Rectangle after undos: " << rect->getLength() << " " << rect->getColour()
+              << " at (" << rect->getPositionX() << "," << rect->getPositionY() << ")\n";
+
+    caretaker.redoEdit(canvas);
+    std::cout << "Rectangle after redo: at (" << rect->getPositionX() << "," << rect->getPositionY() << ")\n";
+    std::cout << "Undo entries: " << caretaker.getEditCount() << ", redo entries: " << caretaker.getRedoCount() << "\n";
+
+    // A new edit drops the redo entries
+    rect->setWidth(7);
+    std::cout << "Redo entries after new edit: " << caretaker.getRedoCount() << "\n";
+
+    // Assignment is journaled and indexed like the setters it goes through
+    canvas.setSpatialIndexEnabled(true);
+    size_t edits = caretaker.getEditCount();
+    *rect = Rectangle(5, 5, "purple", 200, 200);
+    std::cout << "Edits journaled by assignment: " << caretaker.getEditCount() - edits
+              << ", found at new place: " << (canvas.hitTest(202, 202).size() == 1 ? "yes" : "no") << "\n";
+    caretaker.undoEdit(canvas);
+    caretaker.undoEdit(canvas);
+    caretaker.undoEdit(canvas);
+    std::cout << "Assignment undone: " << rect->getColour() << " at (" << rect->getPositionX() << ","
+              << rect->getPositionY() << "), hits there: " << canvas.hitTest(202, 202).size() << "\n";
+    canvas.setSpatialIndexEnabled(false);
+
+    while (caretaker.undoEdit(canvas)) {}
+    std::cout << "Canvas after undoing everything: " << canvas.getShapes().size() << " shapes\n";
+    canvas.setJournal(NULL);
+}
+
+// Test history budgets, eviction, redo and compaction
+void testBoundedHistory() {
+    std::cout << "\n=== TESTING BOUNDED HISTORY ===\n";
+
+    Canvas canvas;
+    CareTaker caretaker;
+    HistoryLimits limits;
+    limits.maxEntries = 3;
+    caretaker.setLimits(limits);
+
+    canvas.addShape(new Rectangle(10, 20, "blue", 0, 0));
+    for (int i = 1; i <= 5; ++i) {
+        canvas.getShapes()[0]->setPositionX(i);
+        caretaker.addMemento(canvas.captureCurrent());
+    }
+    std::cout << "Entries kept with maxEntries=3: " << caretaker.getEntryCount()
+              << ", bytes: " << caretaker.getHistoryBytes() << "\n";
+
+    // Undo/redo of full states
+    canvas.getShapes()[0]->setPositionX(6);
+    caretaker.undoState(canvas);
+    std::cout << "After undoState x=" << canvas.getShapes()[0]->getPositionX() << "\n";
+    caretaker.redoState(canvas);
+    std::cout << "After redoState x=" << canvas.getShapes()[0]->getPositionX() << "\n";
+    std::cout << "Redo states left: " << caretaker.getRedoStateCount() << "\n";
+
+    // Redo entries count toward the budget and are the first to go
+    caretaker.undoState(canvas);
+    caretaker.undoState(canvas);
+    limits.maxEntries = 2;
+    caretaker.setLimits(limits);
+    std::cout << "Entries with maxEntries=2: " << caretaker.getEntryCount() << ", redo states: "
+              << caretaker.getRedoStateCount() << ", x=" << canvas.getShapes()[0]->getPositionX() << "\n";
+    caretaker.redoState(canvas);
+    std::cout << "Redo kept the nearest state: x=" << canvas.getShapes()[0]->getPositionX() << "\n";
+
+    // Undoing at the byte limit keeps the state it pushed, so redo still has it
+    Canvas tight;
+    tight.setSnapshotMode(SnapshotMode::DeepCopy);
+    tight.addShape(new Square(5, "red", 0, 0));
+    CareTaker budget;
+    for (int x = 0; x < 3; ++x) {
+        tight.getShapes()[0]->setPositionX(x);
+        budget.addMemento(tight.captureCurrent());
+    }
+    HistoryLimits full;
+    full.maxBytes = budget.getHistoryBytes();
+    budget.setLimits(full);
+    tight.addShape(new Square(5, "blue", 9, 9));
+    budget.undoState(tight);
+    bool redone = budget.redoState(tight);
+    std::cout << "Undo then redo at the byte limit: " << (redone ? "redone" : "lost")
+              << ", shapes: " << tight.size() << "\n";
+
+    // Byte budget
+    limits.maxEntries = 0;
+    limits.maxBytes = 1;
+    caretaker.setLimits(limits);
+    std::cout << "Entries kept with maxBytes=1: " << caretaker.getEntryCount() << "\n";
+
+    // Compaction folds a run of deep states into one keyframe plus the changes, and each
+    // state is still its own undo step
+    Canvas deep;
+    deep.setSnapshotMode(SnapshotMode::DeepCopy);
+    for (int i = 0; i < 50; ++i) {
+        deep.addShape(new Square(5, "red", i * 10, 0));
+    }
+    CareTaker plain;
+    CareTaker folded;
+    HistoryLimits compact;
+    compact.compactInterval = 4;
+    folded.setLimits(compact);
+    for (int step = 0; step < 8; ++step) {
+        deep.getShapes()[0]->setPositionY(step);
+        plain.addMemento(deep.captureCurrent());
+        folded.addMemento(deep.captureCurrent());
+    }
+    std::cout << "Compacted history under half the size: "
+              << (folded.getHistoryBytes() * 2 < plain.getHistoryBytes() ? "yes" : "no") << "\n";
+    bool steps = true;
+    for (int step = 7; step >= 0; --step) {
+        Memento* saved = folded.getLastMemento();
+        steps = steps && saved != NULL && saved->getSavedState()[0]->getPositionY() == step &&
+                saved->getSavedState()[49]->getPositionX() == 490;
+        delete saved;
+    }
+    std::cout << "Every compacted state restores on its own: " << (steps ? "yes" : "no") << "\n";
+}
+
+// Test the structure-of-arrays store behind the canvas
+void testShapeStore() {
+    std::cout << "\n=== TESTING SHAPE STORE ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(10, 20, "blue", 0, 0));
+    canvas.addShape(new Square(15, "red", 5, 5));
+    canvas.setShapeStoreEnabled(true);
+    canvas.addShape(new Textbox(30, 10, "blue", 40, 40, "Store me"));
+
+    const ShapeStore* store = canvas.getShapeStore();
+    std::cout << "Store rows: " << store->size() << "\n";
+
+    Bounds box = canvas.getBoundingBox();
+    std::cout << "Bounding box: (" << box.minX << "," << box.minY << ")-(" << box.maxX << "," << box.maxY << ")\n";
+    std::cout << "Shapes under (6,6): " << canvas.hitTest(6, 6).size() << "\n";
+
+    // Edits and removals keep the columns in sync
+    canvas.getShapes()[1]->setPosition(100, 100);
+    std::cout << "Shapes under (6,6) after move: " << canvas.hitTest(6, 6).size() << "\n";
+    unsigned textId = canvas.getShapes()[2]->getId();
+    canvas.removeShape(0);
+    std::cout << "Store rows after remove: " << store->size() << "\n";
+    std::cout << "Textbox row colour: " << store->getColour(store->rowOf(textId))
+              << ", text: " << *store->getText(textId) << "\n";
+
+    canvas.setShapeStoreEnabled(false);
+    box = canvas.getBoundingBox();
+    std::cout << "Bounding box without store: (" << box.minX << "," << box.minY << ")-(" << box.maxX << "," << box.maxY << ")\n";
+}
+
+// Test the interned colour palette
+void testColourPalette() {
+    std::cout << "\n=== TESTING COLOUR PALETTE ===\n";
+
+    Rectangle a(10, 10, "teal-ish", 0, 0);
+    Square b(5, "teal-ish", 1, 1);
+    std::cout << "Same colour shares an id: " << (a.getColourId() == b.getColourId() ? "yes" : "no") << "\n";
+    std::cout << "Shared entry: " << (&a.getColour() == &b.getColour() ? "yes" : "no") << "\n";
+
+    Rectangle hex(1, 1, "#11223344", 0, 0);
+    std::cout << std::hex << "RGBA red: " << Rectangle(1, 1, "red", 0, 0).getColourRgba()
+              << ", hex: " << hex.getColourRgba() << std::dec << "\n";
+
+    // Clones keep the same palette entry
+    Shape* clone = a.clone();
+    std::cout << "Clone keeps id: " << (clone->getColourId() == a.getColourId() ? "yes" : "no") << "\n";
+    delete clone;
+
+    // Recolour undo goes through palette ids
+    Canvas canvas;
+    CareTaker journal;
+    canvas.setJournal(&journal);
+    Shape* shape = new Rectangle(1, 1, "green", 0, 0);
+    canvas.addShape(shape);
+    shape->setColour("#abcdef");
+    journal.undoEdit(canvas);
+    std::cout << "Colour after undo: " << shape->getColour() << "\n";
+    journal.redoEdit(canvas);
+    std::cout << "Colour after redo: " << shape->getColour() << "\n";
+    canvas.setJournal(NULL);
+}
+
+// Test the shape pools and the per-canvas arena
+void testShapeAllocators() {
+    std::cout << "\n=== TESTING SHAPE ALLOCATORS ===\n";
+
+    // Freed blocks are reused, so churn does not grow the pool
+    ShapePool pool(8);
+    RectangleFactory pooled;
+    pooled.setAllocator(&pool);
+    for (int round = 0; round < 3; ++round) {
+        std::vector<Shape*> batch;
+        for (int i = 0; i < 8; ++i) {
+            batch.push_back(pooled.createShape());
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            delete batch[i];
+        }
+    }
+    std::cout << "Pool chunks after churn: " << pool.getChunkCount() << "\n";
+
+    // Shapes from a canvas arena, clones follow their original
+    CareTaker caretaker;
+    {
+        Canvas canvas;
+        canvas.setArenaEnabled(true);
+        SquareFactory squares;
+        TextboxFactory texts;
+        squares.setAllocator(canvas.getAllocator());
+        texts.setAllocator(canvas.getAllocator());
+        canvas.addShape(squares.createShape());
+        canvas.addShape(texts.createShape());
+        Shape* clone = canvas.getShapes()[0]->clone();
+        std::cout << "Clone from arena: " << (clone->getAllocator() == canvas.getAllocator() ? "yes" : "no") << "\n";
+        delete clone;
+        canvas.setSnapshotMode(SnapshotMode::DeepCopy);
+        caretaker.addMemento(canvas.captureCurrent());
+        std::cout << "Arena blocks in use: " << static_cast<ShapeArena*>(canvas.getAllocator())->getLiveBlocks() << "\n";
+    }
+
+    // The memento keeps the arena alive after the canvas is gone
+    Memento* saved = caretaker.getLastMemento();
+    std::cout << "Memento shapes after canvas died: " << saved->getSavedState().size() << "\n";
+    delete saved;
+
+    // Threads churning shapes through one arena recycle blocks in their own caches
+    {
+        Canvas canvas;
+        canvas.setArenaEnabled(true);
+        ShapeArena* arena = static_cast<ShapeArena*>(canvas.getAllocator());
+        std::vector<std::thread> workers;
+        for (int t = 0; t < 4; ++t) {
+            workers.push_back(std::thread([arena]() {
+                SquareFactory squares;
+                squares.setAllocator(arena);
+                for (int round = 0; round < 100; ++round) {
+                    std::vector<Shape*> batch;
+                    for (int i = 0; i < 50; ++i) {
+                        batch.push_back(squares.createShape());
+                    }
+                    for (size_t i = 0; i < batch.size(); ++i) {
+                        delete batch[i];
+                    }
+                }
+            }));
+        }
+        for (size_t t = 0; t < workers.size(); ++t) {
+            workers[t].join();
+        }
+        std::cout << "Arena blocks in use after threaded churn: " << arena->getLiveBlocks()
+                  << ", chunks bounded: " << (arena->getChunkCount() <= 4 ? "yes" : "no") << "\n";
+    }
+}
+
+// Test the quadtree against the plain scans
+void testSpatialIndex() {
+    std::cout << "\n=== TESTING SPATIAL INDEX ===\n";
+
+    Canvas indexed;
+    Canvas plain;
+    Canvas stored;
+    indexed.setSpatialIndexEnabled(true);
+    stored.setShapeStoreEnabled(true);
+    unsigned seed = 7;
+    for (int i = 0; i < 500; ++i) {
+        seed = seed * 1103515245 + 12345;
+        int x = static_cast<int>(seed % 4000) - 1000;
+        seed = seed * 1103515245 + 12345;
+        int y = static_cast<int>(seed % 3000) - 500;
+        int size = 1 + static_cast<int>(seed % 60);
+        indexed.addShape(new Rectangle(size, size / 2 + 1, "blue", x, y));
+        plain.addShape(new Rectangle(size, size / 2 + 1, "blue", x, y));
+        stored.addShape(new Rectangle(size, size / 2 + 1, "blue", x, y));
+    }
+    // A few moves and removals the index must follow
+    for (size_t i = 0; i < 50; ++i) {
+        indexed.getShapes()[i]->setPosition(static_cast<int>(i) * 3, 5000);
+        plain.getShapes()[i]->setPosition(static_cast<int>(i) * 3, 5000);
+        stored.getShapes()[i]->setPosition(static_cast<int>(i) * 3, 5000);
+    }
+    indexed.getShapes()[60]->setSize(2000, 10);
+    plain.getShapes()[60]->setSize(2000, 10);
+    stored.getShapes()[60]->setSize(2000, 10);
+    indexed.removeShape(100);
+    plain.removeShape(100);
+    stored.removeShape(100);
+    // Three shapes over one point, the first removed: the store swaps its last row into the gap
+    Canvas* canvases[3] = { &indexed, &plain, &stored };
+    for (int c = 0; c < 3; ++c) {
+        size_t first = canvases[c]->size();
+        for (int i = 0; i < 3; ++i) {
+            canvases[c]->addShape(new Square(10 + i, "red", 9000, 9000));
+        }
+        canvases[c]->removeShape(first);
+    }
+
+    bool same = true;
+    for (int x = -1000; x < 3000; x += 37) {
+        for (int y = -500; y < 5100; y += 41) {
+            std::vector<unsigned> a = indexed.hitTest(x, y);
+            std::vector<unsigned> b = plain.hitTest(x, y);
+            same = same && a == b && stored.hitTest(x, y) == b; // all in canvas order
+        }
+    }
+    same = same && indexed.hitTest(9001, 9001) == plain.hitTest(9001, 9001) && stored.hitTest(9001, 9001) == plain.hitTest(9001, 9001);
+    Bounds view = { 0, 0, 800, 600 };
+    same = same && indexed.queryRect(view) == plain.queryRect(view);
+    same = same && indexed.nearest(123, 456, 10) == plain.nearest(123, 456, 10);
+    std::cout << "Index matches scan: " << (same ? "yes" : "no") << "\n";
+    std::cout << "Indexed shapes: " << indexed.getSpatialIndex()->size() << "\n";
+    std::cout << "Shapes in viewport: " << indexed.queryRect(view).size() << "\n";
+
+    // Erasing a crowd collapses the quadrants it had split
+    size_t nodes = indexed.getSpatialIndex()->nodeCount();
+    while (indexed.size() > 0) {
+        indexed.removeShape(indexed.size() - 1);
+    }
+    std::cout << "Nodes before erasing: " << (nodes > 1 ? "several" : "one") << ", after: "
+              << indexed.getSpatialIndex()->nodeCount() << "\n";
+}
+
+// Test iterating a canvas without copying its shape list
+void testShapeViews() {
+    std::cout << "\n=== TESTING SHAPE VIEWS ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(10, 20, "blue", 0, 0));
+    canvas.addShape(new Square(5, "red", 1, 1));
+    canvas.addShape(NULL);
+    canvas.addShape(new Textbox(30, 10, "green", 4, 4, "Viewed"));
+    canvas.addShape(new Square(7, "red", 2, 2));
+
+    std::cout << "Canvas size: " << canvas.size() << ", view size: " << canvas.view().size() << "\n";
+
+    int area = 0;
+    canvas.forEach([&area](const Shape& shape) { area += shape.getLength() * shape.getWidth(); });
+    std::cout << "Total area: " << area << "\n";
+
+    std::cout << "Squares:";
+    ShapeKindView squares = canvas.viewOf(ShapeKind::Square);
+    for (ShapeKindView::const_iterator it = squares.begin(); it != squares.end(); ++it) {
+        std::cout << " " << (*it)->getLength();
+    }
+    std::cout << " (" << squares.count() << ")\n";
+    std::cout << "Textboxes: " << canvas.viewOf(ShapeKind::Textbox).count() << "\n";
+}
+
+// Test the rasterizer and PNG output behind PNGExporter
+void testRasterExport() {
+    std::cout << "\n=== TESTING RASTER EXPORT ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(40, 30, "red", 0, 0));
+    canvas.addShape(new Square(20, "#0000FF80", 30, 20));
+    canvas.addShape(new Textbox(10, 10, "green", 100, 100, "off the frame"));
+
+    RasterOptions options;
+    options.fitToShapes = false;
+    options.width = 64;
+    options.height = 48;
+    options.tileSize = 16;
+    options.threads = 1;
+    Framebuffer single(options.width, options.height, options.background);
+    Rasterizer::render(canvas, single, options);
+
+    options.threads = 4;
+    Framebuffer tiled(options.width, options.height, options.background);
+    Rasterizer::render(canvas, tiled, options);
+
+    bool same = true;
+    for (int y = 0; y < options.height; ++y) {
+        for (int x = 0; x < options.width; ++x) {
+            same = same && single.getPixel(x, y) == tiled.getPixel(x, y);
+        }
+    }
+    std::cout << "Threads agree: " << (same ? "yes" : "no") << "\n";
+
+    // Renders on several threads at once share the render workers
+    std::vector<Framebuffer> targets(4, Framebuffer(options.width, options.height, options.background));
+    std::vector<std::thread> renders;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        renders.push_back(std::thread([&canvas, &targets, &options, i]() {
+            Rasterizer::render(canvas, targets[i], options);
+        }));
+    }
+    bool shared = true;
+    for (size_t i = 0; i < renders.size(); ++i) {
+        renders[i].join();
+        for (int y = 0; y < options.height; ++y) {
+            for (int x = 0; x < options.width; ++x) {
+                shared = shared && targets[i].getPixel(x, y) == single.getPixel(x, y);
+            }
+        }
+    }
+    std::cout << "Concurrent renders agree: " << (shared ? "yes" : "no") << "\n";
+    std::cout << std::hex << "Pixel (5,5): " << single.getPixel(5, 5)
+              << ", blended (35,25): " << single.getPixel(35, 25)
+              << ", background (60,5): " << single.getPixel(60, 5) << std::dec << "\n";
+
+    std::vector<unsigned char> png = PngEncoder::encode(single);
+    std::cout << "PNG signature ok: " << (png.size() > 8 && png[1] == 'P' && png[2] == 'N' && png[3] == 'G' ? "yes" : "no") << "\n";
+
+    PNGExporter exporter(&canvas);
+    exporter.setOutputPath("raster_test.png");
+    exporter.exportCanvas();
+    std::cout << "Fitted size: " << exporter.getFramebuffer().getWidth() << "x" << exporter.getFramebuffer().getHeight() << "\n";
+    std::remove("raster_test.png");
+}
+
+// Test the streaming PDF writer behind PDFExporter
+void testPdfExport() {
+    std::cout << "\n=== TESTING PDF EXPORT ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(40, 30, "red", 0, 0));
+    canvas.addShape(new Textbox(60, 20, "black", 10, 40, "Hello (PDF) \\ world"));
+    canvas.addShape(new Square(7, "", 3, 3)); // fully transparent, draws nothing
+    canvas.addShape(new Square(9, "#0000ff80", 1, 1));
+
+    PDFExporter exporter(&canvas);
+    exporter.setOutputPath("pdf_test.pdf");
+    exporter.exportCanvas();
+
+    std::ifstream in("pdf_test.pdf", std::ios::binary);
+    std::string pdf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    std::remove("pdf_test.pdf");
+
+    // Every xref entry must point at the object it names
+    size_t xref = pdf.find("xref\n0 7\n");
+    bool offsetsOk = xref != std::string::npos;
+    for (int i = 1; offsetsOk && i < 7; ++i) {
+        long offset = std::atol(pdf.c_str() + xref + 10 + 20 * i);
+        offsetsOk = pdf.compare(offset, 2, std::to_string(i) + " ") == 0;
+    }
+    std::cout << "PDF header: " << pdf.substr(0, 8) << "\n";
+    std::cout << "Xref offsets valid: " << (offsetsOk ? "yes" : "no") << "\n";
+    std::cout << "Has rectangle: " << (pdf.find("0 30 40 30 re f") != std::string::npos ? "yes" : "no") << "\n";
+    std::cout << "Escaped text: " << (pdf.find("(Hello \\(PDF\\) \\\\ world) Tj") != std::string::npos ? "yes" : "no") << "\n";
+    std::cout << "Transparent fill skipped: " << (pdf.find(" 7 7 re f") == std::string::npos ? "yes" : "no") << "\n";
+    std::cout << "Translucent fill uses its graphics state: "
+              << (pdf.find("q /A128 gs 0.000 0.000 1.000 rg 1 ") != std::string::npos &&
+                  pdf.find("/ExtGState << /A128 << /ca 0.502") != std::string::npos ? "yes" : "no") << "\n";
+}
+
+// Test exporting on another thread while the canvas keeps changing
+void testAsyncExport() {
+    std::cout << "\n=== TESTING ASYNC EXPORT ===\n";
+
+    Canvas canvas;
+    for (int i = 0; i < 50; ++i) {
+        canvas.addShape(new Rectangle(20, 20, "blue", i * 10, i * 5));
+    }
+
+    PNGExporter png(&canvas);
+    png.setOutputPath("async_test.png");
+    ExportJob* job = png.exportAsync();
+
+    // Edits after the snapshot do not reach the export
+    canvas.getShapes()[0]->setPosition(5000, 5000);
+    canvas.addShape(new Square(10, "red", -300, -300));
+    bool ok = job->get();
+    std::cout << "Export finished: " << (ok ? "yes" : "no") << ", progress: " << job->getProgress() << "\n";
+    std::cout << "Exported size: " << png.getFramebuffer().getWidth() << "x" << png.getFramebuffer().getHeight() << "\n";
+    delete job;
+
+    std::ifstream written("async_test.png", std::ios::binary);
+    std::cout << "File written: " << (written.good() ? "yes" : "no") << "\n";
+    written.close();
+    std::remove("async_test.png");
+
+    // A cancelled export leaves no file behind
+    PDFExporter pdf(&canvas);
+    pdf.setOutputPath("cancel_test.pdf");
+    job = pdf.exportAsync();
+    job->cancel();
+    ok = job->get();
+    std::cout << "Cancelled export reports success: " << (ok ? "yes" : "no") << "\n";
+    delete job;
+    std::ifstream cancelled("cancel_test.pdf");
+    std::cout << "Cancelled file left: " << (cancelled.good() ? "yes" : "no") << "\n";
+}
+
+// Test one pass over the canvas feeding several exporters
+void testBatchExport() {
+    std::cout << "\n=== TESTING BATCH EXPORT ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(30, 20, "orange", 0, 0));
+    canvas.addShape(new Textbox(50, 20, "white", 10, 30, "Batched"));
+
+    PNGExporter png(&canvas);
+    png.setOutputPath("batch_test.png");
+    PDFExporter pdf(&canvas);
+    pdf.setOutputPath("batch_test.pdf");
+
+    ExportBatch batch(&canvas);
+    batch.add(&png);
+    batch.add(&pdf);
+    batch.add(NULL);
+    bool ok = batch.run();
+    std::cout << "Batch of " << batch.size() << " succeeded: " << (ok ? "yes" : "no") << "\n";
+    std::cout << "PNG size from shared scene: " << png.getFramebuffer().getWidth() << "x" << png.getFramebuffer().getHeight() << "\n";
+
+    std::ifstream in("batch_test.pdf", std::ios::binary);
+    std::string written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    std::cout << "PDF has text: " << (written.find("(Batched) Tj") != std::string::npos ? "yes" : "no") << "\n";
+    std::remove("batch_test.png");
+    std::remove("batch_test.pdf");
+}
+
+static std::string readFile(const std::string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+// Test that re-exports after small edits only redraw the touched tiles
+void testIncrementalExport() {
+    std::cout << "\n=== TESTING INCREMENTAL EXPORT ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(1000, 600, "white", 0, 0)); // fixes the frame
+    for (int i = 0; i < 40; ++i) {
+        canvas.addShape(new Square(30, i % 2 ? "red" : "#00FF0080", i * 24, i * 14));
+    }
+
+    RasterOptions options;
+    options.tileSize = 64;
+    PNGExporter live(&canvas);
+    live.setOptions(options);
+    live.setOutputPath("incremental_test.png");
+    live.exportCanvas();
+    std::cout << "First export incremental: " << (live.wasIncremental() ? "yes" : "no") << "\n";
+
+    canvas.getShapes()[5]->setPosition(500, 300);
+    canvas.getShapes()[9]->setColour("blue");
+    live.exportCanvas();
+    std::cout << "Second export incremental: " << (live.wasIncremental() ? "yes" : "no")
+              << ", tiles redrawn: " << live.getRedrawnTiles() << "\n";
+
+    // Same bytes as a full export of the edited canvas
+    PNGExporter fresh(&canvas);
+    fresh.setOptions(options);
+    fresh.setOutputPath("full_test.png");
+    fresh.exportCanvas();
+    std::cout << "Matches full export: " << (readFile("incremental_test.png") == readFile("full_test.png") ? "yes" : "no") << "\n";
+
+    // Restoring a memento invalidates everything
+    Memento* m = canvas.captureCurrent();
+    canvas.undoAction(m);
+    delete m;
+    live.exportCanvas();
+    std::cout << "After restore incremental: " << (live.wasIncremental() ? "yes" : "no") << "\n";
+
+    std::remove("incremental_test.png");
+    std::remove("full_test.png");
+}
+
+// Test saving a canvas to the binary format and loading it back
+void testBinaryFiles() {
+    std::cout << "\n=== TESTING BINARY FILES ===\n";
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(40, 30, "red", -5, 7));
+    canvas.addShape(NULL);
+    canvas.addShape(new Square(12, "#00FF0080", 100, 200));
+    canvas.addShape(new Textbox(60, 20, "red", 10, 40, std::string("Hello\0board", 11)));
+    canvas.addShape(new Textbox(5, 5, "blue", 0, 0, ""));
+
+    bool written = CanvasFile::write(canvas, "binary_test.ocb");
+    CanvasFile file;
+    bool opened = file.open("binary_test.ocb");
+    std::cout << "Written: " << (written ? "yes" : "no") << ", opened: " << (opened ? "yes" : "no")
+              << ", version " << file.getVersion() << ", records: " << file.size() << "\n";
+
+    // Records can be inspected without building shapes
+    Bounds b = file.getBounds(0);
+    std::cout << "First record bounds: " << b.minX << "," << b.minY << " to " << b.maxX << "," << b.maxY << "\n";
+    std::cout << "Third record is a textbox: " << (file.getKind(2) == ShapeKind::Textbox ? "yes" : "no") << "\n";
+
+    Canvas loaded;
+    loaded.setArenaEnabled(true);
+    size_t added = file.loadInto(loaded);
+    bool same = added == 4 && loaded.size() == 4;
+    std::vector<Shape*> before = canvas.getShapes();
+    before.erase(before.begin() + 1);
+    for (size_t i = 0; same && i < before.size(); ++i) {
+        const Shape* a = before[i];
+        const Shape* c = loaded.view()[i];
+        same = a->getKind() == c->getKind() && a->getColour() == c->getColour() &&
+               a->getLength() == c->getLength() && a->getWidth() == c->getWidth() &&
+               a->getPositionX() == c->getPositionX() && a->getPositionY() == c->getPositionY() &&
+               c->getAllocator() == loaded.getAllocator();
+        if (same && a->getKind() == ShapeKind::Textbox) {
+            same = static_cast<const Textbox*>(a)->getText() == static_cast<const Textbox*>(c)->getText();
+        }
+    }
+    std::cout << "Loaded canvas matches: " << (same ? "yes" : "no") << "\n";
+    file.close();
+
+    // A truncated file is refused rather than read past its end
+    std::string bytes = readFile("binary_test.ocb");
+    std::ofstream out("binary_test.ocb", std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size() - 3);
+    out.close();
+    std::cout << "Truncated file opens: " << (file.open("binary_test.ocb") ? "yes" : "no") << "\n";
+    std::cout << "Missing file opens: " << (file.open("no_such_file.ocb") ? "yes" : "no") << "\n";
+    std::remove("binary_test.ocb");
+}
+
+// Test paging undo states out to a journal file and recovering them after a restart
+void testPersistentHistory() {
+    std::cout << "\n=== TESTING PERSISTENT HISTORY ===\n";
+    std::remove("history_test.ocj");
+
+    Canvas canvas;
+    canvas.addShape(new Rectangle(10, 10, "red", 0, 0));
+    canvas.addShape(new Textbox(30, 10, "black", 5, 5, "note"));
+    unsigned firstId = canvas.getShapes()[0]->getId();
+
+    CareTaker* caretaker = new CareTaker();
+    bool opened = caretaker->setBackingFile("history_test.ocj", 2);
+    for (int i = 0; i < 5; ++i) {
+        caretaker->addMemento(canvas.captureCurrent());
+        canvas.getShapes()[0]->setPosition((i + 1) * 10, 0);
+    }
+    std::cout << "Backing file opened: " << (opened ? "yes" : "no") << ", states: " << caretaker->getEntryCount()
+              << ", in memory: " << caretaker->getResidentStateCount() << "\n";
+    delete caretaker; // as if the process had stopped
+
+    // A write cut short by a crash leaves a torn frame at the end
+    std::ofstream torn("history_test.ocj", std::ios::binary | std::ios::app);
+    torn.write("\x01\0\0\0\xff", 5);
+    torn.close();
+
+    caretaker = new CareTaker();
+    opened = caretaker->setBackingFile("history_test.ocj", 2);
+    std::cout << "Recovered: " << (opened ? "yes" : "no") << ", states: " << caretaker->getEntryCount()
+              << ", in memory: " << caretaker->getResidentStateCount() << "\n";
+
+    // Undo walks back through states read from the file, shape ids included
+    bool inOrder = true;
+    for (int i = 4; i >= 0; --i) {
+        inOrder = caretaker->undoState(canvas) && inOrder;
+        const Shape* shape = canvas.view()[0];
+        inOrder = inOrder && shape->getPositionX() == i * 10 && shape->getId() == firstId;
+    }
+    const Textbox* text = static_cast<const Textbox*>(canvas.view()[1]);
+    std::cout << "Undo through recovered states: " << (inOrder && text->getText() == "note" ? "yes" : "no") << "\n";
+    std::cout << "Redo states available: " << caretaker->getRedoStateCount() << "\n";
+    delete caretaker;
+
+    // Everything was popped, so a restart finds an empty history
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj");
+    std::cout << "States after popping all: " << caretaker->getEntryCount() << "\n";
+    delete caretaker;
+    std::remove("history_test.ocj");
+
+    // A state frame only carries the shapes that changed since the previous one
+    Canvas large;
+    for (int i = 0; i < 200; ++i) {
+        large.addShape(new Square(2, "green", i, i));
+    }
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    caretaker->addMemento(large.captureCurrent());
+    delete caretaker;
+    size_t oneState = readFile("history_test.ocj").size();
+    std::remove("history_test.ocj");
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    for (int i = 0; i < 5; ++i) {
+        caretaker->addMemento(large.captureCurrent());
+        large.findShape(large.view()[i]->getId())->setPosition(-1, -1);
+    }
+    delete caretaker;
+    std::cout << "Five states cost less than three full ones: "
+              << (readFile("history_test.ocj").size() < 3 * oneState ? "yes" : "no") << "\n";
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    caretaker->addMemento(large.captureCurrent());
+    large.findShape(large.view()[5]->getId())->setPosition(-1, -1);
+
+    // Shapes read back from the file are the twins the live ones still share, so they stay
+    const Shape* untouched = large.view()[100];
+    bool kept = caretaker->undoState(large) && large.view()[100] == untouched && large.view()[5]->getPositionX() == 5;
+    std::cout << "Paged-out undo keeps unchanged shapes: " << (kept ? "yes" : "no") << "\n";
+
+    large.setSnapshotMode(SnapshotMode::Shared);
+
+    // A state that fails its checksum is not popped, from memory or from the file
+    caretaker->addMemento(large.captureCurrent());
+    delete caretaker;
+    size_t damaged = readFile("history_test.ocj").size() - 2; // inside the records of that state
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    caretaker->addMemento(large.captureCurrent());
+    delete caretaker;
+    std::fstream damage("history_test.ocj", std::ios::in | std::ios::out | std::ios::binary);
+    damage.seekp(damaged);
+    damage.write("\xff\xff", 2);
+    damage.close();
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    bool refused = caretaker->undoState(large);
+    size_t entries = caretaker->getEntryCount();
+    refused = refused && !caretaker->undoState(large) && caretaker->getEntryCount() == entries;
+    entries -= caretaker->getRedoStateCount(); // redo states are not journaled
+    delete caretaker;
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    std::cout << "Unreadable state stays in the history: "
+              << (refused && caretaker->getEntryCount() == entries ? "yes" : "no") << "\n";
+    delete caretaker;
+    std::remove("history_test.ocj");
+
+    // Nothing keeps the shapes of a paged-out state alive, not even for matching the next one
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    large.setSnapshotMode(SnapshotMode::DeepCopy);
+    auto shapesBefore = Metrics::shapesLive.get();
+    caretaker->addMemento(large.captureCurrent());
+    std::cout << "Paged-out state pins no shapes: " << (Metrics::shapesLive.get() == shapesBefore ? "yes" : "no") << "\n";
+    large.setSnapshotMode(SnapshotMode::Shared);
+    delete caretaker;
+    std::remove("history_test.ocj");
+
+    // Compaction keeps the records that live states still refer to in dropped frames
+    Canvas busy;
+    busy.addShape(new Rectangle(10, 10, "red", 0, 0));
+    busy.addShape(new Textbox(30, 10, "black", 5, 5, "kept from the first frame"));
+    caretaker = new CareTaker();
+    HistoryLimits limits;
+    limits.maxEntries = 3;
+    caretaker->setLimits(limits);
+    caretaker->setBackingFile("history_test.ocj", 0);
+    for (int i = 0; i < 80; ++i) {
+        busy.findShape(busy.view()[0]->getId())->setPosition(i, 0);
+        caretaker->addMemento(busy.captureCurrent());
+    }
+    delete caretaker;
+    size_t before = readFile("history_test.ocj").size();
+    caretaker = new CareTaker();
+    caretaker->setBackingFile("history_test.ocj", 0);
+    bool compacted = readFile("history_test.ocj").size() < before && caretaker->getEntryCount() == 3;
+    for (int i = 79; compacted && i >= 77; --i) {
+        compacted = caretaker->undoState(busy) && busy.view()[0]->getPositionX() == i &&
+            shapeCast<Textbox>(busy.view()[1])->getText() == "kept from the first frame";
+    }
+    std::cout << "Compacted journal restores shared records: " << (compacted ? "yes" : "no") << "\n";
+    delete caretaker;
+    std::remove("history_test.ocj");
+}
+
+// Test readers taking consistent snapshots while a writer keeps editing
+void testConcurrentCanvas() {
+    std::cout << "\n=== TESTING CONCURRENT CANVAS ===\n";
+
+    Canvas canvas;
+    canvas.setConcurrent(true);
+    for (int i = 0; i < 50; ++i) {
+        canvas.addShape(new Square(4, "red", 0, i * 5));
+    }
+
+    // The writer moves every shape in one locked step, so a consistent snapshot
+    // always has all of them at the same x
+    std::atomic<bool> done(false);
+    std::thread writer([&canvas, &done]() {
+        for (int step = 1; step <= 500; ++step) {
+            std::unique_lock<std::recursive_mutex> lock = canvas.lockWrites();
+            std::vector<Shape*> shapes = canvas.getShapes();
+            for (size_t i = 0; i < shapes.size(); ++i) {
+                shapes[i]->setPositionX(step);
+            }
+        }
+        canvas.addShape(new Square(4, "blue", 500, 0));
+        done = true;
+    });
+
+    std::atomic<bool> consistent(true);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r) {
+        readers.push_back(std::thread([&canvas, &done, &consistent]() {
+            while (!done) {
+                std::shared_ptr<const Canvas> view = canvas.read();
+                int x = view->view()[0]->getPositionX();
+                view->forEach([&consistent, x](const Shape& shape) {
+                    if (shape.getPositionX() != x) {
+                        consistent = false;
+                    }
+                });
+            }
+        }));
+    }
+    writer.join();
+    for (size_t r = 0; r < readers.size(); ++r) {
+        readers[r].join();
+    }
+
+    std::shared_ptr<const Canvas> latest = canvas.read();
+    std::cout << "Snapshots consistent: " << (consistent ? "yes" : "no") << "\n";
+    std::cout << "Latest snapshot has " << latest->size() << " shapes, reused: "
+              << (canvas.read() == latest ? "yes" : "no") << "\n";
+
+    // A writer capturing under its own lock gets its latest edit, not the published snapshot
+    Memento* captured;
+    {
+        std::unique_lock<std::recursive_mutex> lock = canvas.lockWrites();
+        canvas.findShape(canvas.view()[0]->getId())->setPositionX(-7);
+        captured = canvas.captureCurrent();
+    }
+    std::cout << "Capture under the write lock sees the edit: "
+              << (captured->getSavedState()[0]->getPositionX() == -7 ? "yes" : "no") << "\n";
+    delete captured;
+
+    // Snapshots share the dirty log's chunks and keep their own revision of it
+    std::vector<Bounds> regions;
+    unsigned long revision = latest->getDirtyLog().getRevision();
+    for (size_t i = 0; i < 2 * DirtyLog::maxRegions; ++i) {
+        std::unique_lock<std::recursive_mutex> lock = canvas.lockWrites();
+        canvas.findShape(canvas.view()[1]->getId())->setPositionX(static_cast<int>(i));
+    }
+    bool kept = latest->getDirtyLog().getRevision() == revision &&
+        latest->getDirtyLog().collect(revision - 10, regions) && regions.size() == 10;
+    std::cout << "Snapshot dirty log unchanged by later edits: " << (kept ? "yes" : "no")
+              << ", live log forgot them: " << (canvas.getDirtyLog().collect(revision, regions) ? "no" : "yes") << "\n";
+
+    // Re-publishing after one edit shares every other twin, and a reader on another
+    // thread gets the last publish while the lock is held instead of waiting
+    for (int i = 0; i < 1000; ++i) {
+        canvas.addShape(new Square(2, "green", i, -i));
+    }
+    std::shared_ptr<const Canvas> before = canvas.read();
+    std::shared_ptr<const Canvas> during;
+    std::vector<const Shape*> previous = before->getShapes();
+    {
+        std::unique_lock<std::recursive_mutex> lock = canvas.lockWrites();
+        canvas.findShape(canvas.view()[500]->getId())->setPositionY(1);
+        std::thread reader([&canvas, &during]() { during = canvas.read(); });
+        reader.join();
+    }
+    std::vector<const Shape*> after = canvas.read()->getShapes();
+    size_t shared = 0;
+    for (size_t i = 0; i < after.size(); ++i) {
+        shared += after[i] == previous[i] ? 1 : 0;
+    }
+    std::cout << "Republished twins shared: " << shared << " of " << after.size()
+              << ", read under a held lock: " << (during == before ? "last publish" : "waited") << "\n";
+}
+
+// Exporter that stays in its first step until released, standing in for a long export
+class HeldExporter : public ExportCanvas {
+private:
+    std::promise<void>* started;
+    std::shared_future<void> release;
+
+public:
+    HeldExporter(std::promise<void>* s, std::shared_future<void> r) : ExportCanvas(NULL), started(s), release(r) {}
+    void prepareCanvas() override {
+        started->set_value();
+        release.wait();
+    }
+    void renderElements() override {}
+    void saveToFile() override {}
+};
+
+// Test many documents sharing one engine, each keeping its own order
+void testCanvasEngine() {
+    std::cout << "\n=== TESTING CANVAS ENGINE ===\n";
+
+    CanvasEngine engine(4);
+    std::vector<DocumentId> ids;
+    std::vector<std::vector<int>> seen(8);
+    for (int d = 0; d < 8; ++d) {
+        ids.push_back(engine.open());
+    }
+    for (int i = 0; i < 200; ++i) {
+        for (int d = 0; d < 8; ++d) {
+            std::vector<int>* log = &seen[d];
+            engine.post(ids[d], [log, i](Canvas& canvas, CareTaker&) {
+                log->push_back(i);
+                if (i % 50 == 0) {
+                    canvas.addShape(new Square(10, "red", i, i));
+                }
+            });
+        }
+    }
+    std::future<std::shared_ptr<const Canvas>> frozen = engine.snapshot(ids[0]);
+    PNGExporter exporter(NULL);
+    exporter.setOutputPath("engine_test.png");
+    std::future<bool> exported = engine.exportDocument(ids[1], &exporter);
+    engine.waitIdle();
+
+    bool ordered = true;
+    for (int d = 0; d < 8; ++d) {
+        ordered = ordered && seen[d].size() == 200;
+        for (size_t i = 0; ordered && i < seen[d].size(); ++i) {
+            ordered = seen[d][i] == static_cast<int>(i);
+        }
+    }
+    std::cout << "Per-document order kept: " << (ordered ? "yes" : "no") << "\n";
+    std::cout << "Snapshot after posted edits has " << frozen.get()->size() << " shapes\n";
+    std::cout << "Export through engine: " << (exported.get() ? "yes" : "no") << "\n";
+    bool refused = engine.close(ids[0]) && !engine.post(ids[0], [](Canvas&, CareTaker&) {});
+    std::cout << "Post to closed document: " << (refused ? "refused" : "accepted") << "\n";
+    std::remove("engine_test.png");
+
+    // A long export must not hold the only worker the other documents are queued on
+    CanvasEngine single(1);
+    DocumentId slow = single.open();
+    DocumentId other = single.open();
+    std::promise<void> started;
+    std::promise<void> gate;
+    HeldExporter held(&started, gate.get_future().share());
+    std::future<bool> holding = single.exportDocument(slow, &held);
+    started.get_future().wait();
+    single.post(other, [](Canvas& canvas, CareTaker&) { canvas.addShape(new Square(5, "blue", 1, 1)); });
+    std::future<std::shared_ptr<const Canvas>> passed = single.snapshot(other);
+    bool ran = passed.wait_for(std::chrono::seconds(5)) == std::future_status::ready && passed.get()->size() == 1;
+    gate.set_value();
+    holding.wait();
+    std::cout << "Other document ran during a long export: " << (ran ? "yes" : "no") << "\n";
+
+    LoopbackResult result = LoopbackDriver(engine).run(2, 4, 200);
+    std::cout << "Loopback ran " << result.operations << " operations on " << result.documents << " documents\n";
+    std::cout << "Documents left open: " << engine.getDocumentCount() << "\n";
+}
+
+// Test creating shapes from parameter arrays and adding them in one step
+void testBulkCreation() {
+    std::cout << "\n=== TESTING BULK CREATION ===\n";
+
+    const size_t count = 1000;
+    std::vector<int> lengths(count), xs(count), ys(count);
+    std::vector<unsigned> colours(count);
+    unsigned red = ColourPalette::global().intern("red")->id;
+    unsigned blue = ColourPalette::global().intern("blue")->id;
+    for (size_t i = 0; i < count; ++i) {
+        lengths[i] = 5 + static_cast<int>(i % 7);
+        xs[i] = static_cast<int>(i) * 3;
+        ys[i] = -static_cast<int>(i);
+        colours[i] = i < count / 2 ? red : blue;
+    }
+
+    Canvas canvas;
+    canvas.setArenaEnabled(true);
+    canvas.setSpatialIndexEnabled(true);
+    SquareFactory squares;
+    squares.setAllocator(canvas.getAllocator());
+    ShapeBatch batch;
+    batch.count = count;
+    batch.lengths = lengths.data();
+    batch.positionsX = xs.data();
+    batch.positionsY = ys.data();
+    batch.colours = colours.data();
+    canvas.addShapes(squares.createShapes(batch));
+
+    const Shape* last = canvas.view()[count - 1];
+    std::cout << "Canvas size: " << canvas.size() << ", last square: " << last->getLength() << "x" << last->getWidth()
+              << " at " << last->getPositionX() << "," << last->getPositionY() << " " << last->getColour() << "\n";
+    std::cout << "Ids consecutive: " << (last->getId() == canvas.view()[0]->getId() + count - 1 ? "yes" : "no") << "\n";
+    std::cout << "Indexed: " << canvas.queryRect(Bounds::of(0, -10, 10, 11)).size() << " shapes near the origin\n";
+
+    SharedText texts[2] = { "first", "a label too long to keep inline" };
+    TextboxFactory boxes;
+    ShapeBatch labels;
+    labels.count = 2;
+    labels.texts = texts;
+    std::vector<Shape*> created = boxes.createShapes(labels);
+    canvas.addShapes(created);
+    std::cout << "Textbox text: " << static_cast<Textbox*>(created[1])->getText() << ", colour " << created[1]->getColour()
+              << ", buffer shared: " << (shapeCast<Textbox>(created[1])->getTextView().data() == texts[1].data() ? "yes" : "no") << "\n";
+}
+
+// Test dispatching on the kind tag instead of virtual calls and dynamic_cast
+void testTagDispatch() {
+    std::cout << "\n=== TESTING TAG DISPATCH ===\n";
+
+    Rectangle rect(4, 2, "red", 0, 0);
+    Square square(3, "blue", 1, 1);
+    Textbox box(10, 5, "black", 2, 2, "tagged");
+    const Shape* shapes[3] = { &rect, &square, &box };
+
+    for (int i = 0; i < 3; ++i) {
+        std::string name = visitShape(*shapes[i], [](const auto& product) -> std::string {
+            typedef typename std::decay<decltype(product)>::type Product;
+            return Product::staticKind == ShapeKind::Rectangle ? "Rectangle"
+                 : Product::staticKind == ShapeKind::Square ? "Square" : "Textbox";
+        });
+        std::cout << name << " bytes match: " << (shapeByteSize(*shapes[i]) == shapes[i]->getByteSize() ? "yes" : "no") << "\n";
+    }
+
+    std::cout << "Square as Textbox: " << (shapeCast<Textbox>(shapes[1]) == NULL ? "NULL" : "cast") << "\n";
+    std::cout << "Textbox text via cast: " << shapeCast<Textbox>(shapes[2])->getText() << "\n";
+
+    Shape* copy = cloneShape(box);
+    std::cout << "Tag clone keeps kind and text: "
+              << (copy->getKind() == ShapeKind::Textbox && shapeCast<Textbox>(copy)->getText() == "tagged" ? "yes" : "no") << "\n";
+    copy->release();
+}
+
+// Keeps what reaches it, the logging thread is the only writer
+class CapturingSink : public LogSink {
+public:
+    std::vector<std::string> lines;
+    std::vector<unsigned long> sequences;
+
+    void write(const LogRecord& record) override {
+        lines.push_back(std::string(Log::getLevelName(record.level)) + " " + record.component + ": " + record.message);
+        sequences.push_back(record.sequence);
+    }
+};
+
+void testLogging() {
+    std::cout << "\n=== TESTING LOGGING ===\n";
+
+    CapturingSink sink;
+    Log::setSink(&sink);
+    Log::setLevel(LogLevel::Info);
+    std::cout << "Debug enabled at Info: " << (Log::isEnabled(LogLevel::Debug) ? "yes" : "no") << "\n";
+    std::cout << "Error enabled at Info: " << (Log::isEnabled(LogLevel::Error) ? "yes" : "no") << "\n";
+
+    Log::write(LogLevel::Info, "test", "%d shapes in %s", 3, "board");
+#if OPENCANVAS_LOGGING
+    Canvas canvas;
+    canvas.undoAction(NULL);
+    OPENCANVAS_LOG(LogLevel::Debug, "test", "filtered out");
+#else
+    Log::write(LogLevel::Warning, "canvas", "cannot undo, no memento provided");
+#endif
+    Log::flush();
+    for (size_t i = 0; i < sink.lines.size(); ++i) {
+        std::cout << "Captured: " << sink.lines[i] << "\n";
+    }
+
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.push_back(std::thread([t]() {
+            for (int i = 0; i < 500; ++i) {
+                Log::write(LogLevel::Info, "writer", "thread %d message %d", t, i);
+            }
+        }));
+    }
+    for (size_t t = 0; t < writers.size(); ++t) {
+        writers[t].join();
+    }
+    Log::flush();
+    bool ordered = std::is_sorted(sink.sequences.begin(), sink.sequences.end());
+    std::cout << "Delivered or dropped all writes: "
+              << (sink.lines.size() - 2 + Log::getDroppedCount() == 2000 ? "yes" : "no") << "\n";
+    std::cout << "Delivered in order: " << (ordered ? "yes" : "no") << "\n";
+
+    Log::setLevel(LogLevel::Warning);
+    Log::setSink(NULL);
+}
+
+void testMetrics() {
+    std::cout << "\n=== TESTING METRICS ===\n";
+
+    MetricsSnapshot before = Metrics::snapshot();
+    {
+        Canvas canvas;
+        canvas.addShape(new Rectangle(4, 2, "red", 0, 0));
+        canvas.addShape(new Square(3, "blue", 5, 5));
+        canvas.addShape(new Textbox(10, 4, "black", 1, 8, "metered"));
+        std::cout << "Live shapes went up by 3: "
+                  << (Metrics::shapesLive.get() - before.getCounter("shapes.live") == 3 ? "yes" : "no") << "\n";
+
+        CareTaker caretaker;
+        caretaker.addMemento(canvas.captureCurrent());
+        std::cout << "History bytes counted: " << (Metrics::historyBytes.get() > before.getCounter("history.bytes") ? "yes" : "no") << "\n";
+        Memento* last = caretaker.getLastMemento();
+        canvas.undoAction(last);
+        delete last;
+
+        PDFExporter exporter(&canvas);
+        exporter.exportCanvas();
+    }
+    MetricsSnapshot after = Metrics::snapshot();
+    std::cout << "Shapes and mementos all released: "
+              << (after.getCounter("shapes.live") == before.getCounter("shapes.live")
+                  && after.getCounter("mementos.live") == before.getCounter("mementos.live") ? "yes" : "no") << "\n";
+    std::cout << "History bytes back to start: " << (after.getCounter("history.bytes") == before.getCounter("history.bytes") ? "yes" : "no") << "\n";
+    std::cout << "Clones performed: " << after.getCounter("shapes.cloned") - before.getCounter("shapes.cloned") << "\n";
+
+    const char* timed[] = { "canvas.capture_ns", "canvas.undo_ns", "caretaker.get_last_memento_ns",
+                            "export.prepare_ns", "export.render_ns", "export.save_ns" };
+    bool eachOnce = true;
+    for (int i = 0; i < 6; ++i) {
+        eachOnce = eachOnce && after.getHistogram(timed[i])->count == before.getHistogram(timed[i])->count + 1;
+    }
+    std::cout << "Each operation timed once: " << (eachOnce ? "yes" : "no") << "\n";
+
+    // Counts from threads that have exited are kept
+    Counter events = Metrics::counter("test.events");
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t) {
+        workers.push_back(std::thread([events]() {
+            for (int i = 0; i < 1000; ++i) {
+                events.increment();
+            }
+        }));
+    }
+    for (size_t t = 0; t < workers.size(); ++t) {
+        workers[t].join();
+    }
+    std::cout << "Counted across threads: " << events.get() << "\n";
+    std::cout << "Same name, same counter: " << (Metrics::counter("test.events").getSlot() == events.getSlot() ? "yes" : "no") << "\n";
+
+    Histogram& sizes = Metrics::histogram("test.sizes");
+    for (unsigned long long v = 1; v <= 100000; ++v) {
+        sizes.record(v);
+    }
+    unsigned long long median = sizes.percentile(0.5);
+    std::cout << "Median within 1/32: " << (median >= 50000 - 50000 / 32 && median <= 50000 + 50000 / 32 ? "yes" : "no") << "\n";
+    std::cout << "Max exact: " << sizes.getMax() << "\n";
+
+    std::ostringstream dumped;
+    Metrics::dump(dumped);
+    std::cout << "Dump lists histograms: " << (dumped.str().find("test.sizes count=100000") != std::string::npos ? "yes" : "no") << "\n";
+}
+
+void testMoveUndo() {
+    std::cout << "\n=== TESTING MOVE UNDO ===\n";
+
+    Canvas deep;
+    deep.setSnapshotMode(SnapshotMode::DeepCopy);
+    deep.addShape(new Rectangle(4, 2, "red", 0, 0));
+    deep.addShape(new Square(3, "blue", 5, 5));
+    deep.addShape(new Textbox(10, 4, "black", 1, 8, "before"));
+    Memento* saved = deep.captureCurrent();
+    std::cout << "Saved state is a view: " << (saved->getSavedState().begin() == saved->getSavedState().begin() ? "yes" : "no") << "\n";
+
+    deep.findShape(deep.view()[0]->getId())->setPosition(40, 40);
+    deep.removeShape(1);
+    deep.addShape(new Square(7, "green", 9, 9));
+
+    long long clones = Metrics::clonesPerformed.get();
+    deep.undoAction(std::unique_ptr<Memento>(saved));
+    std::cout << "Clones during move undo: " << Metrics::clonesPerformed.get() - clones << "\n";
+    std::cout << "Restored: " << deep.size() << " shapes, first at " << deep.view()[0]->getPositionX()
+              << ", text " << shapeCast<Textbox>(deep.view()[2])->getText() << "\n";
+    std::cout << "Found by id: " << (deep.findShape(deep.view()[1]->getId()) == deep.view()[1] ? "yes" : "no") << "\n";
+
+    // Shared mode: unchanged shapes stay, the edited one gets its twin back
+    Canvas shared;
+    shared.addShape(new Rectangle(4, 2, "red", 0, 0));
+    shared.addShape(new Square(3, "blue", 5, 5));
+    const Shape* untouched = shared.view()[1];
+    Memento* before = shared.captureCurrent();
+    shared.findShape(shared.view()[0]->getId())->setColour("purple");
+
+    clones = Metrics::clonesPerformed.get();
+    shared.undoAction(std::unique_ptr<Memento>(before));
+    std::cout << "Clones during shared move undo: " << Metrics::clonesPerformed.get() - clones << "\n";
+    std::cout << "Untouched shape kept: " << (shared.view()[1] == untouched ? "yes" : "no") << "\n";
+    std::cout << "Edited shape colour: " << shared.view()[0]->getColour() << "\n";
+
+    // The pointer overload leaves the memento usable
+    Memento* kept = shared.captureCurrent();
+    shared.findShape(shared.view()[0]->getId())->setColour("green");
+    shared.undoAction(kept);
+    shared.undoAction(kept);
+    std::cout << "Memento kept after copy undo: " << kept->getSavedState().size() << " shapes\n";
+    delete kept;
+}
+
+void testParallelCapture() {
+    std::cout << "\n=== TESTING PARALLEL CAPTURE ===\n";
+
+    Canvas canvas;
+    canvas.setSnapshotMode(SnapshotMode::DeepCopy);
+    std::vector<Shape*> added;
+    for (int i = 0; i < 20000; ++i) {
+        if (i % 3 == 0) added.push_back(new Rectangle(i % 50 + 1, 2, "red", i, -i));
+        else if (i % 3 == 1) added.push_back(new Square(i % 40 + 1, "blue", -i, i));
+        else added.push_back(new Textbox(10, 4, "black", i, i, "box " + std::to_string(i)));
+    }
+    canvas.addShapes(added);
+
+    canvas.setSnapshotThreads(1);
+    Memento* serial = canvas.captureCurrent();
+    canvas.setSnapshotThreads(4);
+    Memento* parallel = canvas.captureCurrent();
+
+    ShapeView a = serial->getSavedState();
+    ShapeView b = parallel->getSavedState();
+    bool same = a.size() == b.size();
+    for (size_t i = 0; same && i < a.size(); ++i) {
+        same = a[i]->getId() == b[i]->getId() && a[i]->getPositionX() == b[i]->getPositionX()
+            && a[i]->getLength() == b[i]->getLength() && a[i] != b[i]
+            && (a[i]->getKind() != ShapeKind::Textbox || shapeCast<Textbox>(a[i])->getText() == shapeCast<Textbox>(b[i])->getText());
+    }
+    std::cout << "Parallel capture matches serial, in order: " << (same ? "yes" : "no") << "\n";
+    std::cout << "Same byte count: " << (serial->getByteSize() == parallel->getByteSize() ? "yes" : "no") << "\n";
+    delete serial;
+
+    canvas.findShape(canvas.view()[0]->getId())->setPosition(-1, -1);
+    canvas.undoAction(std::unique_ptr<Memento>(parallel));
+    std::cout << "Undo from parallel capture: " << canvas.size() << " shapes, first at " << canvas.view()[0]->getPositionX() << "\n";
+
+    // Shared mode: the twins made in parallel are reused by the next capture
+    canvas.setSnapshotMode(SnapshotMode::Shared);
+    Memento* first = canvas.captureCurrent();
+    Memento* second = canvas.captureCurrent();
+    std::cout << "Parallel twins shared: " << (first->getSavedState()[12345] == second->getSavedState()[12345] ? "yes" : "no") << "\n";
+    delete first;
+    delete second;
+}
+
+void testSharedText() {
+    std::cout << "\n=== TESTING SHARED TEXT ===\n";
+
+    std::string body(2000, 'n');
+    Textbox note(20, 10, "yellow", 0, 0, body);
+    Shape* copy = cloneShape(note);
+    const Textbox* cloned = shapeCast<Textbox>(copy);
+    std::cout << "Clone shares the buffer: " << (cloned->getSharedText().data() == note.getSharedText().data() ? "yes" : "no") << "\n";
+    std::cout << "View matches: " << (cloned->getTextView() == body ? "yes" : "no") << "\n";
+    std::cout << "Each holder counts half: " << (note.getSharedText().getHeapBytes() * 2 <= body.size() + 16 ? "yes" : "no") << "\n";
+
+    note.setText("short note");
+    std::cout << "Clone kept its text: " << (cloned->getTextView().size() == 2000 ? "yes" : "no") << "\n";
+    std::cout << "Buffer no longer shared: " << (cloned->getSharedText().isShared() ? "no" : "yes") << "\n";
+    std::cout << "Short text inline: " << (note.getSharedText().getHeapBytes() == 0 ? "yes" : "no") << ", " << note.getText() << "\n";
+    copy->release();
+
+    // Saved states share the text with the canvas until it is changed
+    Canvas canvas;
+    canvas.setSnapshotMode(SnapshotMode::DeepCopy);
+    canvas.addShape(new Textbox(20, 10, "yellow", 0, 0, body));
+    Memento* saved = canvas.captureCurrent();
+    const Textbox* live = shapeCast<Textbox>(canvas.view()[0]);
+    const Textbox* kept = shapeCast<Textbox>(saved->getSavedState()[0]);
+    std::cout << "Memento shares the text: " << (live->getTextView().data() == kept->getTextView().data() ? "yes" : "no") << "\n";
+    canvas.findShape(live->getId())->setColour("red");
+    shapeCast<Textbox>(canvas.findShape(live->getId()))->setText("edited");
+    canvas.undoAction(std::unique_ptr<Memento>(saved));
+    std::cout << "Restored text length: " << shapeCast<Textbox>(canvas.view()[0])->getTextView().size() << "\n";
+
+    // Journaled edits and the store hold the same buffers as the textbox
+    CareTaker journal;
+    Canvas edited;
+    edited.setShapeStoreEnabled(true);
+    edited.setJournal(&journal);
+    edited.addShape(new Textbox(20, 10, "yellow", 0, 0, "first"));
+    Textbox* box = shapeCast<Textbox>(edited.findShape(edited.view()[0]->getId()));
+    size_t bytesBefore = journal.getHistoryBytes();
+    box->setText(body);
+    std::cout << "Store shares the text: " << (edited.getShapeStore()->getText(box->getId())->data() == box->getTextView().data() ? "yes" : "no") << "\n";
+    std::cout << "Edit charged a share of the body: " << (journal.getHistoryBytes() - bytesBefore < body.size() ? "yes" : "no") << "\n";
+    journal.undoEdit(edited);
+    std::cout << "Undo text: " << box->getText() << "\n";
+    journal.redoEdit(edited);
+    std::cout << "Redo text length: " << box->getTextView().size() << "\n";
+    edited.setJournal(NULL);
+}
+
 int main() {
     testFactoryMethod();
     testPrototypePattern();
@@ -392,6 +1723,30 @@ int main() {
     testEmptyMementoOperations();
     testCareTakerMultipleOperations();
     testCloneEdgeCases();
+    testSharedSnapshots();
+    testDeltaJournal();
+    testBoundedHistory();
+    testShapeStore();
+    testColourPalette();
+    testShapeAllocators();
+    testSpatialIndex();
+    testShapeViews();
+    testRasterExport();
+    testPdfExport();
+    testAsyncExport();
+    testBatchExport();
+    testIncrementalExport();
+    testBinaryFiles();
+    testPersistentHistory();
+    testConcurrentCanvas();
+    testCanvasEngine();
+    testBulkCreation();
+    testTagDispatch();
+    testLogging();
+    testMetrics();
+    testMoveUndo();
+    testParallelCapture();
+    testSharedText();
     
     return 0;
 }
\ No newline at end of file